@@ -1,9 +1,19 @@
-/* BTRFS deduplication of file blocks
+/* Block-level deduplication of file extents
+ * This uses the generic FIDEDUPERANGE ioctl, so it works on any Linux
+ * filesystem that can share extents (btrfs, XFS with reflink, ...).
+ * The kernel compares and shares at most DEDUPE_CHUNK bytes per call and
+ * takes a limited number of destinations at once, so each set is walked
+ * in chunk-sized ranges and large sets are split into batches.
+ *
+ * An ioctl can block for a long time while the kernel reads and compares
+ * both files, so up to dedupe_jobs sets are worked on at once. Messages
+ * for a set are collected while it runs and written out together when it
+ * is done so that the output of different sets never gets mixed up.
  * This file is part of jdupes; see jdupes.c for license information */
 
 #include "jdupes.h"
 
-#ifdef ENABLE_BTRFS
+#ifdef ENABLE_DEDUPE
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -11,162 +21,380 @@
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <unistd.h>
+#ifndef NO_THREADS
+#include <pthread.h>
+#endif
 
-#include <linux/btrfs.h>
+#include <linux/fs.h>
 #include <sys/ioctl.h>
+#include "jody_win_unicode.h"
+#include "threadpool.h"
+#include "path_intern.h"
 #include "act_dedupefiles.h"
 
-/* Message to append to BTRFS warnings based on write permissions */
+/* Largest range the kernel will dedupe in one call */
+#define DEDUPE_CHUNK (16 * 1024 * 1024)
+/* Destinations per call; the kernel wants the arguments in one page */
+#define DEDUPE_MAX_DESTS 127
+
+/* Message to append to dedupe warnings based on write permissions */
 static const char *readonly_msg[] = {
    "",
    " (no write permission)"
 };
 
-static char *dedupeerrstr(int err) {
-  static char buf[256];
+/* A destination file and how far it has been deduplicated */
+struct dedupe_dest {
+  file_t *file;
+  int fd;
+  int readonly;
+  int failed;
+  uintmax_t bytes;
+  off_t offset;
+};
+
+/* Output of one set, held back until the set is finished */
+struct dedupe_report {
+  FILE *out;
+  FILE *err;
+  char *outbuf;
+  char *errbuf;
+  size_t outlen;
+  size_t errlen;
+};
+
+/* Number of sets to dedupe at the same time */
+unsigned int dedupe_jobs = DEDUPE_JOBS_DEFAULT;
 
-  buf[sizeof(buf)-1] = '\0';
-  if (err == BTRFS_SAME_DATA_DIFFERS) {
-    snprintf(buf, sizeof(buf), "BTRFS_SAME_DATA_DIFFERS (data modified in the meantime?)");
+/* Totals for the final report; only updated atomically */
+static unsigned int total_files = 0;
+static uintmax_t total_bytes = 0;
+
+#ifndef NO_THREADS
+static pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static const char *dedupeerrstr(const int err, char * const restrict buf, const size_t size) {
+  buf[size - 1] = '\0';
+  if (err == FILE_DEDUPE_RANGE_DIFFERS) {
+    snprintf(buf, size, "FILE_DEDUPE_RANGE_DIFFERS (data modified in the meantime?)");
     return buf;
   } else if (err < 0) {
     return strerror(-err);
   } else {
-    snprintf(buf, sizeof(buf), "Unknown error %d", err);
+    snprintf(buf, size, "Unknown error %d", err);
     return buf;
   }
 }
 
-extern void dedupefiles(file_t * restrict files)
+
+static void report_open(struct dedupe_report * const restrict report)
 {
-  struct btrfs_ioctl_same_args *same;
-  char **dupe_filenames; /* maps to same->info indices */
+  report->out = open_memstream(&report->outbuf, &report->outlen);
+  report->err = open_memstream(&report->errbuf, &report->errlen);
+  if (report->out == NULL || report->err == NULL) oom("report_open()");
+  return;
+}
 
-  file_t *curfile;
-  unsigned int n_dupes, max_dupes, cur_info;
-  unsigned int cur_file = 0, max_files, total_files = 0;
 
-  int fd;
-  int ret, status, readonly;
+/* Write out everything a set had to say in one piece */
+static void report_flush(struct dedupe_report * const restrict report)
+{
+  fclose(report->out);
+  fclose(report->err);
+#ifndef NO_THREADS
+  pthread_mutex_lock(&report_lock);
+#endif
+  if (report->outlen > 0) {
+    fwrite(report->outbuf, 1, report->outlen, stdout);
+    fflush(stdout);
+  }
+  if (report->errlen > 0) fwrite(report->errbuf, 1, report->errlen, stderr);
+#ifndef NO_THREADS
+  pthread_mutex_unlock(&report_lock);
+#endif
+  free(report->outbuf);
+  free(report->errbuf);
+  return;
+}
 
-  LOUD(fprintf(stderr, "\nRunning dedupefiles()\n");)
 
-  /* Find the largest dupe set, alloc space to hold structs for it */
-  get_max_dupes(files, &max_dupes, &max_files);
-  /* Kernel dupe count is a uint16_t so exit if the type's limit is exceeded */
-  if (max_dupes > 65535) {
-    fprintf(stderr, "Largest duplicate set (%d) exceeds the 65535-file dedupe limit.\n", max_dupes);
-    fprintf(stderr, "Ask the program author to add this feature if you really need it. Exiting!\n");
-    exit(EXIT_FAILURE);
+/* Open a destination file; returns -1 if it can't be opened at all */
+static int open_dest(struct dedupe_dest * const restrict dest, FILE * const restrict err)
+{
+  char path[FILE_PATH_SIZE];
+  int errno2;
+
+  file_path(dest->file, path);
+  dest->readonly = 0;
+  if (access(path, W_OK) != 0) dest->readonly = 1;
+  dest->fd = open(path, O_RDWR);
+  LOUD(fprintf(stderr, "opening loop: open('%s', O_RDWR) [%d]\n", path, dest->fd);)
+
+  /* If read-write open fails, privileged users can dedupe in read-only mode */
+  if (dest->fd == -1) {
+    /* Preserve errno in case read-only fallback fails */
+    LOUD(fprintf(stderr, "opening loop: open('%s', O_RDWR) failed: %s\n", path, strerror(errno));)
+    errno2 = errno;
+    dest->fd = open(path, O_RDONLY);
+    if (dest->fd == -1) {
+      LOUD(fprintf(stderr, "opening loop: fallback open('%s', O_RDONLY) failed: %s\n", path, strerror(errno));)
+      fprintf(err, "Unable to open '%s': %s%s\n", path,
+          strerror(errno2), readonly_msg[dest->readonly]);
+      return -1;
+    }
+    LOUD(fprintf(stderr, "opening loop: fallback open('%s', O_RDONLY) succeeded\n", path);)
   }
-  same = calloc(sizeof(struct btrfs_ioctl_same_args) +
-                sizeof(struct btrfs_ioctl_same_extent_info) * max_dupes, 1);
-  dupe_filenames = malloc(max_dupes * sizeof(char *));
-  LOUD(fprintf(stderr, "dedupefiles structs: alloc1 size %lu => %p, alloc2 size %lu => %p\n",
-        sizeof(struct btrfs_ioctl_same_args) + sizeof(struct btrfs_ioctl_same_extent_info) * max_dupes,
-        (void *)same, max_dupes * sizeof(char *), (void *)dupe_filenames);)
-  if (!same || !dupe_filenames) oom("dedupefiles() structures");
-
-  /* Main dedupe loop */
-  while (files) {
-    if (ISFLAG(files->flags, F_HAS_DUPES) && files->size) {
-      cur_file++;
-      if (!ISFLAG(flags, F_HIDEPROGRESS)) {
-        fprintf(stderr, "Dedupe [%u/%u] %u%% \r", cur_file, max_files,
-            cur_file * 100 / max_files);
-      }
+  return dest->fd;
+}
 
-      /* Open each file to be deduplicated */
-      cur_info = 0;
-      for (curfile = files->duplicates; curfile; curfile = curfile->duplicates) {
-        int errno2;
 
-        /* Never allow hard links to be passed to dedupe */
-        if (curfile->device == files->device && curfile->inode == files->inode) {
-          LOUD(fprintf(stderr, "skipping hard linked file pair: '%s' = '%s'\n", curfile->d_name, files->d_name);)
-          continue;
-        }
+/* Dedupe a batch of open destinations against the source, one chunk of
+ * the file at a time. Each destination carries on from wherever the
+ * kernel stopped for it, so a short result is retried rather than
+ * skipped. A destination that fails is dropped from the remaining
+ * chunks; the ones that are left keep going. */
+static void dedupe_batch(const file_t * const restrict head, const int srcfd,
+                struct dedupe_dest * const restrict dests, const unsigned int count,
+                struct file_dedupe_range * const restrict range, FILE * const restrict err)
+{
+  char errbuf[256];
+  char src_path[FILE_PATH_SIZE], dest_path[FILE_PATH_SIZE];
+  unsigned int map[DEDUPE_MAX_DESTS];
+  unsigned int i, n;
+  uint64_t length;
+  off_t offset;
+  int status;
 
-        dupe_filenames[cur_info] = curfile->d_name;
-        readonly = 0;
-        if (access(curfile->d_name, W_OK) != 0) readonly = 1;
-        fd = open(curfile->d_name, O_RDWR);
-        LOUD(fprintf(stderr, "opening loop: open('%s', O_RDWR) [%d]\n", curfile->d_name, fd);)
-
-        /* If read-write open fails, privileged users can dedupe in read-only mode */
-        if (fd == -1) {
-          /* Preserve errno in case read-only fallback fails */
-          LOUD(fprintf(stderr, "opening loop: open('%s', O_RDWR) failed: %s\n", curfile->d_name, strerror(errno));)
-          errno2 = errno;
-          fd = open(curfile->d_name, O_RDONLY);
-          if (fd == -1) {
-            LOUD(fprintf(stderr, "opening loop: fallback open('%s', O_RDONLY) failed: %s\n", curfile->d_name, strerror(errno));)
-            fprintf(stderr, "Unable to open '%s': %s%s\n", curfile->d_name,
-                strerror(errno2), readonly_msg[readonly]);
-            continue;
-          }
-          LOUD(fprintf(stderr, "opening loop: fallback open('%s', O_RDONLY) succeeded\n", curfile->d_name);)
-        }
+  for (i = 0; i < count; i++) dests[i].offset = 0;
 
-        same->info[cur_info].fd = fd;
-        same->info[cur_info].logical_offset = 0;
-        cur_info++;
-        total_files++;
-      }
-      n_dupes = cur_info;
+  while (1) {
+    /* Destinations that are furthest behind go next */
+    offset = head->size;
+    for (i = 0; i < count; i++)
+      if (!dests[i].failed && dests[i].offset < offset) offset = dests[i].offset;
+    if (offset == head->size) return;
+    length = (uint64_t)(head->size - offset);
+    if (length > DEDUPE_CHUNK) length = DEDUPE_CHUNK;
+
+    n = 0;
+    for (i = 0; i < count; i++) {
+      if (dests[i].failed || dests[i].offset != offset) continue;
+      memset(&range->info[n], 0, sizeof(struct file_dedupe_range_info));
+      range->info[n].dest_fd = dests[i].fd;
+      range->info[n].dest_offset = (uint64_t)offset;
+      map[n] = i;
+      n++;
+    }
+    if (n == 0) return;
+
+    range->src_offset = (uint64_t)offset;
+    range->src_length = length;
+    range->dest_count = (uint16_t)n;
+    range->reserved1 = 0;
+    range->reserved2 = 0;
+
+    LOUD(fprintf(stderr, "dedupe: ioctl('%s', FIDEDUPERANGE) offset %" PRIdMAX " length %" PRIuMAX " dests %u\n",
+          head->name, (intmax_t)offset, (uintmax_t)length, n);)
+    if (ioctl(srcfd, FIDEDUPERANGE, range) != 0) {
+      fprintf(err, "dedupe failed against file '%s' (%u matches): %s\n", file_path(head, src_path), n, strerror(errno));
+      for (i = 0; i < n; i++) dests[map[i]].failed = 1;
+      return;
+    }
 
-      same->logical_offset = 0;
-      same->length = (unsigned long)files->size;
-      same->dest_count = (uint16_t)n_dupes;  /* kernel type is __u16 */
+    for (i = 0; i < n; i++) {
+      struct dedupe_dest * const dest = &dests[map[i]];
 
-      fd = open(files->d_name, O_RDONLY);
-      LOUD(fprintf(stderr, "source: open('%s', O_RDONLY) [%d]\n", files->d_name, fd);)
-      if (fd == -1) {
-        fprintf(stderr, "unable to open(\"%s\", O_RDONLY): %s\n", files->d_name, strerror(errno));
-        goto cleanup;
+      status = range->info[i].status;
+      dest->bytes += range->info[i].bytes_deduped;
+      if (status != FILE_DEDUPE_RANGE_SAME) {
+        dest->failed = 1;
+        file_path(head, src_path);
+        file_path(dest->file, dest_path);
+        if (dest->bytes == 0) {
+          fprintf(err, "warning: dedupe failed: %s => %s: %s [%d]%s\n",
+            src_path, dest_path, dedupeerrstr(status, errbuf, sizeof(errbuf)),
+            status, readonly_msg[dest->readonly]);
+        } else {
+          fprintf(err, "warning: dedupe only did %" PRIuMAX " bytes: %s => %s: %s [%d]%s\n",
+            dest->bytes, src_path, dest_path,
+            dedupeerrstr(status, errbuf, sizeof(errbuf)), status, readonly_msg[dest->readonly]);
+        }
+      } else if (range->info[i].bytes_deduped == 0) {
+        /* No progress at all; asking again would loop forever */
+        dest->failed = 1;
+        fprintf(err, "warning: dedupe stopped at %" PRIuMAX " of %" PRIdMAX " bytes: %s => %s\n",
+            dest->bytes, (intmax_t)head->size, file_path(head, src_path), file_path(dest->file, dest_path));
+      } else {
+        LOUD(if (range->info[i].bytes_deduped < length)
+              fprintf(stderr, "dedupe: '%s' short by %" PRIuMAX " bytes at offset %" PRIdMAX "\n",
+              dest->file->name, (uintmax_t)(length - range->info[i].bytes_deduped), (intmax_t)offset);)
+        dest->offset += (off_t)range->info[i].bytes_deduped;
       }
+    }
+  }
+  return;
+}
+
+
+/* Dedupe every file of one set against the first file */
+extern void dedupefiles_set(file_t * restrict head)
+{
+  struct dedupe_report report;
+  struct file_dedupe_range *range;
+  struct dedupe_dest *dests;
+  file_t *curfile;
+  unsigned int count;
+  int srcfd;
+  char src_path[FILE_PATH_SIZE], path[FILE_PATH_SIZE];
+
+  if (head == NULL) nullptr("dedupefiles_set()");
+  /* It is completely useless to dedupe zero-length extents */
+  if (head->size == 0) return;
+
+  range = (struct file_dedupe_range *)calloc(sizeof(struct file_dedupe_range) +
+                sizeof(struct file_dedupe_range_info) * DEDUPE_MAX_DESTS, 1);
+  dests = (struct dedupe_dest *)malloc(sizeof(struct dedupe_dest) * DEDUPE_MAX_DESTS);
+  if (!range || !dests) oom("dedupefiles_set() structures");
+  report_open(&report);
 
-      /* Call dedupe ioctl to pass the files to the kernel */
-      ret = ioctl(fd, BTRFS_IOC_FILE_EXTENT_SAME, same);
-      LOUD(fprintf(stderr, "dedupe: ioctl('%s' [%d], BTRFS_IOC_FILE_EXTENT_SAME, same) => %d\n", files->d_name, fd, ret);)
-      if (close(fd) == -1) fprintf(stderr, "Unable to close(\"%s\"): %s\n", files->d_name, strerror(errno));
+  file_path(head, src_path);
+  srcfd = open(src_path, O_RDONLY);
+  LOUD(fprintf(stderr, "source: open('%s', O_RDONLY) [%d]\n", src_path, srcfd);)
+  if (srcfd == -1) {
+    fprintf(report.err, "unable to open(\"%s\", O_RDONLY): %s\n", src_path, strerror(errno));
+    goto cleanup;
+  }
+  if (!ISFLAG(flags, F_HIDEPROGRESS)) {
+    fprintf(report.out, "[SRC] "); fwprint(report.out, src_path, 1);
+  }
 
-      if (ret < 0) {
-        fprintf(stderr, "dedupe failed against file '%s' (%d matches): %s\n", files->d_name, n_dupes, strerror(errno));
-        goto cleanup;
+  curfile = head->duplicates;
+  while (curfile != NULL) {
+    /* Open the next batch of files to be deduplicated */
+    for (count = 0; curfile != NULL && count < DEDUPE_MAX_DESTS; curfile = curfile->duplicates) {
+      /* Never allow hard links to be passed to dedupe */
+      if (curfile->device == head->device && curfile->inode == head->inode) {
+        LOUD(fprintf(stderr, "skipping hard linked file pair: '%s' = '%s'\n", curfile->name, head->name);)
+        continue;
       }
+      dests[count].file = curfile;
+      dests[count].failed = 0;
+      dests[count].bytes = 0;
+      if (open_dest(&dests[count], report.err) == -1) continue;
+      count++;
+    }
 
-      for (cur_info = 0; cur_info < n_dupes; cur_info++) {
-        status = same->info[cur_info].status;
-        if (status != 0) {
-          if (same->info[cur_info].bytes_deduped == 0) {
-            fprintf(stderr, "warning: dedupe failed: %s => %s: %s [%d]%s\n",
-              files->d_name, dupe_filenames[cur_info], dedupeerrstr(status),
-              status, readonly_msg[readonly]);
-          } else {
-            fprintf(stderr, "warning: dedupe only did %" PRIdMAX " bytes: %s => %s: %s [%d]%s\n",
-              (intmax_t)same->info[cur_info].bytes_deduped, files->d_name,
-              dupe_filenames[cur_info], dedupeerrstr(status), status, readonly_msg[readonly]);
-          }
-        }
+    dedupe_batch(head, srcfd, dests, count, range, report.err);
+
+    for (unsigned int i = 0; i < count; i++) {
+      if (!ISFLAG(flags, F_HIDEPROGRESS)) {
+        fprintf(report.out, "%s ", dests[i].failed ? "-//->" : "-##->");
+        fwprint(report.out, file_path(dests[i].file, path), 1);
+      }
+      __atomic_add_fetch(&total_files, 1, __ATOMIC_RELAXED);
+      __atomic_add_fetch(&total_bytes, dests[i].bytes, __ATOMIC_RELAXED);
+      if (close(dests[i].fd) == -1) {
+        fprintf(report.err, "unable to close(\"%s\"): %s", file_path(dests[i].file, path),
+          strerror(errno));
       }
+    }
+  }
+
+  if (close(srcfd) == -1) fprintf(report.err, "Unable to close(\"%s\"): %s\n", src_path, strerror(errno));
+  if (!ISFLAG(flags, F_HIDEPROGRESS)) fprintf(report.out, "\n");
 
 cleanup:
-      for (cur_info = 0; cur_info < n_dupes; cur_info++) {
-        if (close((int)same->info[cur_info].fd) == -1) {
-          fprintf(stderr, "unable to close(\"%s\"): %s", dupe_filenames[cur_info],
-            strerror(errno));
-        }
-      }
+  report_flush(&report);
+  free(range);
+  free(dests);
+  return;
+}
+
+
+static void dedupe_worker(void * const ctx, const size_t item, const unsigned int thread)
+{
+  file_t ** const heads = (file_t **)ctx;
+
+  (void)thread;
+  dedupefiles_set(heads[item]);
+  return;
+}
+
+
+/* A set and the bytes deduping it could save, worked out once per set */
+struct set_bytes {
+  uintmax_t bytes;
+  file_t *head;
+};
 
-    } /* has dupes */
 
-    files = files->next;
+/* Biggest savings first, so that a huge set doesn't start last and run
+ * on its own after everything else has finished */
+static int sort_sets_by_bytes(const void *a, const void *b)
+{
+  const struct set_bytes * const sa = (const struct set_bytes *)a;
+  const struct set_bytes * const sb = (const struct set_bytes *)b;
+
+  if (sa->bytes > sb->bytes) return -1;
+  if (sa->bytes < sb->bytes) return 1;
+  return 0;
+}
+
+
+/* Dedupe a number of sets, up to dedupe_jobs of them at once */
+extern void dedupefiles_sets(file_t ** const restrict heads, const size_t count)
+{
+  struct set_bytes *sets;
+
+  if (heads == NULL) nullptr("dedupefiles_sets()");
+  if (count == 0) return;
+  if (dedupe_jobs > 1) {
+    sets = (struct set_bytes *)malloc(sizeof(struct set_bytes) * count);
+    if (sets == NULL) oom("dedupefiles_sets()");
+    for (size_t i = 0; i < count; i++) {
+      sets[i].bytes = 0;
+      sets[i].head = heads[i];
+      for (const file_t *f = heads[i]->duplicates; f != NULL; f = f->duplicates)
+        sets[i].bytes += (uintmax_t)heads[i]->size;
+    }
+    qsort(sets, count, sizeof(struct set_bytes), sort_sets_by_bytes);
+    for (size_t i = 0; i < count; i++) heads[i] = sets[i].head;
+    free(sets);
   }
+  pool_run(dedupe_jobs, count, dedupe_worker, heads);
+  return;
+}
+
+
+extern void dedupefiles_report(void)
+{
+  if (!ISFLAG(flags, F_HIDEPROGRESS))
+    fprintf(stderr, "Deduplication done (%u files processed, %" PRIuMAX " bytes deduplicated)\n",
+        total_files, total_bytes);
+  return;
+}
+
+
+extern void dedupefiles(file_t * restrict files)
+{
+  file_t **heads;
+  size_t count = 0;
+
+  LOUD(fprintf(stderr, "\nRunning dedupefiles()\n");)
+
+  for (file_t *f = files; f != NULL; f = f->next)
+    if (ISFLAG(f->flags, F_HAS_DUPES) && f->size) count++;
+  heads = (file_t **)malloc(sizeof(file_t *) * (count + 1));
+  if (heads == NULL) oom("dedupefiles()");
+  count = 0;
+  for (file_t *f = files; f != NULL; f = f->next)
+    if (ISFLAG(f->flags, F_HAS_DUPES) && f->size) heads[count++] = f;
 
-  if (!ISFLAG(flags, F_HIDEPROGRESS)) fprintf(stderr, "Deduplication done (%d files processed)\n", total_files);
-  free(same);
-  free(dupe_filenames);
+  dedupefiles_sets(heads, count);
+  free(heads);
+  dedupefiles_report();
   return;
 }
-#endif /* ENABLE_BTRFS */
+#endif /* ENABLE_DEDUPE */
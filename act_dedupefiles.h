@@ -1,4 +1,4 @@
-/* jdupes action for BTRFS block-level deduplication
+/* jdupes action for block-level deduplication
  * This file is part of jdupes; see jdupes.c for license information */
 
 #ifndef ACT_DEDUPEFILES_H
@@ -9,6 +9,14 @@ extern "C" {
 #endif
 
 #include "jdupes.h"
+
+#define DEDUPE_JOBS_DEFAULT 4
+
+extern unsigned int dedupe_jobs;
+
+extern void dedupefiles_set(file_t * restrict head);
+extern void dedupefiles_sets(file_t ** const restrict heads, const size_t count);
+extern void dedupefiles_report(void);
 extern void dedupefiles(file_t * restrict files);
 
 #ifdef __cplusplus
@@ -8,8 +8,77 @@
 #include <string.h>
 #include "jdupes.h"
 #include "jody_win_unicode.h"
+#include "path_intern.h"
 #include "act_deletefiles.h"
 
+/* Delete every file in dupelist[1..counter] that is not marked in preserve[] */
+static void delete_unpreserved(file_t ** const restrict dupelist,
+                const unsigned int * const restrict preserve, const unsigned int counter)
+{
+  char path[FILE_PATH_SIZE];
+  unsigned int x;
+
+  for (x = 1; x <= counter; x++) {
+    file_path(dupelist[x], path);
+    if (preserve[x]) {
+      printf("   [+] "); fwprint(stdout, path, 1);
+    } else {
+#ifdef UNICODE
+      if (!M2W(path, wstr)) {
+        printf("   [!] "); fwprint(stdout, path, 0);
+        printf("-- MultiByteToWideChar failed\n");
+        continue;
+      }
+#endif
+      if (file_has_changed(dupelist[x])) {
+        printf("   [!] "); fwprint(stdout, path, 0);
+        printf("-- file changed since being scanned\n");
+#ifdef UNICODE
+      } else if (DeleteFile(wstr) != 0) {
+#else
+      } else if (remove(path) == 0) {
+#endif
+        printf("   [-] "); fwprint(stdout, path, 1);
+      } else {
+        printf("   [!] "); fwprint(stdout, path, 0);
+        printf("-- unable to delete file\n");
+      }
+    }
+  }
+  return;
+}
+
+
+/* Delete all but the first file of one set without prompting */
+extern void deletefiles_set(file_t * restrict head)
+{
+  file_t **dupelist;
+  unsigned int *preserve;
+  unsigned int counter = 1, x;
+
+  if (head == NULL) nullptr("deletefiles_set()");
+
+  for (file_t *tmpfile = head->duplicates; tmpfile != NULL; tmpfile = tmpfile->duplicates) counter++;
+  dupelist = (file_t **) malloc(sizeof(file_t*) * (counter + 1));
+  preserve = (unsigned int *) malloc(sizeof(int) * (counter + 1));
+  if (!dupelist || !preserve) oom("deletefiles_set() structures");
+
+  x = 1;
+  for (file_t *tmpfile = head; tmpfile != NULL; tmpfile = tmpfile->duplicates) {
+    dupelist[x] = tmpfile;
+    preserve[x] = (x == 1);
+    x++;
+  }
+
+  printf("\n");
+  delete_unpreserved(dupelist, preserve, counter);
+  printf("\n");
+  free(dupelist);
+  free(preserve);
+  return;
+}
+
+
 extern void deletefiles(file_t *files, int prompt, FILE *tty)
 {
   unsigned int counter, groups;
@@ -20,6 +89,7 @@ extern void deletefiles(file_t *files, int prompt, FILE *tty)
   char *preservestr;
   char *token;
   char *tstr;
+  char path[FILE_PATH_SIZE];
   unsigned int number, sum, max, x;
   size_t i;
 
@@ -40,7 +110,7 @@ extern void deletefiles(file_t *files, int prompt, FILE *tty)
       dupelist[counter] = files;
 
       if (prompt) {
-        printf("[%u] ", counter); fwprint(stdout, files->d_name, 1);
+        printf("[%u] ", counter); fwprint(stdout, file_path(files, path), 1);
       }
 
       tmpfile = files->duplicates;
@@ -48,7 +118,7 @@ extern void deletefiles(file_t *files, int prompt, FILE *tty)
       while (tmpfile) {
         dupelist[++counter] = tmpfile;
         if (prompt) {
-          printf("[%u] ", counter); fwprint(stdout, tmpfile->d_name, 1);
+          printf("[%u] ", counter); fwprint(stdout, file_path(tmpfile, path), 1);
         }
         tmpfile = tmpfile->duplicates;
       }
@@ -109,32 +179,7 @@ preserve_none:
 
       printf("\n");
 
-      for (x = 1; x <= counter; x++) {
-        if (preserve[x]) {
-          printf("   [+] "); fwprint(stdout, dupelist[x]->d_name, 1);
-        } else {
-#ifdef UNICODE
-          if (!M2W(dupelist[x]->d_name, wstr)) {
-            printf("   [!] "); fwprint(stdout, dupelist[x]->d_name, 0);
-            printf("-- MultiByteToWideChar failed\n");
-            continue;
-          }
-#endif
-          if (file_has_changed(dupelist[x])) {
-            printf("   [!] "); fwprint(stdout, dupelist[x]->d_name, 0);
-            printf("-- file changed since being scanned\n");
-#ifdef UNICODE
-          } else if (DeleteFile(wstr) != 0) {
-#else
-          } else if (remove(dupelist[x]->d_name) == 0) {
-#endif
-            printf("   [-] "); fwprint(stdout, dupelist[x]->d_name, 1);
-          } else {
-            printf("   [!] "); fwprint(stdout, dupelist[x]->d_name, 0);
-            printf("-- unable to delete file\n");
-          }
-        }
-      }
+      delete_unpreserved(dupelist, preserve, counter);
       printf("\n");
     }
   }
@@ -9,6 +9,7 @@ extern "C" {
 #endif
 
 #include "jdupes.h"
+extern void deletefiles_set(file_t * restrict head);
 extern void deletefiles(file_t *files, int prompt, FILE *tty);
 
 #ifdef __cplusplus
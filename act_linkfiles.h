@@ -9,6 +9,7 @@ extern "C" {
 #endif
 
 #include "jdupes.h"
+extern void linkfiles_set(file_t * restrict head, const int hard);
 extern void linkfiles(file_t *files, const int hard);
 
 #ifdef __cplusplus
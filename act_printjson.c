@@ -0,0 +1,137 @@
+/* Print matched file sets as JSON or NDJSON
+ * Each set is one object with the size and hash shared by the set and
+ * the path, device, inode, and mtime of every file in it. With --json
+ * the sets are elements of one array; with --ndjson each set is written
+ * on a line of its own. Sets are written (and flushed) one at a time as
+ * soon as they are final.
+ *
+ * The output is plain ASCII: everything outside of printable ASCII in a
+ * path is written as a \u escape. Bytes that aren't valid UTF-8 are
+ * written as the lone surrogates U+DC80 to U+DCFF, the same mapping as
+ * Python's "surrogateescape", so that no file name is ever lost.
+ * This file is part of jdupes; see jdupes.c for license information */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include "jdupes.h"
+#include "hash_provider.h"
+#include "path_intern.h"
+#include "act_printjson.h"
+
+static int json_lines = 0;
+static int json_sets = 0;
+
+
+/* Decode one UTF-8 sequence; returns its length or 0 if it is invalid */
+static int utf8_decode(const unsigned char * const restrict p, uint32_t * const restrict cp)
+{
+  int len, i;
+
+  if (p[0] < 0x80) {
+    *cp = p[0];
+    return 1;
+  }
+  if (p[0] >= 0xc2 && p[0] <= 0xdf) { len = 2; *cp = p[0] & 0x1f; }
+  else if (p[0] >= 0xe0 && p[0] <= 0xef) { len = 3; *cp = p[0] & 0x0f; }
+  else if (p[0] >= 0xf0 && p[0] <= 0xf4) { len = 4; *cp = p[0] & 0x07; }
+  else return 0;
+
+  for (i = 1; i < len; i++) {
+    if ((p[i] & 0xc0) != 0x80) return 0;
+    *cp = (*cp << 6) | (p[i] & 0x3f);
+  }
+  /* Reject overlong forms, surrogates, and anything past U+10FFFF */
+  if ((len == 3 && *cp < 0x800) || (len == 4 && *cp < 0x10000)
+      || (*cp >= 0xd800 && *cp <= 0xdfff) || *cp > 0x10ffff) return 0;
+  return len;
+}
+
+
+static void json_string(const char * const restrict str)
+{
+  const unsigned char *p = (const unsigned char *)str;
+  uint32_t cp;
+  int len;
+
+  putchar('"');
+  while (*p != '\0') {
+    len = utf8_decode(p, &cp);
+    if (len == 0) {
+      /* Not UTF-8; keep the raw byte */
+      printf("\\u%04x", 0xdc00 | *p);
+      p++;
+      continue;
+    }
+    p += len;
+    switch (cp) {
+      case '"': fputs("\\\"", stdout); break;
+      case '\\': fputs("\\\\", stdout); break;
+      case '\n': fputs("\\n", stdout); break;
+      case '\r': fputs("\\r", stdout); break;
+      case '\t': fputs("\\t", stdout); break;
+      default:
+        if (cp >= 0x20 && cp < 0x7f) putchar((int)cp);
+        else if (cp < 0x10000) printf("\\u%04x", (unsigned int)cp);
+        else {
+          cp -= 0x10000;
+          printf("\\u%04x\\u%04x", (unsigned int)(0xd800 | (cp >> 10)),
+              (unsigned int)(0xdc00 | (cp & 0x3ff)));
+        }
+        break;
+    }
+  }
+  putchar('"');
+  return;
+}
+
+
+extern void printjson_start(const int ndjson)
+{
+  json_lines = ndjson;
+  json_sets = 0;
+  if (!json_lines) printf("[");
+  return;
+}
+
+
+/* Print one duplicate set, given the first file in it */
+extern void printjson_set(const file_t * restrict head)
+{
+  char path[FILE_PATH_SIZE];
+
+  if (head == NULL) nullptr("printjson_set()");
+
+  if (!json_lines) printf("%s\n  ", json_sets ? "," : "");
+  json_sets++;
+
+  printf("{\"size\": %" PRIdMAX ", \"hash\": ", (intmax_t)head->size);
+  /* Sets matched without hashing (hard links with -H) have no hash */
+  if (ISFLAG(head->flags, F_HASH_FULL)) {
+    printf("\"%s:%016" PRIxMAX, hash_provider->name, (uintmax_t)head->filehash);
+#ifdef WIDE_HASH
+    if (hash_provider->wide) printf("%016" PRIx64, head->filehash_ext);
+#endif
+    putchar('"');
+  } else printf("null");
+  printf(", \"files\": [");
+
+  for (const file_t *f = head; f != NULL; f = f->duplicates) {
+    printf("%s{\"path\": ", (f == head) ? "" : ", ");
+    json_string(file_path(f, path));
+    printf(", \"device\": %" PRIuMAX ", \"inode\": %" PRIuMAX ", \"mtime\": %" PRIdMAX "}",
+        (uintmax_t)f->device, (uintmax_t)f->inode, (intmax_t)f->mtime);
+  }
+  printf("]}");
+  if (json_lines) putchar('\n');
+  fflush(stdout);
+  return;
+}
+
+
+extern void printjson_end(void)
+{
+  if (!json_lines) printf("%s]\n", json_sets ? "\n" : "");
+  fflush(stdout);
+  return;
+}
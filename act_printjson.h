@@ -0,0 +1,20 @@
+/* jdupes action for printing matched file sets as JSON or NDJSON
+ * This file is part of jdupes; see jdupes.c for license information */
+
+#ifndef ACT_PRINTJSON_H
+#define ACT_PRINTJSON_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "jdupes.h"
+extern void printjson_start(const int ndjson);
+extern void printjson_set(const file_t * restrict head);
+extern void printjson_end(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ACT_PRINTJSON_H */
@@ -6,28 +6,40 @@
 #include <inttypes.h>
 #include "jdupes.h"
 #include "jody_win_unicode.h"
+#include "path_intern.h"
 #include "act_printmatches.h"
 
+/* Print one set of matches, given the first file in the set */
+extern void printmatches_set(const file_t * restrict head)
+{
+  const file_t * restrict tmpfile;
+  char path[FILE_PATH_SIZE];
+
+  if (head == NULL) nullptr("printmatches_set()");
+
+  if (!ISFLAG(flags, F_OMITFIRST)) {
+    if (ISFLAG(flags, F_SHOWSIZE)) printf("%" PRIdMAX " byte%c each:\n", (intmax_t)head->size,
+     (head->size != 1) ? 's' : ' ');
+    fwprint(stdout, file_path(head, path), 1);
+  }
+  tmpfile = head->duplicates;
+  while (tmpfile != NULL) {
+    fwprint(stdout, file_path(tmpfile, path), 1);
+    tmpfile = tmpfile->duplicates;
+  }
+  return;
+}
+
+
 extern void printmatches(file_t * restrict files)
 {
-  file_t * restrict tmpfile;
   int printed = 0;
 
   while (files != NULL) {
     if (ISFLAG(files->flags, F_HAS_DUPES)) {
       printed = 1;
-      if (!ISFLAG(flags, F_OMITFIRST)) {
-        if (ISFLAG(flags, F_SHOWSIZE)) printf("%" PRIdMAX " byte%c each:\n", (intmax_t)files->size,
-         (files->size != 1) ? 's' : ' ');
-        fwprint(stdout, files->d_name, 1);
-      }
-      tmpfile = files->duplicates;
-      while (tmpfile != NULL) {
-        fwprint(stdout, tmpfile->d_name, 1);
-        tmpfile = tmpfile->duplicates;
-      }
+      printmatches_set(files);
       if (files->next != NULL) fwprint(stdout, "", 1);
-
     }
 
     files = files->next;
@@ -9,6 +9,7 @@ extern "C" {
 #endif
 
 #include "jdupes.h"
+extern void printmatches_set(const file_t * restrict head);
 extern void printmatches(file_t * restrict files);
 
 #ifdef __cplusplus
@@ -0,0 +1,171 @@
+/* Replace duplicate files with copy-on-write clones (reflinks)
+ * Each duplicate keeps its own inode, owner, permissions and times but
+ * its data is replaced by a FICLONE of the first file in the set, so the
+ * filesystem shares the blocks. Unlike hard links, the files stay
+ * separate: writing to one of them later doesn't change the others.
+ * This file is part of jdupes; see jdupes.c for license information */
+
+#include "jdupes.h"
+
+#ifdef ENABLE_DEDUPE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include "jody_win_unicode.h"
+#include "path_intern.h"
+#include "act_reflinkfiles.h"
+
+/* Devices whose filesystem turned out not to support FICLONE */
+static dev_t *noclone_devs = NULL;
+static size_t noclone_count = 0;
+
+
+static int can_clone(const dev_t device)
+{
+  for (size_t i = 0; i < noclone_count; i++) if (noclone_devs[i] == device) return 0;
+  return 1;
+}
+
+
+static void set_noclone(const dev_t device)
+{
+  dev_t *devs = (dev_t *)realloc(noclone_devs, sizeof(dev_t) * (noclone_count + 1));
+
+  if (devs == NULL) oom("set_noclone()");
+  noclone_devs = devs;
+  noclone_devs[noclone_count++] = device;
+  return;
+}
+
+
+/* Clone the source's data into one destination; returns 0 on success,
+ * or an errno value with the destination left as it was */
+static int clone_file(const int srcfd, const char * const restrict dest)
+{
+  struct stat st;
+  struct timespec times[2];
+  int fd, err = 0;
+
+  fd = open(dest, O_WRONLY);
+  if (fd == -1) return errno;
+  /* Keep the times the file had before its data was replaced */
+  if (fstat(fd, &st) != 0) {
+    err = errno;
+    goto close_dest;
+  }
+  times[0] = st.st_atim;
+  times[1] = st.st_mtim;
+
+  LOUD(fprintf(stderr, "reflink: ioctl('%s', FICLONE)\n", dest);)
+  if (ioctl(fd, FICLONE, srcfd) != 0) {
+    err = errno;
+    goto close_dest;
+  }
+  if (futimens(fd, times) != 0) {
+    fprintf(stderr, "warning: unable to restore times of '%s': %s\n", dest, strerror(errno));
+  }
+
+close_dest:
+  if (close(fd) != 0 && err == 0) err = errno;
+  return err;
+}
+
+
+/* Clone the first file of one set over every other file in it */
+extern void reflinkfiles_set(file_t * restrict head)
+{
+  file_t *dest;
+  int srcfd, err, i;
+  char src_path[FILE_PATH_SIZE], path[FILE_PATH_SIZE];
+
+  if (head == NULL) nullptr("reflinkfiles_set()");
+  if (head->size == 0) return;
+  /* The warning was already given for the first set on this device */
+  if (!can_clone(head->device)) return;
+  file_path(head, src_path);
+
+  i = file_has_changed(head);
+  if (i) {
+    fprintf(stderr, "warning: source file modified since scanned, not cloning:\n[SRC] ");
+    fwprint(stderr, src_path, 1);
+    LOUD(fprintf(stderr, "file_has_changed: %d\n", i);)
+    return;
+  }
+  srcfd = open(src_path, O_RDONLY);
+  if (srcfd == -1) {
+    fprintf(stderr, "warning: unable to open source file, not cloning: %s\n[SRC] ", strerror(errno));
+    fwprint(stderr, src_path, 1);
+    return;
+  }
+  if (!ISFLAG(flags, F_HIDEPROGRESS)) {
+    printf("[SRC] "); fwprint(stdout, src_path, 1);
+  }
+
+  for (dest = head->duplicates; dest != NULL; dest = dest->duplicates) {
+    file_path(dest, path);
+    /* Hard links already share their data */
+    if (dest->device == head->device && dest->inode == head->inode) {
+      if (ISFLAG(flags, F_CONSIDERHARDLINKS) && !ISFLAG(flags, F_HIDEPROGRESS)) {
+        printf("-==-> "); fwprint(stdout, path, 1);
+      }
+      continue;
+    }
+    /* Cloning through a symlink would change the file it points to */
+    if (ISFLAG(dest->flags, F_IS_SYMLINK)) continue;
+    if (dest->device != head->device) {
+      fprintf(stderr, "warning: clone target on different device, not cloning:\n-//-> ");
+      fwprint(stderr, path, 1);
+      continue;
+    }
+    if (file_has_changed(dest)) {
+      fprintf(stderr, "warning: target file modified since scanned, not cloning:\n-//-> ");
+      fwprint(stderr, path, 1);
+      continue;
+    }
+
+    err = clone_file(srcfd, path);
+    if (err == 0) {
+      if (!ISFLAG(flags, F_HIDEPROGRESS)) {
+        printf("-++-> "); fwprint(stdout, path, 1);
+      }
+      continue;
+    }
+
+    if (!ISFLAG(flags, F_HIDEPROGRESS)) {
+      printf("-//-> "); fwprint(stdout, path, 1);
+    }
+    if (err == EOPNOTSUPP || err == ENOTTY) {
+      /* Nothing else on this filesystem can be cloned either; EINVAL and
+       * EXDEV can be about just this file, so they don't stop the set */
+      fprintf(stderr, "warning: filesystem of '%s' can't clone files (%s); remaining files not cloned\n",
+          src_path, strerror(err));
+      set_noclone(head->device);
+      break;
+    }
+    fprintf(stderr, "warning: unable to clone '"); fwprint(stderr, path, 0);
+    fprintf(stderr, "' from '"); fwprint(stderr, src_path, 0);
+    fprintf(stderr, "': %s\n", strerror(err));
+  }
+
+  if (close(srcfd) != 0) fprintf(stderr, "unable to close(\"%s\"): %s\n", src_path, strerror(errno));
+  if (!ISFLAG(flags, F_HIDEPROGRESS)) printf("\n");
+  return;
+}
+
+
+extern void reflinkfiles(file_t * restrict files)
+{
+  LOUD(fprintf(stderr, "\nRunning reflinkfiles()\n");)
+
+  for (; files != NULL; files = files->next)
+    if (ISFLAG(files->flags, F_HAS_DUPES)) reflinkfiles_set(files);
+  return;
+}
+#endif /* ENABLE_DEDUPE */
@@ -0,0 +1,19 @@
+/* jdupes action for copy-on-write cloning of duplicate files
+ * This file is part of jdupes; see jdupes.c for license information */
+
+#ifndef ACT_REFLINKFILES_H
+#define ACT_REFLINKFILES_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "jdupes.h"
+extern void reflinkfiles_set(file_t * restrict head);
+extern void reflinkfiles(file_t * restrict files);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ACT_REFLINKFILES_H */
@@ -7,27 +7,32 @@
 #include "jdupes.h"
 #include "act_summarize.h"
 
-extern void summarizematches(const file_t * restrict files)
+static unsigned int numsets = 0;
+static off_t numbytes = 0;
+static int numfiles = 0;
+
+
+/* Add one set of matches to the summary */
+extern void summarize_set(const file_t * restrict head)
 {
-  unsigned int numsets = 0;
-  off_t numbytes = 0;
-  int numfiles = 0;
+  const file_t *tmpfile;
 
-  while (files != NULL) {
-    file_t *tmpfile;
-
-    if (ISFLAG(files->flags, F_HAS_DUPES)) {
-      numsets++;
-      tmpfile = files->duplicates;
-      while (tmpfile != NULL) {
-        numfiles++;
-        numbytes += files->size;
-        tmpfile = tmpfile->duplicates;
-      }
-    }
-    files = files->next;
+  if (head == NULL) nullptr("summarize_set()");
+
+  numsets++;
+  tmpfile = head->duplicates;
+  while (tmpfile != NULL) {
+    numfiles++;
+    numbytes += head->size;
+    tmpfile = tmpfile->duplicates;
   }
+  return;
+}
 
+
+/* Print the summary of every set added so far */
+extern void summarize_print(void)
+{
   if (numsets == 0)
     printf("No duplicates found.\n");
   else
@@ -39,3 +44,14 @@ extern void summarizematches(const file_t * restrict files)
   }
   return;
 }
+
+
+extern void summarizematches(const file_t * restrict files)
+{
+  while (files != NULL) {
+    if (ISFLAG(files->flags, F_HAS_DUPES)) summarize_set(files);
+    files = files->next;
+  }
+  summarize_print();
+  return;
+}
@@ -9,6 +9,8 @@ extern "C" {
 #endif
 
 #include "jdupes.h"
+extern void summarize_set(const file_t * restrict head);
+extern void summarize_print(void);
 extern void summarizematches(const file_t * restrict files);
 
 #ifdef __cplusplus
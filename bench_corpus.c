@@ -0,0 +1,251 @@
+/* jdupes benchmark corpus generator
+ * Builds a reproducible tree of files for benchmarking: the same options
+ * and seed always give the same names, sizes and contents. A summary of
+ * the corpus is written to stdout as JSON for bench_run to include.
+ *
+ * Usage: bench_corpus [options] DIRECTORY
+ *
+ * -n COUNT      number of files (default 10000)
+ * -s MIN:MAX    file sizes, spread log-uniformly (default 0:64K);
+ *               K/M/G suffixes can be used
+ * -d RATIO      fraction of files that are copies of an earlier file
+ * -H RATIO      fraction of files that share the first HEADER_SIZE bytes
+ *               and the size of an earlier file but differ after that
+ * -D DEPTH      directory levels above the files (default 3)
+ * -w COUNT      files per directory (default 50)
+ * -S SEED       random seed (default 1)
+ *
+ * This file is part of jdupes; see jdupes.c for license information */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/* Same as jdupes' PARTIAL_HASH_SIZE: files sharing this much only differ
+ * once they are fully hashed */
+#define HEADER_SIZE 4096
+#define WRITE_SIZE 65536
+#define PATH_SIZE 4096
+
+struct spec {
+  uint64_t size;
+  uint64_t header_seed;
+  uint64_t body_seed;
+};
+
+
+/* splitmix64: small, fast, and the same everywhere */
+static uint64_t next_rand(uint64_t * const state)
+{
+  uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+
+static double rand_unit(uint64_t * const state)
+{
+  return (double)(next_rand(state) >> 11) / 9007199254740992.0;
+}
+
+
+static int parse_size(const char *str, uint64_t * const size)
+{
+  char *end;
+  unsigned long long n;
+
+  errno = 0;
+  n = strtoull(str, &end, 10);
+  if (errno != 0 || end == str) return -1;
+  switch (*end) {
+    case 'k': case 'K': n <<= 10; end++; break;
+    case 'm': case 'M': n <<= 20; end++; break;
+    case 'g': case 'G': n <<= 30; end++; break;
+    default: break;
+  }
+  if (*end != '\0' && *end != ':') return -1;
+  *size = (uint64_t)n;
+  return 0;
+}
+
+
+static double parse_ratio(const char *str)
+{
+  char *end;
+  double r = strtod(str, &end);
+
+  if (end == str || *end != '\0' || r < 0 || r > 1) {
+    fprintf(stderr, "bench_corpus: bad ratio '%s' (must be 0 to 1)\n", str);
+    exit(EXIT_FAILURE);
+  }
+  return r;
+}
+
+
+/* Fill buf with the bytes of a stream at 'offset'; the stream for a seed
+ * is a fixed sequence of 64-bit values */
+static void fill(unsigned char * const buf, const size_t len, const uint64_t seed, const uint64_t offset)
+{
+  uint64_t state = seed + (offset / 8) * 0x9e3779b97f4a7c15ULL, v;
+  size_t i = 0, skip = (size_t)(offset % 8);
+
+  while (i < len) {
+    v = next_rand(&state);
+    for (size_t b = skip; b < 8 && i < len; b++) buf[i++] = (unsigned char)(v >> (b * 8));
+    skip = 0;
+  }
+  return;
+}
+
+
+static void write_file(const char * const path, const struct spec * const s, unsigned char * const buf)
+{
+  FILE *fp;
+  uint64_t pos = 0, len;
+  size_t chunk;
+
+  fp = fopen(path, "wb");
+  if (fp == NULL) goto error;
+  while (pos < s->size) {
+    len = s->size - pos;
+    if (len > WRITE_SIZE) len = WRITE_SIZE;
+    /* Don't let a chunk cross from the header into the body */
+    if (pos < HEADER_SIZE && pos + len > HEADER_SIZE) len = HEADER_SIZE - pos;
+    chunk = (size_t)len;
+    fill(buf, chunk, (pos < HEADER_SIZE) ? s->header_seed : s->body_seed, pos);
+    if (fwrite(buf, 1, chunk, fp) != chunk) goto error;
+    pos += len;
+  }
+  if (fclose(fp) != 0) goto error_closed;
+  return;
+
+error:
+  if (fp != NULL) fclose(fp);
+error_closed:
+  fprintf(stderr, "bench_corpus: can't write '%s': %s\n", path, strerror(errno));
+  exit(EXIT_FAILURE);
+}
+
+
+/* Build the directory for a file, creating each level as needed */
+static void file_path(char * const path, const char * const root, const uint64_t file,
+                const unsigned int depth, const uint64_t per_dir)
+{
+  uint64_t dir = file / per_dir;
+  size_t len;
+
+  len = (size_t)snprintf(path, PATH_SIZE, "%s", root);
+  /* Each level holds up to 16 directories */
+  for (unsigned int level = depth; level > 0; level--) {
+    len += (size_t)snprintf(path + len, PATH_SIZE - len, "/%02x",
+        (unsigned int)((dir >> ((level - 1) * 4)) & 0xf));
+    if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+      fprintf(stderr, "bench_corpus: can't create '%s': %s\n", path, strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+  }
+  snprintf(path + len, PATH_SIZE - len, "/f%07" PRIu64, file);
+  return;
+}
+
+
+int main(int argc, char **argv)
+{
+  uint64_t count = 10000, size_min = 0, size_max = 65536, per_dir = 50, seed = 1, state;
+  uint64_t bytes = 0, dupes = 0, headers = 0;
+  double dup_ratio = 0.3, header_ratio = 0.1, r;
+  unsigned int depth = 3;
+  struct spec *specs;
+  unsigned char *buf;
+  char path[PATH_SIZE];
+  const char *colon;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n:s:d:H:D:w:S:")) != -1) {
+    switch (opt) {
+      case 'n': count = strtoull(optarg, NULL, 10); break;
+      case 's':
+        colon = strchr(optarg, ':');
+        if (colon == NULL || parse_size(optarg, &size_min) != 0
+            || parse_size(colon + 1, &size_max) != 0 || size_max < size_min) {
+          fprintf(stderr, "bench_corpus: bad size range '%s' (use MIN:MAX)\n", optarg);
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'd': dup_ratio = parse_ratio(optarg); break;
+      case 'H': header_ratio = parse_ratio(optarg); break;
+      case 'D': depth = (unsigned int)strtoul(optarg, NULL, 10); break;
+      case 'w': per_dir = strtoull(optarg, NULL, 10); break;
+      case 'S': seed = strtoull(optarg, NULL, 10); break;
+      default:
+        fprintf(stderr, "usage: bench_corpus [-n count] [-s min:max] [-d ratio] [-H ratio] [-D depth] [-w per_dir] [-S seed] DIRECTORY\n");
+        return EXIT_FAILURE;
+    }
+  }
+  if (optind != argc - 1) {
+    fprintf(stderr, "bench_corpus: a directory to create is required\n");
+    return EXIT_FAILURE;
+  }
+  if (dup_ratio + header_ratio > 1) {
+    fprintf(stderr, "bench_corpus: -d and -H together can't be more than 1\n");
+    return EXIT_FAILURE;
+  }
+  if (per_dir == 0) per_dir = 1;
+  if (depth > 16) depth = 16;
+  if (mkdir(argv[optind], 0755) != 0) {
+    fprintf(stderr, "bench_corpus: can't create '%s': %s\n", argv[optind], strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  specs = (struct spec *)malloc(sizeof(struct spec) * (count ? count : 1));
+  buf = (unsigned char *)malloc(WRITE_SIZE);
+  if (specs == NULL || buf == NULL) {
+    fprintf(stderr, "bench_corpus: out of memory\n");
+    return EXIT_FAILURE;
+  }
+
+  state = seed;
+  for (uint64_t i = 0; i < count; i++) {
+    struct spec * const s = &specs[i];
+    const struct spec *orig = (i > 0) ? &specs[next_rand(&state) % i] : NULL;
+
+    r = rand_unit(&state);
+    if (orig != NULL && r < dup_ratio) {
+      *s = *orig;
+      dupes++;
+    } else if (orig != NULL && r < dup_ratio + header_ratio && orig->size > HEADER_SIZE) {
+      s->size = orig->size;
+      s->header_seed = orig->header_seed;
+      s->body_seed = next_rand(&state);
+      headers++;
+    } else {
+      /* Log-uniform sizes: as many small files as big ones per decade */
+      s->size = (uint64_t)exp(log((double)size_min + 1)
+          + rand_unit(&state) * (log((double)size_max + 1) - log((double)size_min + 1))) - 1;
+      if (s->size > size_max) s->size = size_max;
+      s->header_seed = next_rand(&state);
+      s->body_seed = s->header_seed;
+    }
+    file_path(path, argv[optind], i, depth, per_dir);
+    write_file(path, s, buf);
+    bytes += s->size;
+  }
+
+  printf("{\"files\": %" PRIu64 ", \"size_min\": %" PRIu64 ", \"size_max\": %" PRIu64
+      ", \"dup_ratio\": %g, \"header_ratio\": %g, \"depth\": %u, \"files_per_dir\": %" PRIu64
+      ", \"seed\": %" PRIu64 ", \"bytes\": %" PRIu64 ", \"dup_files\": %" PRIu64
+      ", \"header_files\": %" PRIu64 "}\n",
+      count, size_min, size_max, dup_ratio, header_ratio, depth, per_dir, seed, bytes, dupes, headers);
+  free(specs);
+  free(buf);
+  return EXIT_SUCCESS;
+}
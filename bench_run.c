@@ -0,0 +1,300 @@
+/* jdupes benchmark runner
+ * Runs a jdupes binary against a directory in several configurations
+ * that each do one more phase of the work than the one before, and
+ * writes the results as JSON so that runs of different builds can be
+ * compared with diff. The time of a phase is the difference between
+ * the configuration that ends with it and the one before it.
+ *
+ * scan:   -x +0 excludes every file while scanning, so nothing is read
+ * hash:   --trust-hash hashes but never compares bytes
+ * verify: plain run, also comparing matching files byte for byte
+ * action: -L also hard links the duplicates
+ *
+ * All but the scan run use --hash=murmur3 so that they hash the same
+ * way. Builds without 128-bit hashes can't do the hash run, so they
+ * use the default hash and their verify phase also includes hashing.
+ * The action run changes the tree, so it runs once and comes last;
+ * every other configuration is run several times and the fastest run
+ * is kept.
+ *
+ * Usage: bench_run [-n RUNS] [-m CORPUS.json] [-s] [-x OPTION]... JDUPES DIR
+ *
+ * -x adds an option to every jdupes run (e.g. -x --threads=4). The
+ * read counts come from /proc/PID/io and are null where it is missing.
+ * -s runs jdupes with --stats=json and includes the per-phase statistics
+ * of each kept run; they are left out by default because timing every
+ * phase adds a little to the run times.
+ * This file is part of jdupes; see jdupes.c for license information */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#define MAX_EXTRA 32
+#define MAX_ARGS (MAX_EXTRA + 8)
+#define STATS_SIZE 4096
+
+struct result {
+  int status;         /* Exit status, or -1 if the run failed */
+  double wall, user, sys;
+  long maxrss;        /* KiB */
+  int have_io;
+  uint64_t rchar, read_bytes, syscr, syscw;
+  char stats[STATS_SIZE];  /* --stats=json output, or empty */
+};
+
+/* Writable copies so that they can go into execv()'s argv */
+static char opt_recurse[] = "-rq";
+static char opt_exclude[] = "-x", opt_all[] = "+0";
+static char opt_murmur3[] = "--hash=murmur3";
+static char opt_trust[] = "--trust-hash";
+static char opt_link[] = "-L";
+static char opt_stats[] = "--stats=json";
+
+struct config {
+  const char *name;
+  char *args[3];
+  int wide;  /* Hashes with murmur3 if the build has it */
+  int once;
+  int used_wide;
+  struct result best;
+};
+
+static struct config configs[] = {
+  { "scan",   { opt_exclude, opt_all, NULL }, 0, 0, 0, { 0 } },
+  { "hash",   { opt_trust, NULL, NULL }, 1, 0, 0, { 0 } },
+  { "verify", { NULL, NULL, NULL }, 1, 0, 0, { 0 } },
+  { "action", { opt_link, NULL, NULL }, 1, 1, 0, { 0 } },
+  { NULL, { NULL, NULL, NULL }, 0, 0, 0, { 0 } }
+};
+static int have_wide = 1;
+static int with_stats = 0;
+
+
+static double tv_sec(const struct timeval * const tv)
+{
+  return (double)tv->tv_sec + (double)tv->tv_usec / 1e6;
+}
+
+
+/* Read the I/O counters of a finished child that hasn't been reaped */
+static void read_proc_io(const pid_t pid, struct result * const res)
+{
+  char path[64], key[32];
+  unsigned long long value;
+  FILE *fp;
+
+  res->have_io = 0;
+  snprintf(path, sizeof(path), "/proc/%ld/io", (long)pid);
+  fp = fopen(path, "r");
+  if (fp == NULL) return;
+  while (fscanf(fp, "%31[^:]: %llu\n", key, &value) == 2) {
+    if (strcmp(key, "rchar") == 0) res->rchar = value;
+    else if (strcmp(key, "read_bytes") == 0) res->read_bytes = value;
+    else if (strcmp(key, "syscr") == 0) res->syscr = value;
+    else if (strcmp(key, "syscw") == 0) res->syscw = value;
+  }
+  fclose(fp);
+  res->have_io = 1;
+  return;
+}
+
+
+/* Keep the last JSON line jdupes wrote to stderr */
+static void read_stats(FILE * const fp, struct result * const res)
+{
+  char line[STATS_SIZE];
+  size_t len;
+
+  res->stats[0] = '\0';
+  rewind(fp);
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    if (line[0] != '{') continue;
+    len = strlen(line);
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) line[--len] = '\0';
+    memcpy(res->stats, line, len + 1);
+  }
+  return;
+}
+
+
+static void run_once(char * const * const argv, struct result * const res)
+{
+  struct timespec start, end;
+  struct rusage ru;
+  siginfo_t info;
+  int status, fd;
+  FILE *err = NULL;
+  pid_t pid;
+
+  memset(res, 0, sizeof(struct result));
+  res->status = -1;
+  if (with_stats && (err = tmpfile()) == NULL) return;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  pid = fork();
+  if (pid == -1) goto close_err;
+  if (pid == 0) {
+    fd = open("/dev/null", O_WRONLY);
+    if (fd != -1) {
+      dup2(fd, STDOUT_FILENO);
+      dup2((err != NULL) ? fileno(err) : fd, STDERR_FILENO);
+    }
+    execv(argv[0], argv);
+    _exit(127);
+  }
+
+  /* Wait without reaping so that /proc still has the child's counters */
+  if (waitid(P_PID, (id_t)pid, &info, WEXITED | WNOWAIT) == 0) read_proc_io(pid, res);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  if (wait4(pid, &status, 0, &ru) != pid) goto close_err;
+
+  res->status = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+  res->wall = (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+  res->user = tv_sec(&ru.ru_utime);
+  res->sys = tv_sec(&ru.ru_stime);
+  res->maxrss = ru.ru_maxrss;
+  if (err != NULL) read_stats(err, res);
+
+close_err:
+  if (err != NULL) fclose(err);
+  return;
+}
+
+
+static void print_result(const struct config * const c, char * const * const extra, const int nextra)
+{
+  const struct result * const r = &c->best;
+
+  printf("    \"%s\": {\"args\": \"%s", c->name, opt_recurse);
+  for (int i = 0; i < nextra; i++) printf(" %s", extra[i]);
+  if (c->used_wide) printf(" %s", opt_murmur3);
+  for (int i = 0; c->args[i] != NULL; i++) printf(" %s", c->args[i]);
+  if (with_stats) printf(" %s", opt_stats);
+  printf("\", \"status\": %d, \"wall\": %.6f, \"user\": %.6f, \"sys\": %.6f, \"maxrss_kib\": %ld",
+      r->status, r->wall, r->user, r->sys, r->maxrss);
+  if (r->have_io) printf(", \"rchar\": %" PRIu64 ", \"read_bytes\": %" PRIu64
+      ", \"syscr\": %" PRIu64 ", \"syscw\": %" PRIu64,
+      r->rchar, r->read_bytes, r->syscr, r->syscw);
+  else printf(", \"rchar\": null, \"read_bytes\": null, \"syscr\": null, \"syscw\": null");
+  if (with_stats) printf(", \"stats\": %s", (r->stats[0] != '\0') ? r->stats : "null");
+  printf("}");
+  return;
+}
+
+
+/* Copy the corpus summary written by bench_corpus into the output */
+static void print_file(const char * const name)
+{
+  char buf[4096];
+  size_t len;
+  FILE *fp;
+
+  fp = fopen(name, "r");
+  if (fp == NULL) {
+    printf("null");
+    return;
+  }
+  while ((len = fread(buf, 1, sizeof(buf), fp)) > 0) {
+    while (len > 0 && (buf[len - 1] == '\n' || buf[len - 1] == '\r')) len--;
+    fwrite(buf, 1, len, stdout);
+  }
+  fclose(fp);
+  return;
+}
+
+
+/* Phase time, or null if either configuration failed */
+static void print_phase(const char * const name, const struct config * const c,
+                const struct config * const prev, const int last)
+{
+  printf("    \"%s\": ", name);
+  if (c->best.status != 0 || (prev != NULL && prev->best.status != 0)) printf("null");
+  else printf("%.6f", c->best.wall - ((prev != NULL) ? prev->best.wall : 0));
+  printf("%s\n", last ? "" : ",");
+  return;
+}
+
+
+int main(int argc, char **argv)
+{
+  char *extra[MAX_EXTRA];
+  char *args[MAX_ARGS];
+  const char *manifest = NULL;
+  struct result res;
+  int runs = 3, nextra = 0, opt, n;
+  struct config *hash, *verify_prev;
+
+  while ((opt = getopt(argc, argv, "n:m:sx:")) != -1) {
+    switch (opt) {
+      case 'n': runs = atoi(optarg); if (runs < 1) runs = 1; break;
+      case 'm': manifest = optarg; break;
+      case 's': with_stats = 1; break;
+      case 'x':
+        if (nextra == MAX_EXTRA) {
+          fprintf(stderr, "bench_run: too many -x options\n");
+          return EXIT_FAILURE;
+        }
+        extra[nextra++] = optarg;
+        break;
+      default:
+        fprintf(stderr, "usage: bench_run [-n runs] [-m corpus.json] [-s] [-x option]... JDUPES DIRECTORY\n");
+        return EXIT_FAILURE;
+    }
+  }
+  if (optind != argc - 2) {
+    fprintf(stderr, "bench_run: a jdupes binary and a directory are required\n");
+    return EXIT_FAILURE;
+  }
+
+  for (struct config *c = configs; c->name != NULL; c++) {
+    n = 0;
+    args[n++] = argv[optind];
+    args[n++] = opt_recurse;
+    for (int i = 0; i < nextra; i++) args[n++] = extra[i];
+    c->used_wide = c->wide && have_wide;
+    if (c->used_wide) args[n++] = opt_murmur3;
+    for (int i = 0; c->args[i] != NULL; i++) args[n++] = c->args[i];
+    if (with_stats) args[n++] = opt_stats;
+    args[n++] = argv[optind + 1];
+    args[n] = NULL;
+
+    c->best.status = -1;
+    for (int i = 0; i < (c->once ? 1 : runs); i++) {
+      run_once(args, &res);
+      /* A successful run always beats a failed one */
+      if (i == 0 || (res.status == 0 && (c->best.status != 0 || res.wall < c->best.wall))) c->best = res;
+    }
+    fprintf(stderr, "bench_run: %s: %.3f s (status %d)\n", c->name, c->best.wall, c->best.status);
+    /* A failed hash run means the build has no 128-bit hashes */
+    if (c == &configs[1] && c->best.status != 0) have_wide = 0;
+  }
+
+  printf("{\n  \"jdupes\": \"%s\",\n  \"runs\": %d,\n  \"corpus\": ", argv[optind], runs);
+  if (manifest != NULL) print_file(manifest);
+  else printf("null");
+  printf(",\n  \"configs\": {\n");
+  for (struct config *c = configs; c->name != NULL; c++) {
+    print_result(c, extra, nextra);
+    printf("%s\n", (c[1].name != NULL) ? "," : "");
+  }
+  printf("  },\n  \"phases\": {\n");
+  hash = &configs[1];
+  /* Without the hash run, verify covers hashing too */
+  verify_prev = have_wide ? hash : &configs[0];
+  print_phase("scan", &configs[0], NULL, 0);
+  print_phase("hash", hash, &configs[0], 0);
+  print_phase("verify", &configs[2], verify_prev, 0);
+  print_phase("action", &configs[3], &configs[2], 1);
+  printf("  }\n}\n");
+  return EXIT_SUCCESS;
+}
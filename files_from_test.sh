@@ -0,0 +1,31 @@
+#!/bin/sh
+
+# Regression test for --files-from: a file that gets into the file list
+# twice must not be matched against itself. With -H both copies would be
+# "duplicates" and -d -N would delete the only copy of the file.
+# Run from the source directory after building jdupes.
+
+test ! -e ./jdupes && echo "Build jdupes first, silly" && exit 1
+
+JDUPES="$(pwd)/jdupes"
+ERR=0
+TMP="$(mktemp -d "${TMPDIR:-/tmp}/jdupes-files-from.XXXXXX")" || exit 1
+cd "$TMP" || exit 1
+
+mkdir t1 t2
+echo "only copy" > t1/only
+echo "another only copy" > t2/one
+
+# The same file listed twice, also spelled differently
+printf 't1/only\nt1/only\n./t1/only\n' > dupe_lines
+"$JDUPES" -q -H -d -N --files-from=dupe_lines > /dev/null 2>&1
+test -e t1/only || { echo "FAILED: a repeated line deleted t1/only"; ERR=1; }
+
+# A listed file that a directory on the command line also adds
+printf 't2/one\n' > dir_overlap
+"$JDUPES" -q -H -d -N t2 --files-from=dir_overlap > /dev/null 2>&1
+test -e t2/one || { echo "FAILED: a listed file in a scanned directory deleted t2/one"; ERR=1; }
+
+cd / && rm -rf "$TMP"
+test "$ERR" = "0" && echo "files_from_test: all tests passed"
+exit $ERR
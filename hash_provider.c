@@ -0,0 +1,98 @@
+/* jdupes file hash providers
+ * Every file hash goes through the provider selected with --hash:
+ *
+ * jodyhash: the multi-lane jody_hash; fast, hash_t bits wide
+ * murmur3:  MurmurHash3_x64_128; 128 bits wide (needs wide hash support)
+ *
+ * A wide provider returns 64 bits in addition to the hash_t value. These
+ * are kept in file_t so that full hash comparisons use all 128 bits,
+ * which makes it reasonable to trust a hash match (--trust-hash).
+ * This file is part of jdupes; see jdupes.c for license information */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "jdupes.h"
+#include "hash_provider.h"
+
+
+static void jodyhash_init(hash_state_t * const restrict state, const hash_t seed)
+{
+  jody_hash_init(&state->jody, seed);
+  return;
+}
+
+
+static void jodyhash_update(hash_state_t * const restrict state,
+                const void * const restrict data, const size_t count)
+{
+  jody_hash_update(&state->jody, data, count);
+  return;
+}
+
+
+static hash_t jodyhash_final(hash_state_t * const restrict state, uint64_t * const restrict ext)
+{
+  *ext = 0;
+  return jody_hash_final(&state->jody);
+}
+
+
+#ifdef WIDE_HASH
+static void murmur3_provider_init(hash_state_t * const restrict state, const hash_t seed)
+{
+  murmur3_init(&state->murmur3, (uint64_t)seed);
+  return;
+}
+
+
+static void murmur3_provider_update(hash_state_t * const restrict state,
+                const void * const restrict data, const size_t count)
+{
+  murmur3_update(&state->murmur3, data, count);
+  return;
+}
+
+
+static hash_t murmur3_provider_final(hash_state_t * const restrict state, uint64_t * const restrict ext)
+{
+  uint64_t out[2];
+
+  murmur3_final(&state->murmur3, out);
+  *ext = out[1];
+  return (hash_t)out[0];
+}
+#endif /* WIDE_HASH */
+
+
+static const struct hash_provider providers[] = {
+  { "jodyhash", HASH_ID_JODYHASH, 0, jodyhash_init, jodyhash_update, jodyhash_final },
+#ifdef WIDE_HASH
+  { "murmur3", HASH_ID_MURMUR3, 1, murmur3_provider_init, murmur3_provider_update, murmur3_provider_final },
+#endif
+  { NULL, 0, 0, NULL, NULL, NULL }
+};
+
+const struct hash_provider *hash_provider = &providers[0];
+
+
+/* Select a provider by name; returns 0 on success or -1 if unknown */
+extern int hash_provider_set(const char * const restrict name)
+{
+  if (name == NULL) nullptr("hash_provider_set()");
+
+  for (int i = 0; providers[i].name != NULL; i++) {
+    if (strcmp(name, providers[i].name) == 0) {
+      hash_provider = &providers[i];
+      return 0;
+    }
+  }
+  return -1;
+}
+
+
+/* Number of bits compared when checking full file hashes */
+extern unsigned int hash_provider_bits(void)
+{
+  return (unsigned int)(sizeof(hash_t) * 8) + (hash_provider->wide ? 64 : 0);
+}
@@ -0,0 +1,45 @@
+/* jdupes file hash providers
+ * This file is part of jdupes; see jdupes.c for license information */
+
+#ifndef HASH_PROVIDER_H
+#define HASH_PROVIDER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+#include "jody_hash.h"
+#include "murmur3.h"
+
+/* Provider IDs are stored in hash databases. Never reuse or renumber
+ * one; a provider whose output changes must get a new ID. */
+#define HASH_ID_JODYHASH 1
+#define HASH_ID_MURMUR3  2
+
+typedef union {
+  jody_hash_state_t jody;
+  murmur3_state_t murmur3;
+} hash_state_t;
+
+struct hash_provider {
+  const char *name;
+  uint32_t id;
+  int wide;  /* Produces 64 extra hash bits in 'ext' */
+  void (*init)(hash_state_t * const restrict state, const hash_t seed);
+  void (*update)(hash_state_t * const restrict state,
+                const void * const restrict data, const size_t count);
+  hash_t (*final)(hash_state_t * const restrict state, uint64_t * const restrict ext);
+};
+
+extern const struct hash_provider *hash_provider;
+
+extern int hash_provider_set(const char * const restrict name);
+extern unsigned int hash_provider_bits(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HASH_PROVIDER_H */
@@ -0,0 +1,335 @@
+/* jdupes persistent hash database
+ * Saves each file's stat() identity along with its partial, tail,
+ * sampled and full hashes so that later runs can skip hashing files that
+ * haven't changed. A sampled hash is only reused with the same --samples.
+ * A record is only reused if the device, inode, size, mtime (to the
+ * nanosecond), and ctime of the file all match the stored values. The
+ * mtime can be set back after a file is rewritten (cp -p, touch -r,
+ * rsync) but the ctime can't, and a stale full hash would be trusted
+ * as is by --trust-hash.
+ *
+ * The database is a header followed by an array of fixed-size records
+ * sorted by device, inode, and hash provider. Each file can have one
+ * record per hash provider (--hash). The database is written in native
+ * byte order and is discarded if the header doesn't match this build's
+ * hash parameters.
+ * This file is part of jdupes; see jdupes.c for license information */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include "jdupes.h"
+#include "jody_win_unicode.h"
+#include "hash_provider.h"
+#include "hashdb.h"
+
+#define HASHDB_MAGIC "jdupesdb"
+#define HASHDB_VERSION 4
+#define HASHDB_ENDIAN 0x01020304U
+/* Only these per-file flags are stored in records */
+#define HASHDB_FLAGS (F_HASH_PARTIAL | F_HASH_TAIL | F_HASH_SAMPLE | F_HASH_FULL)
+
+struct hashdb_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t endian;
+  uint32_t hash_version;  /* JODY_HASH_VERSION */
+  uint32_t hash_width;    /* sizeof(hash_t) */
+  uint64_t partial_size;  /* PARTIAL_HASH_SIZE */
+  uint64_t count;         /* Number of records that follow */
+};
+
+struct hashdb_record {
+  uint64_t device;
+  uint64_t inode;
+  int64_t size;
+  int64_t mtime;
+  int64_t ctime_ns;
+  uint64_t partial;
+  uint64_t full;
+  uint64_t partial_ext;  /* Extra bits from 128-bit hash providers */
+  uint64_t full_ext;
+  uint64_t tail;
+  uint64_t sample;
+  uint32_t samples;      /* Blocks in the sampled hash (--samples) */
+  uint32_t pad;
+  uint32_t provider;     /* HASH_ID_* of the provider that made the hashes */
+  uint32_t flags;
+  uint32_t seen;  /* Not meaningful on disk; set when a file matches */
+  uint32_t mtime_nsec;
+};
+
+static struct hashdb_record *db = NULL;
+static size_t db_count = 0;
+
+
+/* Order records by device, inode, then hash provider */
+static int hashdb_cmp(const void *a, const void *b)
+{
+  const struct hashdb_record * const r1 = (const struct hashdb_record *)a;
+  const struct hashdb_record * const r2 = (const struct hashdb_record *)b;
+
+  if (r1->device < r2->device) return -1;
+  if (r1->device > r2->device) return 1;
+  if (r1->inode < r2->inode) return -1;
+  if (r1->inode > r2->inode) return 1;
+  if (r1->provider < r2->provider) return -1;
+  if (r1->provider > r2->provider) return 1;
+  return 0;
+}
+
+
+static void hashdb_header_init(struct hashdb_header * const restrict hdr, const size_t count)
+{
+  memset(hdr, 0, sizeof(struct hashdb_header));
+  memcpy(hdr->magic, HASHDB_MAGIC, sizeof(hdr->magic));
+  hdr->version = HASHDB_VERSION;
+  hdr->endian = HASHDB_ENDIAN;
+  hdr->hash_version = JODY_HASH_VERSION;
+  hdr->hash_width = (uint32_t)sizeof(hash_t);
+  hdr->partial_size = PARTIAL_HASH_SIZE;
+  hdr->count = count;
+  return;
+}
+
+
+static FILE *hashdb_fopen(const char * const restrict name, const int write)
+{
+#ifdef UNICODE
+  if (!M2W(name, wstr)) return NULL;
+  return _wfopen(wstr, write ? L"wb" : L"rb");
+#else
+  return fopen(name, write ? "wb" : "rb");
+#endif
+}
+
+
+/* Load a hash database into memory
+ * Returns the number of records loaded, 0 if there is no usable
+ * database (a missing database is not an error), or -1 on error */
+extern int hashdb_load(const char * const restrict dbname)
+{
+  struct hashdb_header hdr, want;
+  FILE *fp;
+  off_t len;
+
+  if (dbname == NULL) nullptr("hashdb_load()");
+  LOUD(fprintf(stderr, "hashdb_load('%s')\n", dbname);)
+
+  hashdb_free();
+  fp = hashdb_fopen(dbname, 0);
+  if (fp == NULL) {
+    if (errno == ENOENT) return 0;
+    fprintf(stderr, "warning: can't open hash database "); fwprint(stderr, dbname, 0);
+    fprintf(stderr, ": %s\n", strerror(errno));
+    return -1;
+  }
+
+  hashdb_header_init(&want, 0);
+  if (fread(&hdr, sizeof(hdr), 1, fp) != 1) goto error_format;
+  if (memcmp(hdr.magic, want.magic, sizeof(hdr.magic)) != 0
+      || hdr.endian != want.endian)
+    goto error_format;
+  /* Hashes from a different hash configuration or an older database
+   * version are useless but harmless; they are replaced on save */
+  if (hdr.version != want.version
+      || hdr.hash_version != want.hash_version || hdr.hash_width != want.hash_width
+      || hdr.partial_size != want.partial_size) {
+    LOUD(fprintf(stderr, "hashdb_load: hash parameters changed, ignoring database\n");)
+    fclose(fp);
+    return 0;
+  }
+
+  /* Make sure the record count agrees with the file size */
+  if (fseeko(fp, 0, SEEK_END) != 0) goto error_format;
+  len = ftello(fp);
+  if (len < 0 || (uint64_t)len != sizeof(hdr) + hdr.count * sizeof(struct hashdb_record))
+    goto error_format;
+  if (fseeko(fp, (off_t)sizeof(hdr), SEEK_SET) != 0) goto error_format;
+
+  if (hdr.count == 0) {
+    fclose(fp);
+    return 0;
+  }
+  db = (struct hashdb_record *)malloc(sizeof(struct hashdb_record) * (size_t)hdr.count);
+  if (db == NULL) oom("hashdb_load()");
+  if (fread(db, sizeof(struct hashdb_record), (size_t)hdr.count, fp) != (size_t)hdr.count) {
+    hashdb_free();
+    goto error_format;
+  }
+  fclose(fp);
+
+  db_count = (size_t)hdr.count;
+  for (size_t i = 0; i < db_count; i++) db[i].seen = 0;
+  /* Records are written sorted, but don't trust that blindly */
+  qsort(db, db_count, sizeof(struct hashdb_record), hashdb_cmp);
+  LOUD(fprintf(stderr, "hashdb_load: loaded %" PRIuMAX " records\n", (uintmax_t)db_count);)
+  return (int)(db_count > INT_MAX ? INT_MAX : db_count);
+
+error_format:
+  fclose(fp);
+  fprintf(stderr, "warning: ignoring invalid hash database "); fwprint(stderr, dbname, 1);
+  return -1;
+}
+
+
+/* Copy stored hashes into every file whose stat() info is unchanged
+ * 'samples' is the current --samples count
+ * Returns the number of files that received hashes */
+extern uintmax_t hashdb_apply(file_t *files, const unsigned int samples)
+{
+  struct hashdb_record key, *rec;
+  uintmax_t applied = 0;
+
+  LOUD(fprintf(stderr, "hashdb_apply(%p)\n", (void *)files);)
+  if (db == NULL) return 0;
+
+  for (; files != NULL; files = files->next) {
+    if (!ISFLAG(files->flags, F_VALID_STAT)) continue;
+    key.device = (uint64_t)files->device;
+    key.inode = (uint64_t)files->inode;
+    key.provider = hash_provider->id;
+    rec = (struct hashdb_record *)bsearch(&key, db, db_count, sizeof(struct hashdb_record), hashdb_cmp);
+    if (rec == NULL) continue;
+    rec->seen = 1;
+    if (rec->size != (int64_t)files->size || rec->mtime != (int64_t)files->mtime
+        || rec->mtime_nsec != files->mtime_nsec || rec->ctime_ns != files->ctime_ns) continue;
+
+    if (ISFLAG(rec->flags, F_HASH_PARTIAL) && !ISFLAG(files->flags, F_HASH_PARTIAL)) {
+      files->filehash_partial = (hash_t)rec->partial;
+      SET_HASH_EXT(files->filehash_partial_ext, rec->partial_ext);
+      SETFLAG(files->flags, F_HASH_PARTIAL);
+    }
+    if (ISFLAG(rec->flags, F_HASH_TAIL) && !ISFLAG(files->flags, F_HASH_TAIL)) {
+      files->filehash_tail = (hash_t)rec->tail;
+      SETFLAG(files->flags, F_HASH_TAIL);
+    }
+    if (ISFLAG(rec->flags, F_HASH_SAMPLE) && !ISFLAG(files->flags, F_HASH_SAMPLE)
+        && rec->samples == samples) {
+      files->filehash_sample = (hash_t)rec->sample;
+      SETFLAG(files->flags, F_HASH_SAMPLE);
+    }
+    if (ISFLAG(rec->flags, F_HASH_FULL) && !ISFLAG(files->flags, F_HASH_FULL)) {
+      files->filehash = (hash_t)rec->full;
+      SET_HASH_EXT(files->filehash_ext, rec->full_ext);
+      SETFLAG(files->flags, F_HASH_FULL);
+    }
+    applied++;
+  }
+
+  LOUD(fprintf(stderr, "hashdb_apply: reused hashes for %" PRIuMAX " files\n", applied);)
+  return applied;
+}
+
+
+/* Write the database out with the hashes of all files that have them.
+ * Loaded records for files that were not seen in this run are kept so
+ * that scanning part of a tree doesn't throw away the rest of it. The
+ * new database is written to a temporary file and renamed into place.
+ * Returns 0 on success, -1 on failure */
+extern int hashdb_save(const char * const restrict dbname, const file_t *files,
+                const unsigned int samples)
+{
+  struct hashdb_header hdr;
+  struct hashdb_record *out;
+  const file_t *f;
+  char *tempname;
+  size_t count = 0, i, j;
+  FILE *fp;
+
+  if (dbname == NULL) nullptr("hashdb_save()");
+  LOUD(fprintf(stderr, "hashdb_save('%s')\n", dbname);)
+
+  for (f = files; f != NULL; f = f->next) if (ISFLAG(f->flags, F_HASH_PARTIAL)) count++;
+  for (i = 0; i < db_count; i++) if (!db[i].seen) count++;
+
+  out = (struct hashdb_record *)malloc(sizeof(struct hashdb_record) * (count + 1));
+  tempname = (char *)malloc(strlen(dbname) + 5);
+  if (out == NULL || tempname == NULL) oom("hashdb_save()");
+  strcpy(tempname, dbname);
+  strcat(tempname, ".tmp");
+
+  count = 0;
+  for (f = files; f != NULL; f = f->next) {
+    if (!ISFLAG(f->flags, F_HASH_PARTIAL)) continue;
+    memset(&out[count], 0, sizeof(struct hashdb_record));
+    out[count].device = (uint64_t)f->device;
+    out[count].inode = (uint64_t)f->inode;
+    out[count].size = (int64_t)f->size;
+    out[count].mtime = (int64_t)f->mtime;
+    out[count].mtime_nsec = f->mtime_nsec;
+    out[count].ctime_ns = f->ctime_ns;
+    out[count].partial = (uint64_t)f->filehash_partial;
+    out[count].full = (uint64_t)f->filehash;
+    out[count].tail = (uint64_t)f->filehash_tail;
+    out[count].sample = (uint64_t)f->filehash_sample;
+    out[count].samples = samples;
+#ifdef WIDE_HASH
+    out[count].partial_ext = f->filehash_partial_ext;
+    out[count].full_ext = f->filehash_ext;
+#endif
+    out[count].provider = hash_provider->id;
+    out[count].flags = f->flags & HASHDB_FLAGS;
+    count++;
+  }
+  for (i = 0; i < db_count; i++) if (!db[i].seen) out[count++] = db[i];
+
+  /* Hard links produce several records for one inode; keep the best one */
+  qsort(out, count, sizeof(struct hashdb_record), hashdb_cmp);
+  for (i = 0, j = 0; i < count; i++) {
+    if (j > 0 && hashdb_cmp(&out[j - 1], &out[i]) == 0) {
+      if (ISFLAG(out[i].flags, F_HASH_FULL) && !ISFLAG(out[j - 1].flags, F_HASH_FULL))
+        out[j - 1] = out[i];
+      continue;
+    }
+    out[j++] = out[i];
+  }
+  count = j;
+  for (i = 0; i < count; i++) out[i].seen = 0;
+
+  fp = hashdb_fopen(tempname, 1);
+  if (fp == NULL) goto error_write;
+  hashdb_header_init(&hdr, count);
+  if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1
+      || fwrite(out, sizeof(struct hashdb_record), count, fp) != count) {
+    fclose(fp);
+    remove(tempname);
+    goto error_write;
+  }
+  if (fclose(fp) != 0) {
+    remove(tempname);
+    goto error_write;
+  }
+#ifdef ON_WINDOWS
+  /* Windows rename() won't replace an existing file */
+  remove(dbname);
+#endif
+  if (rename(tempname, dbname) != 0) {
+    remove(tempname);
+    goto error_write;
+  }
+
+  LOUD(fprintf(stderr, "hashdb_save: wrote %" PRIuMAX " records\n", (uintmax_t)count);)
+  free(out);
+  free(tempname);
+  return 0;
+
+error_write:
+  fprintf(stderr, "warning: can't write hash database "); fwprint(stderr, dbname, 0);
+  fprintf(stderr, ": %s\n", strerror(errno));
+  free(out);
+  free(tempname);
+  return -1;
+}
+
+
+extern void hashdb_free(void)
+{
+  free(db);
+  db = NULL;
+  db_count = 0;
+  return;
+}
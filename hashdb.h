@@ -0,0 +1,23 @@
+/* jdupes persistent hash database
+ * This file is part of jdupes; see jdupes.c for license information */
+
+#ifndef HASHDB_H
+#define HASHDB_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "jdupes.h"
+
+extern int hashdb_load(const char * const restrict dbname);
+extern uintmax_t hashdb_apply(file_t *files, const unsigned int samples);
+extern int hashdb_save(const char * const restrict dbname, const file_t *files,
+                const unsigned int samples);
+extern void hashdb_free(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HASHDB_H */
@@ -0,0 +1,345 @@
+/* jdupes file read backends
+ * All file content reads for hashing and comparison go through io_read(),
+ * which either copies data into the caller's buffer or returns a pointer
+ * straight into a mapping of the file. The backend is chosen with --io:
+ *
+ * stdio:  buffered fread(), which copies everything through libc twice
+ * pread:  unbuffered pread() into the caller's buffer
+ * mmap:   no copying at all; the kernel is told reads are sequential
+ * direct: O_DIRECT reads that bypass the page cache entirely
+ * uring:  pread, but partial hashes are read in bulk (see uring_hash.c)
+ *
+ * The pread and mmap backends tell the kernel to drop the file's cached
+ * pages when it is closed so that scanning huge trees doesn't push more
+ * useful data out of the page cache. stdio leaves the cache alone.
+ *
+ * Touching a mapping past the end of a file that shrank after it was
+ * mapped raises SIGBUS, which would kill the whole run. Each chunk of a
+ * mapping is touched under a SIGBUS guard before it is handed out, and a
+ * file that faults is read with pread() from there on, which just sees a
+ * short read like the other backends do. A file that shrinks after its
+ * chunk was touched but before the caller is done with it can still
+ * raise SIGBUS; that window is much smaller but not closed.
+ * This file is part of jdupes; see jdupes.c for license information */
+
+/* O_DIRECT is a GNU extension on Linux */
+#ifndef _GNU_SOURCE
+ #define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "jdupes.h"
+#include "jody_win_unicode.h"
+#include "io_backend.h"
+#include "stats.h"
+
+#ifndef ON_WINDOWS
+ #include <setjmp.h>
+ #include <signal.h>
+ #include <sys/mman.h>
+#endif
+
+/* O_DIRECT offsets, lengths, and buffers must be block-aligned */
+#define IO_DIRECT_ALIGN 4096
+#define IO_DIRECT_BUFSIZE 65536
+
+int io_mode = IO_STDIO;
+
+static const char *io_mode_names[] = { "stdio", "pread", "mmap", "direct", "uring", NULL };
+
+#ifndef ON_WINDOWS
+/* Where a SIGBUS in a guarded touch of a mapping jumps to */
+ #ifndef NO_THREADS
+static __thread sigjmp_buf *bus_jump = NULL;
+ #else
+static sigjmp_buf *bus_jump = NULL;
+ #endif
+static size_t page_size = 4096;
+
+
+static void bus_handler(const int sig)
+{
+  if (bus_jump != NULL) siglongjmp(*bus_jump, 1);
+  /* Not from a guarded touch: die the way SIGBUS normally would */
+  signal(sig, SIG_DFL);
+  raise(sig);
+  return;
+}
+
+
+/* Catch SIGBUS for the mmap backend */
+static void bus_guard_init(void)
+{
+  struct sigaction sa;
+  long pagesize = sysconf(_SC_PAGESIZE);
+
+  if (pagesize > 0) page_size = (size_t)pagesize;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = bus_handler;
+  sigemptyset(&sa.sa_mask);
+  /* Leave SIGBUS unblocked in the handler so that the jump out of it
+   * doesn't need sigsetjmp() to save and restore the signal mask */
+  sa.sa_flags = SA_NODEFER;
+  sigaction(SIGBUS, &sa, NULL);
+  return;
+}
+
+
+/* Touch every page of a piece of a mapping so that it is read in
+ * Returns 0 on success or -1 if it lies past the end of the file */
+static int map_touch(const char * const restrict p, const size_t len)
+{
+  sigjmp_buf jump;
+  volatile char sink = 0;
+
+  if (sigsetjmp(jump, 0) != 0) {
+    bus_jump = NULL;
+    return -1;
+  }
+  bus_jump = &jump;
+  for (size_t i = 0; i < len; i += page_size) sink ^= ((const volatile char *)p)[i];
+  if (len > 0) sink ^= ((const volatile char *)p)[len - 1];
+  bus_jump = NULL;
+  (void)sink;
+  return 0;
+}
+#endif /* ON_WINDOWS */
+
+
+/* Select the read backend by name; returns 0 on success or -1 if the
+ * name is unknown or the backend isn't available on this platform */
+extern int io_set_mode(const char * const restrict name)
+{
+  if (name == NULL) nullptr("io_set_mode()");
+
+  for (int i = 0; io_mode_names[i] != NULL; i++) {
+    if (strcmp(name, io_mode_names[i]) != 0) continue;
+#ifdef ON_WINDOWS
+    if (i != IO_STDIO) return -1;
+#endif
+#ifndef O_DIRECT
+    if (i == IO_DIRECT) return -1;
+#endif
+#ifndef ENABLE_IO_URING
+    if (i == IO_URING) return -1;
+#endif
+#ifndef ON_WINDOWS
+    if (i == IO_MMAP) bus_guard_init();
+#endif
+    io_mode = i;
+    return 0;
+  }
+  return -1;
+}
+
+
+extern const char *io_mode_name(void)
+{
+  return io_mode_names[io_mode];
+}
+
+
+/* Open a file for reading with the current backend
+ * Returns 0 on success or -1 on failure with errno set */
+extern int io_open(struct io_file * const restrict f, const char * const restrict name)
+{
+#ifndef ON_WINDOWS
+  struct stat st;
+  int oflags = O_RDONLY;
+#endif
+
+  if (f == NULL || name == NULL) nullptr("io_open()");
+  LOUD(fprintf(stderr, "io_open('%s') [%s]\n", name, io_mode_name());)
+
+  f->fp = NULL;
+  f->fd = -1;
+  /* Single files are read the same way in io_uring mode */
+  f->mode = (io_mode == IO_URING) ? IO_PREAD : io_mode;
+  f->size = 0;
+  f->pos = 0;
+  f->map = NULL;
+  f->abuf = NULL;
+
+  if (f->mode == IO_STDIO) {
+#ifdef UNICODE
+    if (!M2W(name, wstr)) f->fp = NULL;
+    else f->fp = _wfopen(wstr, FILE_MODE_RO);
+#else
+    f->fp = fopen(name, FILE_MODE_RO);
+#endif
+    if (f->fp == NULL) return -1;
+    STATS(stats_add_opens(1);)
+    return 0;
+  }
+
+#ifndef ON_WINDOWS
+ #ifdef O_DIRECT
+  if (f->mode == IO_DIRECT) oflags |= O_DIRECT;
+ #endif
+  f->fd = open(name, oflags);
+ #ifdef O_DIRECT
+  /* Some filesystems (tmpfs, for one) refuse O_DIRECT */
+  if (f->fd == -1 && f->mode == IO_DIRECT && errno == EINVAL) {
+    LOUD(fprintf(stderr, "io_open: O_DIRECT refused, using pread\n");)
+    f->mode = IO_PREAD;
+    f->fd = open(name, O_RDONLY);
+  }
+ #endif
+  if (f->fd == -1) return -1;
+  if (fstat(f->fd, &st) != 0) goto error_open;
+  f->size = st.st_size;
+
+  switch (f->mode) {
+    case IO_MMAP:
+      if (f->size == 0) break;
+      f->map = (char *)mmap(NULL, (size_t)f->size, PROT_READ, MAP_PRIVATE, f->fd, 0);
+      if (f->map == MAP_FAILED) {
+        /* Fall back to pread() if the file can't be mapped */
+        LOUD(fprintf(stderr, "io_open: mmap() failed, using pread\n");)
+        f->map = NULL;
+        f->mode = IO_PREAD;
+        break;
+      }
+      madvise(f->map, (size_t)f->size, MADV_SEQUENTIAL);
+      break;
+    case IO_DIRECT:
+      if (posix_memalign((void **)&f->abuf, IO_DIRECT_ALIGN, IO_DIRECT_BUFSIZE) != 0) oom("io_open()");
+      break;
+    default:
+      break;
+  }
+ #ifdef POSIX_FADV_SEQUENTIAL
+  if (f->mode == IO_PREAD) posix_fadvise(f->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+ #endif
+  STATS(stats_add_opens(1);)
+  return 0;
+
+error_open:
+  close(f->fd);
+  f->fd = -1;
+  return -1;
+#else
+  return -1;
+#endif /* ON_WINDOWS */
+}
+
+
+/* Set the offset of the next read; returns 0 on success or -1 on failure */
+extern int io_seek(struct io_file * const restrict f, const off_t offset)
+{
+  if (f == NULL) nullptr("io_seek()");
+  if (f->mode == IO_STDIO) return fseeko(f->fp, offset, SEEK_SET);
+  if (offset < 0) return -1;
+  f->pos = offset;
+  return 0;
+}
+
+
+/* The read itself for io_read() */
+static inline const void *read_backend(struct io_file * const restrict f, void * const restrict buf,
+                const size_t len, size_t * const restrict got)
+{
+#ifndef ON_WINDOWS
+  ssize_t r;
+#endif
+
+  *got = 0;
+  switch (f->mode) {
+    case IO_STDIO:
+      *got = fread(buf, 1, len, f->fp);
+      if (*got < len && ferror(f->fp)) return NULL;
+      return buf;
+#ifndef ON_WINDOWS
+    case IO_MMAP:
+      if (f->pos >= f->size) return buf;
+      *got = (f->size - f->pos < (off_t)len) ? (size_t)(f->size - f->pos) : len;
+      if (map_touch(f->map + f->pos, *got) != 0) {
+        /* The file shrank after it was mapped */
+        LOUD(fprintf(stderr, "io_read: SIGBUS in mapping, using pread\n");)
+        munmap(f->map, (size_t)f->size);
+        f->map = NULL;
+        f->mode = IO_PREAD;
+        return read_backend(f, buf, len, got);
+      }
+      f->pos += (off_t)*got;
+      return f->map + f->pos - *got;
+ #ifdef O_DIRECT
+    case IO_DIRECT:
+      /* Round the read up to whole blocks; the data stops at EOF anyway */
+      if ((f->pos & (IO_DIRECT_ALIGN - 1)) == 0 && len <= IO_DIRECT_BUFSIZE) {
+        size_t alen = (len + IO_DIRECT_ALIGN - 1) & ~((size_t)IO_DIRECT_ALIGN - 1);
+
+        do r = pread(f->fd, f->abuf, alen, f->pos);
+        while (r == -1 && errno == EINTR);
+        if (r < 0) return NULL;
+        *got = ((size_t)r > len) ? len : (size_t)r;
+        f->pos += (off_t)*got;
+        return f->abuf;
+      }
+      /* Unaligned reads can't use O_DIRECT, so turn it off for good */
+      fcntl(f->fd, F_SETFL, fcntl(f->fd, F_GETFL) & ~O_DIRECT);
+      f->mode = IO_PREAD;
+      /* Fall through */
+ #endif
+    case IO_PREAD:
+      /* Keep reading until len bytes or EOF, like fread() */
+      while (*got < len) {
+        r = pread(f->fd, (char *)buf + *got, len - *got, f->pos);
+        if (r == -1 && errno == EINTR) continue;
+        if (r < 0) return NULL;
+        if (r == 0) break;
+        *got += (size_t)r;
+        f->pos += r;
+      }
+      return buf;
+#endif /* ON_WINDOWS */
+    default:
+      return NULL;
+  }
+}
+
+
+/* Read up to len bytes at the current offset. Returns a pointer to the
+ * data, which is either buf or somewhere inside a mapping, and stores the
+ * number of bytes read in *got. At end of file *got is 0. Returns NULL on
+ * error. buf must hold at least len bytes. */
+extern const void *io_read(struct io_file * const restrict f, void * const restrict buf,
+                const size_t len, size_t * const restrict got)
+{
+  const void *data;
+
+  if (f == NULL || buf == NULL || got == NULL) nullptr("io_read()");
+
+  data = read_backend(f, buf, len, got);
+  STATS(if (data != NULL) stats_add_bytes(*got);)
+  return data;
+}
+
+
+extern void io_close(struct io_file * const restrict f)
+{
+  if (f == NULL) nullptr("io_close()");
+
+  if (f->fp != NULL) fclose(f->fp);
+  f->fp = NULL;
+#ifndef ON_WINDOWS
+  if (f->map != NULL) munmap(f->map, (size_t)f->size);
+  f->map = NULL;
+  free(f->abuf);
+  f->abuf = NULL;
+  if (f->fd != -1) {
+ #ifdef POSIX_FADV_DONTNEED
+    if (f->mode == IO_PREAD || f->mode == IO_MMAP) posix_fadvise(f->fd, 0, 0, POSIX_FADV_DONTNEED);
+ #endif
+    close(f->fd);
+  }
+  f->fd = -1;
+#endif /* ON_WINDOWS */
+  return;
+}
@@ -0,0 +1,47 @@
+/* jdupes file read backends
+ * This file is part of jdupes; see jdupes.c for license information */
+
+#ifndef IO_BACKEND_H
+#define IO_BACKEND_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdio.h>
+#include <sys/types.h>
+
+enum io_mode {
+  IO_STDIO = 0,  /* Buffered fread(); the default */
+  IO_PREAD,      /* pread() straight into the caller's buffer */
+  IO_MMAP,       /* Read from a read-only mapping of the file */
+  IO_DIRECT,     /* O_DIRECT pread() into an aligned buffer */
+  IO_URING       /* pread(), plus batched partial hashing with io_uring */
+};
+
+/* An open file; only touch it through the io_*() functions */
+struct io_file {
+  FILE *fp;
+  int fd;
+  int mode;
+  off_t size;   /* Size at open time */
+  off_t pos;    /* Current read offset */
+  char *map;
+  char *abuf;   /* Aligned O_DIRECT bounce buffer */
+};
+
+extern int io_mode;
+
+extern int io_set_mode(const char * const restrict name);
+extern const char *io_mode_name(void);
+extern int io_open(struct io_file * const restrict f, const char * const restrict name);
+extern int io_seek(struct io_file * const restrict f, const off_t offset);
+extern const void *io_read(struct io_file * const restrict f, void * const restrict buf,
+                const size_t len, size_t * const restrict got);
+extern void io_close(struct io_file * const restrict f);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* IO_BACKEND_H */
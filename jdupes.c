@@ -39,19 +39,36 @@
 #include <errno.h>
 #include <libgen.h>
 #include <sys/time.h>
+#ifndef ON_WINDOWS
+ #include <sys/resource.h>
+#endif
+#ifndef NO_THREADS
+#include <pthread.h>
+#endif
 #include "jdupes.h"
 #include "string_malloc.h"
 #include "jody_hash.h"
 #include "jody_sort.h"
 #include "jody_win_unicode.h"
 #include "jody_cacheinfo.h"
+#include "threadpool.h"
+#include "hashdb.h"
+#include "io_backend.h"
+#include "hash_provider.h"
+#include "path_intern.h"
+#include "stats.h"
+#ifdef ENABLE_IO_URING
+#include "uring_hash.h"
+#endif
 #include "version.h"
 
 /* Headers for post-scanning actions */
 #include "act_deletefiles.h"
 #include "act_dedupefiles.h"
 #include "act_linkfiles.h"
+#include "act_reflinkfiles.h"
 #include "act_printmatches.h"
+#include "act_printjson.h"
 #include "act_summarize.h"
 
 /* Detect Windows and modify as needed */
@@ -112,6 +129,13 @@ static enum {
 #ifndef PARTIAL_HASH_SIZE
  #define PARTIAL_HASH_SIZE 4096
 #endif
+/* Files at least this big get tail and sampled block hashes between the
+ * partial and full hash stages */
+#ifndef STAGE_MIN_SIZE
+ #define STAGE_MIN_SIZE 1048576
+#endif
+#define SAMPLE_COUNT_DEFAULT 8
+#define SAMPLE_COUNT_MAX 64
 
 static size_t auto_chunk_size;
 
@@ -129,10 +153,6 @@ static size_t auto_chunk_size;
 #error "PATHBUF_SIZE can't be less than PATH_MAX"
 #endif
 
-#ifndef INITIAL_DEPTH_THRESHOLD
-#define INITIAL_DEPTH_THRESHOLD 8
-#endif
-
 /* For interactive deletion input */
 #define INPUT_SIZE 512
 
@@ -156,8 +176,11 @@ static const char *extensions[] = {
     #ifdef LOUD_DEBUG
     "loud",
     #endif
-    #ifdef ENABLE_BTRFS
-    "btrfs",
+    #ifdef ENABLE_DEDUPE
+    "dedupe",
+    #endif
+    #ifdef ENABLE_IO_URING
+    "io_uring",
     #endif
     #ifdef LOW_MEMORY
     "lowmem",
@@ -177,11 +200,8 @@ static const char *extensions[] = {
     #ifdef NO_SYMLINKS
     "nosymlink",
     #endif
-    #ifdef USE_TREE_REBALANCE
-    "rebal",
-    #endif
-    #ifdef CONSIDER_IMBALANCE
-    "ci",
+    #ifdef NO_THREADS
+    "nothreads",
     #endif
     #ifdef BALANCE_THRESHOLD
     "bt",
@@ -189,14 +209,29 @@ static const char *extensions[] = {
     NULL
 };
 
-/* Tree to track each directory traversed */
+/* Hash table to track each directory traversed; each directory is
+ * claimed by the first thread to find it and scanned only once */
+#ifndef TRAVDONE_BUCKETS
+#define TRAVDONE_BUCKETS 4096  /* Must be a power of two */
+#endif
+struct scanitem;
 struct travdone {
-  struct travdone *left;
-  struct travdone *right;
+  struct travdone *next;
   jdupes_ino_t inode;
   dev_t device;
+  path_dir_t *dir;  /* Shared by the names of everything in it */
+  struct scanitem *items;  /* Directory contents in readdir() order */
+  size_t item_count;
+  size_t item_max;
+  int recurse;
+  int emitted;  /* Contents have been added to the file list */
+};
+/* A directory entry: either a file or a subdirectory to descend into */
+struct scanitem {
+  file_t *file;
+  struct travdone *dir;
 };
-static struct travdone *travdone_head = NULL;
+static struct travdone *travdone_table[TRAVDONE_BUCKETS];
 
 /* Required for progress indicator code */
 static uintmax_t filecount = 0;
@@ -208,8 +243,10 @@ static uintmax_t progress = 0, dir_progress = 0, dupecount = 0;
 #ifdef DEBUG
 static unsigned int small_file = 0, partial_hash = 0, partial_elim = 0;
 static unsigned int full_hash = 0, partial_to_full = 0, hash_fail = 0;
+static unsigned int tail_hash = 0, sample_hash = 0, stage_elim = 0;
 static uintmax_t comparisons = 0;
-static unsigned int left_branch = 0, right_branch = 0;
+static uintmax_t match_probes = 0;
+static unsigned int match_splits = 0;
  #ifdef ON_WINDOWS
   #ifndef NO_HARDLINKS
 static unsigned int hll_exclude = 0;
@@ -217,23 +254,78 @@ static unsigned int hll_exclude = 0;
  #endif
 #endif /* DEBUG */
 
-#ifdef TREE_DEPTH_STATS
-static unsigned int tree_depth = 0;
-static unsigned int max_depth = 0;
+/* Hot matching metadata, one array per field, indexed by the file's
+ * position in the size-grouped candidate list (its file ID). Matching
+ * only reads these, so lookups and condition checks stream through a few
+ * small arrays instead of visiting a whole file_t (name, links and other
+ * cold attributes) for every candidate. file_t keeps its own copy of
+ * every hash, which is what everything after matching uses. */
+#define META_PARTIAL 0x01
+#define META_FULL    0x02
+static struct {
+  dev_t *device;
+  jdupes_ino_t *inode;
+  unsigned int *user_order;
+  hash_t *partial;
+  hash_t *full;
+#ifdef WIDE_HASH
+  uint64_t *partial_ext;
+  uint64_t *full_ext;
 #endif
+  uint8_t *state;  /* Which hashes are known (META_*) */
+} meta;
 
-/* File tree head */
-static filetree_t *checktree = NULL;
+/* Number of sets handed to the actions so far (--stream) */
+static unsigned int stream_sets = 0;
 
 /* Directory parameter position counter */
 static unsigned int user_dir_count = 1;
 
-/* registerfile() direction options */
-enum tree_direction { NONE, LEFT, RIGHT };
-
 /* Sort order reversal */
 static int sort_direction = 1;
 
+/* Duplicate set sort order (-o) */
+static ordertype_t ordertype = ORDER_NAME;
+
+/* Number of sampled blocks in the sample hash stage (--samples) */
+static unsigned int sample_count = SAMPLE_COUNT_DEFAULT;
+
+/* Number of threads to use for hashing (--threads) */
+static unsigned int hash_threads = 1;
+
+/* Hash database file name (--hash-db) */
+static const char *hashdb_name = NULL;
+
+/* Write one JSON set per line instead of a JSON array (--ndjson) */
+static int json_lines = 0;
+
+/* List of files to use instead of scanning (--files-from) */
+static const char *files_from_name = NULL;
+static int files_from_delim = '\n';
+
+/* Most files verify_set() will read at once; larger sets (or a low open
+ * file limit) fall back to comparing each file to the first one */
+#define VERIFY_MAX_FILES 256
+static size_t verify_max_files = 0;
+
+/* Option codes for long options without a short equivalent */
+enum {
+  OPT_THREADS = 0x100,
+  OPT_HASHDB,
+  OPT_IO,
+  OPT_HASH,
+  OPT_TRUSTHASH,
+  OPT_SAMPLES,
+  OPT_FILESFROM,
+  OPT_FILES0FROM,
+  OPT_JSON,
+  OPT_NDJSON,
+  OPT_STREAM,
+  OPT_DEDUPEJOBS,
+  OPT_REFLINK,
+  OPT_STATS
+};
+
 /* Signal handler */
 static int interrupt = 0;
 
@@ -279,6 +371,12 @@ extern void nullptr(const char * restrict func)
 
 /* Compare two jody_hashes like memcmp() */
 #define HASH_COMPARE(a,b) ((a > b) ? 1:((a == b) ? 0:-1))
+/* Compare the extra bits of wide hashes, which are always equal without them */
+#ifdef WIDE_HASH
+ #define HASH_EXT_COMPARE(a,b) HASH_COMPARE(a,b)
+#else
+ #define HASH_EXT_COMPARE(a,b) 0
+#endif
 
 
 static inline char **cloneargs(const int argc, char **argv)
@@ -362,21 +460,24 @@ static void update_progress(const char * const restrict msg, const int file_perc
  * Returns 1 if changed, 0 if not changed, negative if error */
 extern int file_has_changed(file_t * const restrict file)
 {
-  if (file == NULL || file->d_name == NULL) nullptr("file_has_changed()");
-  LOUD(fprintf(stderr, "file_has_changed('%s')\n", file->d_name);)
+  char path[FILE_PATH_SIZE];
+
+  if (file == NULL || file->name == NULL) nullptr("file_has_changed()");
+  file_path(file, path);
+  LOUD(fprintf(stderr, "file_has_changed('%s')\n", path);)
 
   if (!ISFLAG(file->flags, F_VALID_STAT)) return -66;
 
 #ifdef ON_WINDOWS
   int i;
-  if ((i = win_stat(file->d_name, &ws)) != 0) return i;
+  if ((i = win_stat(path, &ws)) != 0) return i;
   if (file->inode != ws.inode) return 1;
   if (file->size != ws.size) return 1;
   if (file->device != ws.device) return 1;
   if (file->mtime != ws.mtime) return 1;
   if (file->mode != ws.mode) return 1;
 #else
-  if (stat(file->d_name, &s) != 0) return -2;
+  if (stat(path, &s) != 0) return -2;
   if (file->inode != s.st_ino) return 1;
   if (file->size != s.st_size) return 1;
   if (file->device != s.st_dev) return 1;
@@ -387,7 +488,7 @@ extern int file_has_changed(file_t * const restrict file)
   if (file->gid != s.st_gid) return 1;
  #endif
  #ifndef NO_SYMLINKS
-  if (lstat(file->d_name, &s) != 0) return -3;
+  if (lstat(path, &s) != 0) return -3;
   if ((S_ISLNK(s.st_mode) > 0) ^ ISFLAG(file->flags, F_IS_SYMLINK)) return 1;
  #endif
 #endif /* ON_WINDOWS */
@@ -396,39 +497,91 @@ extern int file_has_changed(file_t * const restrict file)
 }
 
 
+#ifndef ON_WINDOWS
+ #ifdef __APPLE__
+  #define ST_MTIME_NSEC(st) ((st)->st_mtimespec.tv_nsec)
+  #define ST_CTIME_NSEC(st) ((st)->st_ctimespec.tv_nsec)
+ #else
+  #define ST_MTIME_NSEC(st) ((st)->st_mtim.tv_nsec)
+  #define ST_CTIME_NSEC(st) ((st)->st_ctim.tv_nsec)
+ #endif
+
+/* Copy the stat() fields jdupes uses into a file_t */
+static inline void set_file_stats(file_t * const restrict file,
+                const struct stat * const restrict st)
+{
+  file->inode = st->st_ino;
+  file->size = st->st_size;
+  file->device = st->st_dev;
+  file->mtime = st->st_mtime;
+  file->mtime_nsec = (uint32_t)ST_MTIME_NSEC(st);
+  file->ctime_ns = (int64_t)st->st_ctime * 1000000000 + (int64_t)ST_CTIME_NSEC(st);
+  file->mode = st->st_mode;
+ #ifndef NO_PERMS
+  file->uid = st->st_uid;
+  file->gid = st->st_gid;
+ #endif
+  return;
+}
+
+
+/* Get file information for a directory entry relative to its open parent
+ * directory. Unlike getfilestats(), which does stat() and lstat() on the
+ * full path, this only needs one fstatat() unless the entry is a symlink */
+static int getentrystats(const int dfd, const char * const restrict name,
+                file_t * const restrict file)
+{
+  struct stat st;
+
+  SETFLAG(file->flags, F_VALID_STAT);
+ #ifndef NO_SYMLINKS
+  if (fstatat(dfd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) return -1;
+  if (S_ISLNK(st.st_mode)) {
+    SETFLAG(file->flags, F_IS_SYMLINK);
+    if (fstatat(dfd, name, &st, 0) != 0) return -1;
+  }
+ #else
+  if (fstatat(dfd, name, &st, 0) != 0) return -1;
+ #endif
+  set_file_stats(file, &st);
+  return 0;
+}
+#endif /* ON_WINDOWS */
+
+
 extern inline int getfilestats(file_t * const restrict file)
 {
-  if (file == NULL || file->d_name == NULL) nullptr("getfilestats()");
-  LOUD(fprintf(stderr, "getfilestats('%s')\n", file->d_name);)
+#ifndef ON_WINDOWS
+  struct stat st;  /* Local so that scanning threads can share this */
+#endif
+  char path[FILE_PATH_SIZE];
+
+  if (file == NULL || file->name == NULL) nullptr("getfilestats()");
+  LOUD(fprintf(stderr, "getfilestats('%s')\n", file->name);)
 
   /* Don't stat the same file more than once */
   if (ISFLAG(file->flags, F_VALID_STAT)) return 0;
   SETFLAG(file->flags, F_VALID_STAT);
+  file_path(file, path);
 
 #ifdef ON_WINDOWS
-  if (win_stat(file->d_name, &ws) != 0) return -1;
+  if (win_stat(path, &ws) != 0) return -1;
   file->inode = ws.inode;
   file->size = ws.size;
   file->device = ws.device;
   file->mtime = ws.mtime;
+  file->mtime_nsec = 0;
+  file->ctime_ns = (int64_t)ws.ctime * 1000000000;
   file->mode = ws.mode;
  #ifndef NO_HARDLINKS
   file->nlink = ws.nlink;
  #endif /* NO_HARDLINKS */
 #else
-  if (stat(file->d_name, &s) != 0) return -1;
-  file->inode = s.st_ino;
-  file->size = s.st_size;
-  file->device = s.st_dev;
-  file->mtime = s.st_mtime;
-  file->mode = s.st_mode;
- #ifndef NO_PERMS
-  file->uid = s.st_uid;
-  file->gid = s.st_gid;
- #endif
+  if (stat(path, &st) != 0) return -1;
+  set_file_stats(file, &st);
  #ifndef NO_SYMLINKS
-  if (lstat(file->d_name, &s) != 0) return -1;
-  if (S_ISLNK(s.st_mode) > 0) SETFLAG(file->flags, F_IS_SYMLINK);
+  if (lstat(path, &st) != 0) return -1;
+  if (S_ISLNK(st.st_mode) > 0) SETFLAG(file->flags, F_IS_SYMLINK);
  #endif
 #endif /* ON_WINDOWS */
   return 0;
@@ -438,6 +591,10 @@ extern inline int getfilestats(file_t * const restrict file)
 extern int getdirstats(const char * const restrict name,
         jdupes_ino_t * const restrict inode, dev_t * const restrict dev)
 {
+#ifndef ON_WINDOWS
+  struct stat st;
+#endif
+
   if (name == NULL || inode == NULL || dev == NULL) nullptr("getdirstats");
   LOUD(fprintf(stderr, "getdirstats('%s', %p, %p)\n", name, (void *)inode, (void *)dev);)
 
@@ -446,9 +603,9 @@ extern int getdirstats(const char * const restrict name,
   *inode = ws.inode;
   *dev = ws.device;
 #else
-  if (stat(name, &s) != 0) return -1;
-  *inode = s.st_ino;
-  *dev = s.st_dev;
+  if (stat(name, &st) != 0) return -1;
+  *inode = st.st_ino;
+  *dev = st.st_dev;
 #endif /* ON_WINDOWS */
   return 0;
 }
@@ -462,9 +619,9 @@ extern int getdirstats(const char * const restrict name,
  *  2 on an absolute match condition met */
 extern int check_conditions(const file_t * const restrict file1, const file_t * const restrict file2)
 {
-  if (file1 == NULL || file2 == NULL || file1->d_name == NULL || file2->d_name == NULL) nullptr("check_conditions()");
+  if (file1 == NULL || file2 == NULL || file1->name == NULL || file2->name == NULL) nullptr("check_conditions()");
 
-  LOUD(fprintf(stderr, "check_conditions('%s', '%s')\n", file1->d_name, file2->d_name);)
+  LOUD(fprintf(stderr, "check_conditions('%s', '%s')\n", file1->name, file2->name);)
 
   /* Exclude based on -I/--isolate */
   if (ISFLAG(flags, F_ISOLATE) && (file1->user_order == file2->user_order)) {
@@ -521,127 +678,253 @@ extern int check_conditions(const file_t * const restrict file1, const file_t *
 }
 
 
-/* Create a new traversal check object and initialize its values */
-static struct travdone *travdone_alloc(const jdupes_ino_t inode, const dev_t device)
+#ifndef NO_THREADS
+static pthread_mutex_t travdone_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+
+/* Allocate a file_t for a name of 'len' bytes (not counting the
+ * terminating NUL) in 'dir' with everything but the name cleared */
+static file_t *new_file(const path_dir_t * const restrict dir,
+                const char * const restrict name, const size_t len)
 {
-  struct travdone *trav;
+  file_t * restrict newfile;
+
+  newfile = (file_t *)string_malloc(sizeof(file_t));
+  if (!newfile) oom("new_file() file structure");
+  newfile->name = (char *)string_malloc(len + 1);
+  if (!newfile->name) oom("new_file() filename");
+
+  newfile->next = NULL;
+  newfile->user_order = 0;
+  newfile->size = -1;
+  newfile->device = 0;
+  newfile->inode = 0;
+  newfile->mtime = 0;
+  newfile->mtime_nsec = 0;
+  newfile->ctime_ns = 0;
+  newfile->mode = 0;
+#ifdef ON_WINDOWS
+ #ifndef NO_HARDLINKS
+  newfile->nlink = 0;
+ #endif
+#endif
+#ifndef NO_PERMS
+  newfile->uid = 0;
+  newfile->gid = 0;
+#endif
+  newfile->filehash = 0;
+  newfile->filehash_partial = 0;
+  newfile->filehash_tail = 0;
+  newfile->filehash_sample = 0;
+  SET_HASH_EXT(newfile->filehash_ext, 0);
+  SET_HASH_EXT(newfile->filehash_partial_ext, 0);
+  newfile->duplicates = NULL;
+  newfile->flags = 0;
+#ifdef SORT_KEYS
+  newfile->sortkey = NULL;
+  newfile->sortkey_len = 0;
+#endif
+
+  newfile->dir = dir;
+  memcpy(newfile->name, name, len);
+  newfile->name[len] = '\0';
+  return newfile;
+}
 
-  LOUD(fprintf(stderr, "travdone_alloc(%" PRIdMAX ", %" PRIdMAX ")\n", (intmax_t)inode, (intmax_t)device);)
 
-  trav = (struct travdone *)string_malloc(sizeof(struct travdone));
-  if (trav == NULL) {
-    LOUD(fprintf(stderr, "travdone_alloc: malloc failed\n");)
-    return NULL;
+/* Check a stat()ed file against the size and link exclusion options
+ * Returns 1 if the file should be left out */
+static int exclude_file(const file_t * const restrict newfile)
+{
+  /* Exclude zero-length files if requested */
+  if (!S_ISDIR(newfile->mode) && newfile->size == 0 && !ISFLAG(flags, F_INCLUDEEMPTY)) {
+    LOUD(fprintf(stderr, "exclude_file: excluding zero-length empty file (-z not set)\n"));
+    return 1;
+  }
+
+  /* Exclude files below --xsize parameter */
+  if (!S_ISDIR(newfile->mode) && ISFLAG(flags, F_EXCLUDESIZE)) {
+    if (
+        ((excludetype == SMALLERTHAN) && (newfile->size < (off_t)excludesize)) ||
+        ((excludetype == LARGERTHAN) && (newfile->size > (off_t)excludesize))
+    ) {
+      LOUD(fprintf(stderr, "exclude_file: excluding based on xsize limit (-x set)\n"));
+      return 1;
+    }
+  }
+
+  /* Windows has a 1023 (+1) hard link limit. If we're hard linking,
+   * ignore all files that have hit this limit */
+#ifdef ON_WINDOWS
+ #ifndef NO_HARDLINKS
+  if (ISFLAG(flags, F_HARDLINKFILES) && newfile->nlink >= 1024) {
+  #ifdef DEBUG
+    hll_exclude++;
+  #endif
+    LOUD(fprintf(stderr, "exclude_file: excluding due to Windows 1024 hard link limit\n"));
+    return 1;
   }
-  trav->left = NULL;
-  trav->right = NULL;
+ #endif
+#endif
+  return 0;
+}
+
+
+/* Regular files can be matched, and so can symlinks to them with -s */
+static inline int usable_file(const file_t * const restrict newfile)
+{
+#ifndef NO_SYMLINKS
+  return (S_ISREG(newfile->mode) && !ISFLAG(newfile->flags, F_IS_SYMLINK))
+      || (ISFLAG(newfile->flags, F_IS_SYMLINK) && ISFLAG(flags, F_FOLLOWLINKS));
+#else
+  return S_ISREG(newfile->mode);
+#endif
+}
+
+
+static inline size_t travdone_bucket(const jdupes_ino_t inode, const dev_t device)
+{
+  return (size_t)((((uint64_t)inode * 0x9e3779b97f4a7c15ULL) ^ (uint64_t)device) >> 32) & (TRAVDONE_BUCKETS - 1);
+}
+
+
+/* Find the traversal record for a directory, creating it if it doesn't
+ * exist yet. Whoever creates the record owns scanning that directory.
+ * If a new record is created, it takes over 'dir'; otherwise the caller
+ * keeps it. Returns NULL on allocation failure. */
+static struct travdone *travdone_claim(const jdupes_ino_t inode, const dev_t device,
+                path_dir_t * const restrict dir, const int recurse, int * const restrict isnew)
+{
+  struct travdone *trav;
+  size_t bucket;
+
+  LOUD(fprintf(stderr, "travdone_claim(%" PRIdMAX ", %" PRIdMAX ")\n", (intmax_t)inode, (intmax_t)device);)
+
+  bucket = travdone_bucket(inode, device);
+  *isnew = 0;
+
+#ifndef NO_THREADS
+  pthread_mutex_lock(&travdone_lock);
+#endif
+  for (trav = travdone_table[bucket]; trav != NULL; trav = trav->next)
+    if (trav->inode == inode && trav->device == device) goto claim_done;
+
+  trav = (struct travdone *)malloc(sizeof(struct travdone));
+  if (trav == NULL) goto claim_done;
+  trav->next = travdone_table[bucket];
   trav->inode = inode;
   trav->device = device;
-  LOUD(fprintf(stderr, "travdone_alloc returned %p\n", (void *)trav);)
+  trav->dir = dir;
+  trav->items = NULL;
+  trav->item_count = 0;
+  trav->item_max = 0;
+  trav->recurse = recurse;
+  trav->emitted = 0;
+  travdone_table[bucket] = trav;
+  *isnew = 1;
+
+claim_done:
+#ifndef NO_THREADS
+  pthread_mutex_unlock(&travdone_lock);
+#endif
+  LOUD(fprintf(stderr, "travdone_claim returned %p (new: %d)\n", (void *)trav, *isnew);)
+  return trav;
+}
+
+
+/* Find the traversal record of a directory that has already been
+ * scanned; only safe once scanning threads are done */
+static struct travdone *travdone_find(const jdupes_ino_t inode, const dev_t device)
+{
+  struct travdone *trav;
+
+  for (trav = travdone_table[travdone_bucket(inode, device)]; trav != NULL; trav = trav->next)
+    if (trav->inode == inode && trav->device == device) break;
   return trav;
 }
 
 
-/* Load a directory's contents into the file tree, recursing as needed */
-static void grokdir(const char * const restrict dir,
-                file_t * restrict * const restrict filelistp,
-                int recurse)
+/* Append a file or a subdirectory to a directory's contents */
+static void scanitem_add(struct travdone * const restrict trav,
+                file_t * const restrict file, struct travdone * const restrict dir)
+{
+  struct scanitem *items;
+
+  if (trav->item_count == trav->item_max) {
+    trav->item_max = (trav->item_max == 0) ? 32 : trav->item_max * 2;
+    items = (struct scanitem *)realloc(trav->items, sizeof(struct scanitem) * trav->item_max);
+    if (items == NULL) oom("scanitem_add()");
+    trav->items = items;
+  }
+  trav->items[trav->item_count].file = file;
+  trav->items[trav->item_count].dir = dir;
+  trav->item_count++;
+  return;
+}
+
+
+/* Read one directory's contents into its traversal record
+ * Files that pass all exclusion checks are stored in readdir() order
+ * along with the subdirectories to descend into, which are claimed and
+ * queued for scanning as they are found. Only this thread touches the
+ * record while it is being scanned. */
+static void grokdir(struct travdone * const restrict trav,
+                struct pool_queue * const restrict queue, const unsigned int thread)
 {
   file_t * restrict newfile;
-#ifndef NO_SYMLINKS
-  static struct stat linfo;
-#endif
   struct dirent *dirinfo;
-  static int grokdir_level = 0;
-  static char tempname[PATHBUF_SIZE * 2];
+  char dir[FILE_PATH_SIZE];
   size_t dirlen;
-  struct travdone *traverse;
-  jdupes_ino_t inode, n_inode;
-  dev_t device, n_device;
 #ifdef UNICODE
+  char tempname[FILE_PATH_SIZE];
   WIN32_FIND_DATA ffd;
   HANDLE hFind = INVALID_HANDLE_VALUE;
   char *p;
 #else
   DIR *cd;
+  int dfd;
 #endif
 
-  if (dir == NULL || filelistp == NULL) nullptr("grokdir()");
+  if (trav->dir == NULL) nullptr("grokdir()");
+  dirlen = path_build(dir, trav->dir, NULL);
   LOUD(fprintf(stderr, "grokdir: scanning '%s' (order %d)\n", dir, user_dir_count));
 
-  /* Double traversal prevention tree */
-  if (getdirstats(dir, &inode, &device) != 0) goto error_travdone;
-  if (travdone_head == NULL) {
-    travdone_head = travdone_alloc(inode, device);
-    if (travdone_head == NULL) goto error_travdone;
-  } else {
-    traverse = travdone_head;
-    while (1) {
-      if (traverse == NULL) nullptr("grokdir() traverse");
-      /* Don't re-traverse directories we've already seen */
-      if (inode == traverse->inode && device == traverse->device) {
-        LOUD(fprintf(stderr, "already seen dir '%s', skipping\n", dir);)
-        return;
-      } else if (inode > traverse->inode || (inode == traverse->inode && device > traverse->device)) {
-        /* Traverse right */
-        if (traverse->right == NULL) {
-          LOUD(fprintf(stderr, "traverse dir right '%s'\n", dir);)
-          traverse->right = travdone_alloc(inode, device);
-          if (traverse->right == NULL) goto error_travdone;
-          break;
-        }
-        traverse = traverse->right;
-        continue;
-      } else {
-        /* Traverse left */
-        if (traverse->left == NULL) {
-          LOUD(fprintf(stderr, "traverse dir left '%s'\n", dir);)
-          traverse->left = travdone_alloc(inode, device);
-          if (traverse->left == NULL) goto error_travdone;
-          break;
-        }
-        traverse = traverse->left;
-        continue;
-      }
-    }
-  }
-
-  dir_progress++;
-  grokdir_level++;
+  __atomic_add_fetch(&dir_progress, 1, __ATOMIC_RELAXED);
 
 #ifdef UNICODE
   /* Windows requires \* at the end of directory names */
-  strncpy(tempname, dir, PATHBUF_SIZE * 2);
-  dirlen = strlen(tempname) - 1;
-  p = tempname + dirlen;
+  strncpy(tempname, dir, FILE_PATH_SIZE);
+  p = tempname + dirlen - 1;
   if (*p == '/' || *p == '\\') *p = '\0';
-  strncat(tempname, "\\*", PATHBUF_SIZE * 2);
+  strncat(tempname, "\\*", FILE_PATH_SIZE);
 
   if (!M2W(tempname, wname)) goto error_cd;
 
   LOUD(fprintf(stderr, "FindFirstFile: %s\n", dir));
   hFind = FindFirstFile((LPCWSTR)wname, &ffd);
   if (hFind == INVALID_HANDLE_VALUE) { fprintf(stderr, "\nfile handle bad\n"); goto error_cd; }
+  STATS(stats_add_opens(1);)
   LOUD(fprintf(stderr, "Loop start\n"));
   do {
-    char * restrict tp = tempname;
     size_t d_name_len;
 
-    /* Get necessary length and allocate d_name */
+    /* Get the entry's name */
     dirinfo = (struct dirent *)string_malloc(sizeof(struct dirent));
     if (!W2M(ffd.cFileName, dirinfo->d_name)) continue;
 #else
   cd = opendir(dir);
   if (!cd) goto error_cd;
+  STATS(stats_add_opens(1);)
+  dfd = dirfd(cd);
 
   while ((dirinfo = readdir(cd)) != NULL) {
-    char * restrict tp = tempname;
     size_t d_name_len;
 #endif /* UNICODE */
 
     LOUD(fprintf(stderr, "grokdir: readdir: '%s'\n", dirinfo->d_name));
     if (strcmp(dirinfo->d_name, ".") && strcmp(dirinfo->d_name, "..")) {
-      if (!ISFLAG(flags, F_HIDEPROGRESS)) {
+      if (thread == 0 && !ISFLAG(flags, F_HIDEPROGRESS)) {
         gettimeofday(&time2, NULL);
         if (progress == 0 || time2.tv_sec > time1.tv_sec) {
           fprintf(stderr, "\rScanning: %" PRIuMAX " files, %" PRIuMAX " dirs (in %u specified)",
@@ -650,163 +933,107 @@ static void grokdir(const char * const restrict dir,
         time1.tv_sec = time2.tv_sec;
       }
 
-      /* Assemble the file's full path name, optimized to avoid strcat() */
-      dirlen = strlen(dir);
-      d_name_len = strlen(dirinfo->d_name);
-      memcpy(tp, dir, dirlen+1);
-      if (dirlen != 0 && tp[dirlen-1] != dir_sep) {
-        tp[dirlen] = dir_sep;
-        dirlen++;
+      /* Exclude hidden files if requested */
+      if (ISFLAG(flags, F_EXCLUDEHIDDEN) && dirinfo->d_name[0] == '.') {
+        LOUD(fprintf(stderr, "grokdir: excluding hidden file (-A on)\n"));
+        continue;
       }
-      if (dirlen + d_name_len + 1 >= (PATHBUF_SIZE * 2)) goto error_overflow;
-      tp += dirlen;
-      memcpy(tp, dirinfo->d_name, d_name_len);
-      tp += d_name_len;
-      *tp = '\0';
-      d_name_len++;
-
-      /* Allocate the file_t and the d_name entries */
-      newfile = (file_t *)string_malloc(sizeof(file_t));
-      if (!newfile) oom("grokdir() file structure");
-      newfile->d_name = (char *)string_malloc(dirlen + d_name_len + 2);
-      if (!newfile->d_name) oom("grokdir() filename");
-
-      newfile->next = *filelistp;
-      newfile->user_order = user_dir_count;
-      newfile->size = -1;
-      newfile->device = 0;
-      newfile->inode = 0;
-      newfile->mtime = 0;
-      newfile->mode = 0;
-#ifdef ON_WINDOWS
- #ifndef NO_HARDLINKS
-      newfile->nlink = 0;
+
+#ifdef DT_UNKNOWN
+      /* Skip entries that can't be used without stat()ing them at all */
+      switch (dirinfo->d_type) {
+        case DT_UNKNOWN:
+        case DT_REG:
+          break;
+        case DT_DIR:
+          if (!trav->recurse) {
+            LOUD(fprintf(stderr, "grokdir: directory: not recursing\n"));
+            continue;
+          }
+          break;
+        case DT_LNK:
+ #ifndef NO_SYMLINKS
+          /* Symlinks are never recursed and only added with -s */
+          if (!ISFLAG(flags, F_FOLLOWLINKS)) {
+            LOUD(fprintf(stderr, "grokdir: not following symlink (-s not set)\n"));
+            continue;
+          }
  #endif
-#endif
-#ifndef NO_PERMS
-      newfile->uid = 0;
-      newfile->gid = 0;
-#endif
-      newfile->filehash = 0;
-      newfile->filehash_partial = 0;
-      newfile->duplicates = NULL;
-      newfile->flags = 0;
-
-      tp = tempname;
-      memcpy(newfile->d_name, tp, dirlen + d_name_len);
-
-      if (ISFLAG(flags, F_EXCLUDEHIDDEN)) {
-        /* WARNING: Re-used tp here to eliminate a strdup() */
-        strncpy(tp, newfile->d_name, dirlen + d_name_len);
-        tp = basename(tp);
-        if (tp[0] == '.' && strcmp(tp, ".") && strcmp(tp, "..")) {
-          LOUD(fprintf(stderr, "grokdir: excluding hidden file (-A on)\n"));
-          string_free(newfile->d_name);
-          string_free(newfile);
+          break;
+        default:
+          LOUD(fprintf(stderr, "grokdir: not a regular file or directory\n"));
           continue;
-        }
       }
+#endif /* DT_UNKNOWN */
+
+      /* Only the name is stored, but the full path must still fit */
+      d_name_len = strlen(dirinfo->d_name);
+      if (dirlen + d_name_len + 2 >= FILE_PATH_SIZE) goto error_overflow;
+
+      /* Allocate the file_t and its name */
+      newfile = new_file(trav->dir, dirinfo->d_name, d_name_len);
 
       /* Get file information and check for validity */
+#ifdef ON_WINDOWS
       const int i = getfilestats(newfile);
+#else
+      const int i = getentrystats(dfd, dirinfo->d_name, newfile);
+#endif
       if (i || newfile->size == -1) {
         LOUD(fprintf(stderr, "grokdir: excluding due to bad stat()\n"));
-        string_free(newfile->d_name);
-        string_free(newfile);
-        continue;
-      }
-
-      /* Exclude zero-length files if requested */
-      if (!S_ISDIR(newfile->mode) && newfile->size == 0 && !ISFLAG(flags, F_INCLUDEEMPTY)) {
-        LOUD(fprintf(stderr, "grokdir: excluding zero-length empty file (-z not set)\n"));
-        string_free(newfile->d_name);
-        string_free(newfile);
-        continue;
-      }
-
-      /* Exclude files below --xsize parameter */
-      if (!S_ISDIR(newfile->mode) && ISFLAG(flags, F_EXCLUDESIZE)) {
-        if (
-            ((excludetype == SMALLERTHAN) && (newfile->size < (off_t)excludesize)) ||
-            ((excludetype == LARGERTHAN) && (newfile->size > (off_t)excludesize))
-        ) {
-          LOUD(fprintf(stderr, "grokdir: excluding based on xsize limit (-x set)\n"));
-          string_free(newfile->d_name);
-          string_free(newfile);
-          continue;
-        }
-      }
-
-#ifndef NO_SYMLINKS
-      /* Get lstat() information */
-      if (lstat(newfile->d_name, &linfo) == -1) {
-        LOUD(fprintf(stderr, "grokdir: excluding due to bad lstat()\n"));
-        string_free(newfile->d_name);
-        string_free(newfile);
-        continue;
+        goto skip_file;
       }
-#endif
+      if (exclude_file(newfile)) goto skip_file;
 
-      /* Windows has a 1023 (+1) hard link limit. If we're hard linking,
-       * ignore all files that have hit this limit */
-#ifdef ON_WINDOWS
- #ifndef NO_HARDLINKS
-      if (ISFLAG(flags, F_HARDLINKFILES) && newfile->nlink >= 1024) {
-  #ifdef DEBUG
-        hll_exclude++;
-  #endif
-        LOUD(fprintf(stderr, "grokdir: excluding due to Windows 1024 hard link limit\n"));
-        string_free(newfile->d_name);
-        string_free(newfile);
-        continue;
-      }
- #endif
-#endif
       /* Optionally recurse directories, including symlinked ones if requested */
       if (S_ISDIR(newfile->mode)) {
-        if (recurse) {
+        if (trav->recurse
+#ifndef NO_SYMLINKS
+            && /*ISFLAG(flags, F_FOLLOWLINKS) ||*/ !ISFLAG(newfile->flags, F_IS_SYMLINK)
+#endif
+           ) {
           /* --one-file-system */
-          if (ISFLAG(flags, F_ONEFS)
-              && (getdirstats(newfile->d_name, &n_inode, &n_device) == 0)
-              && (device != n_device)) {
+          if (ISFLAG(flags, F_ONEFS) && (trav->device != newfile->device)) {
             LOUD(fprintf(stderr, "grokdir: directory: not recursing (--one-file-system)\n"));
-            string_free(newfile->d_name);
-            string_free(newfile);
-            continue;
-          }
-#ifndef NO_SYMLINKS
-          else if (/*ISFLAG(flags, F_FOLLOWLINKS) ||*/ !S_ISLNK(linfo.st_mode)) {
-            LOUD(fprintf(stderr, "grokdir: directory: recursing (-r/-R)\n"));
-            grokdir(newfile->d_name, filelistp, recurse);
-          }
-#else
-          else {
+            goto skip_file;
+          } else {
+            struct travdone *subdir;
+            path_dir_t *subpath;
+            int isnew;
+
             LOUD(fprintf(stderr, "grokdir: directory: recursing (-r/-R)\n"));
-            grokdir(newfile->d_name, filelistp, recurse);
+            subpath = path_dir_new(trav->dir, newfile->name, d_name_len);
+            subdir = travdone_claim(newfile->inode, newfile->device, subpath, trav->recurse, &isnew);
+            if (subdir == NULL) oom("grokdir() travdone");
+            scanitem_add(trav, NULL, subdir);
+            if (isnew) {
+              /* The traversal record now owns the directory name */
+              pool_queue_push(queue, subdir);
+              goto skip_file;
+            }
+            string_free(subpath);
+            LOUD(fprintf(stderr, "already seen dir '%s', skipping\n", newfile->name);)
           }
-#endif
         }
         LOUD(fprintf(stderr, "grokdir: directory: not recursing\n"));
-        string_free(newfile->d_name);
-        string_free(newfile);
-        continue;
+        goto skip_file;
       } else {
         /* Add regular files to list, including symlink targets if requested */
-#ifndef NO_SYMLINKS
-        if (S_ISREG(linfo.st_mode) || (S_ISLNK(linfo.st_mode) && ISFLAG(flags, F_FOLLOWLINKS))) {
-#else
-        if (S_ISREG(newfile->mode)) {
-#endif
-          *filelistp = newfile;
-          filecount++;
-          progress++;
-        } else {
-          LOUD(fprintf(stderr, "grokdir: not a regular file: %s\n", newfile->d_name);)
-          string_free(newfile->d_name);
-          string_free(newfile);
+        if (usable_file(newfile)) {
+          scanitem_add(trav, newfile, NULL);
+          __atomic_add_fetch(&filecount, 1, __ATOMIC_RELAXED);
+          __atomic_add_fetch(&progress, 1, __ATOMIC_RELAXED);
           continue;
+        } else {
+          LOUD(fprintf(stderr, "grokdir: not a regular file: %s\n", newfile->name);)
+          goto skip_file;
         }
       }
+
+skip_file:
+      string_free(newfile->name);
+      string_free(newfile);
+      continue;
     }
   }
 #ifdef UNICODE
@@ -815,18 +1042,8 @@ static void grokdir(const char * const restrict dir,
 #else
   closedir(cd);
 #endif
-
-
-  grokdir_level--;
-  if (grokdir_level == 0 && !ISFLAG(flags, F_HIDEPROGRESS)) {
-    fprintf(stderr, "\rScanning: %" PRIuMAX " files, %" PRIuMAX " dirs (in %u specified)",
-            progress, dir_progress, user_dir_count);
-  }
   return;
 
-error_travdone:
-  fprintf(stderr, "\ncould not stat dir "); fwprint(stderr, dir, 1);
-  return;
 error_cd:
   fprintf(stderr, "\ncould not chdir to "); fwprint(stderr, dir, 1);
   return;
@@ -835,85 +1052,453 @@ error_overflow:
   exit(EXIT_FAILURE);
 }
 
-/* Use Jody Bruchon's hash function on part or all of a file */
-static hash_t *get_filehash(const file_t * const restrict checkfile,
-                const size_t max_read)
+
+/* Thread pool task wrapper for grokdir() */
+static void grokdir_task(struct pool_queue * const queue, void * const task,
+                const unsigned int thread)
 {
-  off_t fsize;
-  /* This is an array because we return a pointer to it */
-  static hash_t hash[1];
-  static hash_t chunk[(CHUNK_SIZE / sizeof(hash_t))];
-  FILE *file;
-  int check = 0;
+  /* Each scanning thread allocates from its own string_malloc() arena */
+  if (string_malloc_arena(thread) != 0) oom("grokdir_task()");
+  grokdir((struct travdone *)task, queue, thread);
+  return;
+}
 
-  if (checkfile == NULL || checkfile->d_name == NULL) nullptr("get_filehash()");
-  LOUD(fprintf(stderr, "get_filehash('%s', %" PRIdMAX ")\n", checkfile->d_name, (intmax_t)max_read);)
 
-  /* Get the file size. If we can't read it, bail out early */
-  if (checkfile->size == -1) {
-    LOUD(fprintf(stderr, "get_filehash: not hashing because stat() info is bad\n"));
-    return NULL;
+/* Add a scanned directory's files to the file list in the order a
+ * single-threaded depth-first scan would have found them. A directory
+ * that was reached by more than one path is only added the first time
+ * it comes up in that order, exactly as if it were scanned right then. */
+static void grokdir_merge(struct travdone * const restrict trav,
+                file_t * restrict * const restrict filelistp)
+{
+  struct scanitem *item;
+
+  trav->emitted = 1;
+  for (size_t i = 0; i < trav->item_count; i++) {
+    item = &trav->items[i];
+    if (item->file != NULL) {
+      item->file->user_order = user_dir_count;
+      item->file->next = *filelistp;
+      *filelistp = item->file;
+    } else if (!item->dir->emitted) {
+      grokdir_merge(item->dir, filelistp);
+    }
   }
-  fsize = checkfile->size;
 
-  /* Do not read more than the requested number of bytes */
-  if (max_read > 0 && fsize > (off_t)max_read)
-    fsize = (off_t)max_read;
+  /* Only the device and inode are needed from here on; the directory
+   * name stays around for the files that were found in it */
+  free(trav->items);
+  trav->items = NULL;
+  trav->item_count = 0;
+  return;
+}
 
-  /* Initialize the hash and file read parameters (with filehash_partial skipped)
-   *
-   * If we already hashed the first chunk of this file, we don't want to
-   * wastefully read and hash it again, so skip the first chunk and use
-   * the computed hash for that chunk as our starting point.
-   *
-   * WARNING: We assume max_read is NEVER less than CHUNK_SIZE here! */
 
-  *hash = 0;
-  if (ISFLAG(checkfile->flags, F_HASH_PARTIAL)) {
-    *hash = checkfile->filehash_partial;
-    /* Don't bother going further if max_read is already fulfilled */
-    if (max_read != 0 && max_read <= PARTIAL_HASH_SIZE) {
-      LOUD(fprintf(stderr, "Partial hash size (%d) >= max_read (%" PRIuMAX "), not hashing anymore\n", PARTIAL_HASH_SIZE, (uintmax_t)max_read);)
-      return hash;
-    }
-  }
-#ifdef UNICODE
-  if (!M2W(checkfile->d_name, wstr)) file = NULL;
-  else file = _wfopen(wstr, FILE_MODE_RO);
-#else
-  file = fopen(checkfile->d_name, FILE_MODE_RO);
-#endif
-  if (file == NULL) {
-    fprintf(stderr, "\nerror opening file "); fwprint(stderr, checkfile->d_name, 1);
-    return NULL;
-  }
-  /* Actually seek past the first chunk if applicable
-   * This is part of the filehash_partial skip optimization */
-  if (ISFLAG(checkfile->flags, F_HASH_PARTIAL)) {
-    if (fseeko(file, PARTIAL_HASH_SIZE, SEEK_SET) == -1) {
-      fclose(file);
-      fprintf(stderr, "\nerror seeking in file "); fwprint(stderr, checkfile->d_name, 1);
-      return NULL;
-    }
-    fsize -= PARTIAL_HASH_SIZE;
-  }
-  /* Read the file in CHUNK_SIZE chunks until we've read it all. */
-  while (fsize > 0) {
-    size_t bytes_to_read;
+/* Load a directory's contents into the file list, recursing as needed
+ * Subdirectories are scanned by up to hash_threads threads at once */
+static void grokdirs(const char * const restrict dir,
+                file_t * restrict * const restrict filelistp, const int recurse)
+{
+  struct travdone *trav;
+  jdupes_ino_t inode;
+  dev_t device;
+  path_dir_t *path;
+  int isnew;
 
-    if (interrupt) return 0;
-    bytes_to_read = (fsize >= (off_t)auto_chunk_size) ? auto_chunk_size : (size_t)fsize;
-    if (fread((void *)chunk, bytes_to_read, 1, file) != 1) {
-      fprintf(stderr, "\nerror reading from file "); fwprint(stderr, checkfile->d_name, 1);
-      fclose(file);
-      return NULL;
-    }
+  if (dir == NULL || filelistp == NULL) nullptr("grokdirs()");
+  LOUD(fprintf(stderr, "grokdirs: scanning '%s' (order %d)\n", dir, user_dir_count));
 
-    *hash = jody_block_hash(chunk, *hash, bytes_to_read);
-    if ((off_t)bytes_to_read > fsize) break;
-    else fsize -= (off_t)bytes_to_read;
+  /* Double traversal prevention */
+  if (getdirstats(dir, &inode, &device) != 0) goto error_travdone;
+  path = path_dir_new(NULL, dir, strlen(dir));
+  trav = travdone_claim(inode, device, path, recurse, &isnew);
+  if (trav == NULL) oom("grokdirs() travdone");
+  if (!isnew) {
+    LOUD(fprintf(stderr, "already seen dir '%s', skipping\n", dir);)
+    string_free(path);
+    return;
+  }
 
-    if (!ISFLAG(flags, F_HIDEPROGRESS)) {
+  pool_queue_run(hash_threads, grokdir_task, trav);
+  grokdir_merge(trav, filelistp);
+
+  if (!ISFLAG(flags, F_HIDEPROGRESS)) {
+    fprintf(stderr, "\rScanning: %" PRIuMAX " files, %" PRIuMAX " dirs (in %u specified)",
+            progress, dir_progress, user_dir_count);
+  }
+  return;
+
+error_travdone:
+  fprintf(stderr, "\ncould not stat dir "); fwprint(stderr, dir, 1);
+  return;
+}
+
+
+/* Paths from --files-from are stat()ed in batches of this many so that
+ * hash_threads threads can work on each batch */
+#define FILES_FROM_BATCH 4096
+#define FILES_FROM_BUFSIZE 65536
+
+/* A listed file waiting in a batch, with the identity of its directory */
+struct listentry {
+  file_t *file;
+  jdupes_ino_t dir_inode;
+  dev_t dir_device;
+  int dir_known;
+};
+
+/* Listed files already added to the file list (see files_from_seen()) */
+#ifndef LISTED_BUCKETS
+#define LISTED_BUCKETS 4096  /* Must be a power of two */
+#endif
+struct listed {
+  struct listed *next;
+  jdupes_ino_t inode;
+  dev_t device;
+  const char *name;  /* NULL if inode and device are the file's own */
+};
+static struct listed *listed_table[LISTED_BUCKETS];
+
+/* stat() one file of a batch (thread pool work function) */
+static void files_from_stat(void * const ctx, const size_t item, const unsigned int thread)
+{
+  file_t * const restrict file = ((struct listentry *)ctx)[item].file;
+
+  (void)thread;
+  if (getfilestats(file) != 0) file->size = -1;
+  return;
+}
+
+
+/* Check whether a listed file is already in the file list and remember
+ * it if it isn't. A directory entry is known by the device and inode of
+ * its directory plus its name, which catches a repeated line, another
+ * spelling of the same path (a/f, ./a/f, or a path through a symlinked
+ * directory), and a file in a directory that grokdirs() already scanned.
+ * If the directory couldn't be stat()ed, the file's own device and inode
+ * are used instead. A file that got in twice would match itself under -H
+ * and could be deleted as its own duplicate. */
+static int files_from_seen(const struct listentry * const restrict entry)
+{
+  const file_t * const restrict file = entry->file;
+  struct listed *listed;
+  const char *name = NULL;
+  jdupes_ino_t inode = file->inode;
+  dev_t device = file->device;
+  uint64_t key;
+  size_t bucket;
+
+  if (entry->dir_known) {
+    if (travdone_find(entry->dir_inode, entry->dir_device) != NULL) return 1;
+    inode = entry->dir_inode;
+    device = entry->dir_device;
+    name = file->name;
+  }
+
+  key = ((uint64_t)inode * 0x9e3779b97f4a7c15ULL) ^ (uint64_t)device;
+  if (name != NULL) for (const char *p = name; *p != '\0'; p++)
+    key = (key ^ (unsigned char)*p) * 0x100000001b3ULL;
+  bucket = (size_t)(key >> 32) & (LISTED_BUCKETS - 1);
+  for (listed = listed_table[bucket]; listed != NULL; listed = listed->next) {
+    if (listed->inode != inode || listed->device != device) continue;
+    if (name == NULL && listed->name == NULL) return 1;
+    if (name != NULL && listed->name != NULL && strcmp(name, listed->name) == 0) return 1;
+  }
+
+  listed = (struct listed *)malloc(sizeof(struct listed));
+  if (listed == NULL) oom("files_from_seen()");
+  listed->next = listed_table[bucket];
+  listed->inode = inode;
+  listed->device = device;
+  listed->name = name;
+  listed_table[bucket] = listed;
+  return 0;
+}
+
+
+/* stat() a batch of listed files and add the usable ones to the file list */
+static void files_from_batch(struct listentry * const restrict batch, const size_t count,
+                file_t * restrict * const restrict filelistp)
+{
+  unsigned int threads = hash_threads;
+  char path[FILE_PATH_SIZE];
+
+  LOUD(fprintf(stderr, "files_from_batch(%" PRIuMAX " files)\n", (uintmax_t)count);)
+#ifdef ON_WINDOWS
+  /* getfilestats() shares one stat buffer on Windows */
+  threads = 1;
+#endif
+  pool_run(threads, count, files_from_stat, batch);
+
+  for (size_t i = 0; i < count; i++) {
+    file_t * const restrict newfile = batch[i].file;
+
+    if (newfile->size == -1) {
+      fprintf(stderr, "\ncould not stat "); fwprint(stderr, file_path(newfile, path), 1);
+      goto skip_file;
+    }
+    if (exclude_file(newfile)) goto skip_file;
+    if (!usable_file(newfile)) {
+      LOUD(fprintf(stderr, "files_from_batch: not a regular file: %s\n", newfile->name);)
+      goto skip_file;
+    }
+    if (files_from_seen(&batch[i])) {
+      LOUD(fprintf(stderr, "files_from_batch: already in the file list: %s\n", newfile->name);)
+      goto skip_file;
+    }
+    newfile->user_order = user_dir_count;
+    newfile->next = *filelistp;
+    *filelistp = newfile;
+    filecount++;
+    progress++;
+    continue;
+
+skip_file:
+    string_free(newfile->name);
+    string_free(newfile);
+  }
+
+  if (!ISFLAG(flags, F_HIDEPROGRESS)) {
+    fprintf(stderr, "\rScanning: %" PRIuMAX " files, %" PRIuMAX " dirs (in %u specified)",
+            progress, dir_progress, user_dir_count);
+  }
+  return;
+}
+
+
+/* Add one path read by grokfilelist() to the current batch
+ * Lists usually name many files in a row from the same directory, so
+ * the directory part (separator included) is only stored again when it
+ * differs from the one before it */
+static void files_from_add(char * const restrict path, size_t len, const int delim,
+                struct listentry * const restrict batch, size_t * const restrict nbatch,
+                file_t * restrict * const restrict filelistp)
+{
+  static path_dir_t *lastdir = NULL;
+  static int dirstat = -2;  /* getdirstats() result for lastdir, -2 before the first */
+  static jdupes_ino_t dir_inode;
+  static dev_t dir_device;
+  struct listentry *entry;
+  const char *base;
+  size_t dirlen;
+
+  /* Lists written on Windows may end lines with CR LF */
+  if (delim == '\n' && len > 0 && path[len - 1] == '\r') len--;
+  if (len == 0) return;
+  if (len >= PATHBUF_SIZE) {
+    fprintf(stderr, "\nwarning: skipping a path in the file list that is too long\n");
+    return;
+  }
+  path[len] = '\0';
+  slash_convert(path);
+
+  /* Exclude hidden files if requested */
+  base = strrchr(path, dir_sep);
+  base = (base == NULL) ? path : base + 1;
+  if (ISFLAG(flags, F_EXCLUDEHIDDEN) && *base == '.') {
+    LOUD(fprintf(stderr, "files_from_add: excluding hidden file (-A on)\n"));
+    return;
+  }
+
+  /* The directory is stat()ed once per run of names in it */
+  dirlen = (size_t)(base - path);
+  if (dirlen == 0) {
+    if (lastdir != NULL || dirstat == -2) {
+      lastdir = NULL;
+      dirstat = getdirstats(".", &dir_inode, &dir_device);
+    }
+  } else if (lastdir == NULL || lastdir->len != dirlen || memcmp(lastdir->name, path, dirlen) != 0) {
+    lastdir = path_dir_new(NULL, path, dirlen);
+    dirstat = getdirstats(lastdir->name, &dir_inode, &dir_device);
+  }
+  entry = &batch[(*nbatch)++];
+  entry->file = new_file(lastdir, base, len - dirlen);
+  entry->dir_inode = dir_inode;
+  entry->dir_device = dir_device;
+  entry->dir_known = (dirstat == 0);
+  if (*nbatch == FILES_FROM_BATCH) {
+    files_from_batch(batch, *nbatch, filelistp);
+    *nbatch = 0;
+  }
+  return;
+}
+
+
+/* Load the files named in a list (--files-from) instead of scanning
+ * directories. Names are separated by 'delim' (newline or NUL) and the
+ * list is read from stdin if listname is "-". */
+static void grokfilelist(const char * const restrict listname, const int delim,
+                file_t * restrict * const restrict filelistp)
+{
+  struct listentry *batch;
+  char *buf, *p;
+  size_t nbatch = 0, len = 0, start, got;
+  int toolong = 0;
+  FILE *fp;
+
+  if (listname == NULL || filelistp == NULL) nullptr("grokfilelist()");
+  LOUD(fprintf(stderr, "grokfilelist('%s')\n", listname));
+
+  if (strcmp(listname, "-") == 0) fp = stdin;
+  else {
+#ifdef UNICODE
+    if (!M2W(listname, wstr)) fp = NULL;
+    else fp = _wfopen(wstr, L"rb");
+#else
+    fp = fopen(listname, "rb");
+#endif
+  }
+  if (fp == NULL) {
+    fprintf(stderr, "\ncould not open file list "); fwprint(stderr, listname, 1);
+    string_malloc_destroy();
+    exit(EXIT_FAILURE);
+  }
+
+  /* Room for one whole path left over from the last read, plus a read */
+  buf = (char *)malloc(PATHBUF_SIZE + FILES_FROM_BUFSIZE + 1);
+  batch = (struct listentry *)malloc(sizeof(struct listentry) * FILES_FROM_BATCH);
+  if (buf == NULL || batch == NULL) oom("grokfilelist()");
+
+  do {
+    got = fread(buf + len, 1, FILES_FROM_BUFSIZE, fp);
+    len += got;
+    start = 0;
+    while (start < len && (p = (char *)memchr(buf + start, delim, len - start)) != NULL) {
+      if (toolong) toolong = 0;
+      else files_from_add(buf + start, (size_t)(p - (buf + start)), delim, batch, &nbatch, filelistp);
+      start = (size_t)(p - buf) + 1;
+    }
+    len -= start;
+    memmove(buf, buf + start, len);
+    if (len >= PATHBUF_SIZE) {
+      if (!toolong) fprintf(stderr, "\nwarning: skipping a path in the file list that is too long\n");
+      toolong = 1;
+      len = 0;
+    }
+  } while (got > 0);
+  if (ferror(fp)) {
+    fprintf(stderr, "\nerror reading file list "); fwprint(stderr, listname, 1);
+  }
+  /* The last name doesn't need a separator after it */
+  if (len > 0 && !toolong) files_from_add(buf, len, delim, batch, &nbatch, filelistp);
+  if (nbatch > 0) files_from_batch(batch, nbatch, filelistp);
+
+  if (fp != stdin) fclose(fp);
+  free(buf);
+  free(batch);
+  for (size_t i = 0; i < LISTED_BUCKETS; i++) {
+    while (listed_table[i] != NULL) {
+      struct listed *next = listed_table[i]->next;
+
+      free(listed_table[i]);
+      listed_table[i] = next;
+    }
+  }
+  return;
+}
+
+
+/* Use Jody Bruchon's hash function on part or all of a file
+ * This version is reentrant: the result goes into *hash and reads
+ * go through the caller's CHUNK_SIZE buffer. Progress is only shown
+ * if show_progress is set, i.e. when called from the main thread. */
+static hash_t *get_filehash_r(const file_t * const restrict checkfile,
+                const size_t max_read, hash_t * const restrict hash,
+                uint64_t * const restrict ext,
+                hash_t * const restrict chunk, const int show_progress)
+{
+  off_t fsize, pos = 0;
+  struct io_file file;
+  hash_state_t hs;
+  const void *data;
+  size_t got;
+  int check = 0, skip_partial = 0;
+  char path[FILE_PATH_SIZE];
+
+  if (checkfile == NULL || checkfile->name == NULL) nullptr("get_filehash()");
+  LOUD(fprintf(stderr, "get_filehash('%s', %" PRIdMAX ")\n", checkfile->name, (intmax_t)max_read);)
+
+  /* Get the file size. If we can't read it, bail out early */
+  if (checkfile->size == -1) {
+    LOUD(fprintf(stderr, "get_filehash: not hashing because stat() info is bad\n"));
+    return NULL;
+  }
+  fsize = checkfile->size;
+
+  /* Do not read more than the requested number of bytes */
+  if (max_read > 0 && fsize > (off_t)max_read)
+    fsize = (off_t)max_read;
+
+  /* Initialize the hash and file read parameters (with filehash_partial skipped)
+   *
+   * If we already hashed the first chunk of this file, we don't want to
+   * wastefully read and hash it again, so skip the first chunk and use
+   * the computed hash for that chunk as our starting point.
+   *
+   * WARNING: We assume max_read is NEVER less than CHUNK_SIZE here! */
+
+  *hash = 0;
+  *ext = 0;
+  if (ISFLAG(checkfile->flags, F_HASH_PARTIAL)) {
+    /* Don't bother going further if max_read is already fulfilled */
+    if (max_read != 0 && max_read <= PARTIAL_HASH_SIZE) {
+      LOUD(fprintf(stderr, "Partial hash size (%d) >= max_read (%" PRIuMAX "), not hashing anymore\n", PARTIAL_HASH_SIZE, (uintmax_t)max_read);)
+      *hash = checkfile->filehash_partial;
+      SET_HASH_EXT(*ext, checkfile->filehash_partial_ext);
+      return hash;
+    }
+    /* Wide hashes always cover the whole file so that every bit of the
+     * result depends on all of the data */
+    if (!hash_provider->wide) {
+      *hash = checkfile->filehash_partial;
+      skip_partial = 1;
+    }
+  }
+  if (io_open(&file, file_path(checkfile, path)) != 0) {
+    fprintf(stderr, "\nerror opening file "); fwprint(stderr, path, 1);
+    return NULL;
+  }
+  STATS(stats_add_files(1);)
+  /* Actually seek past the first chunk if applicable
+   * This is part of the filehash_partial skip optimization */
+  if (skip_partial) {
+    if (io_seek(&file, PARTIAL_HASH_SIZE) == -1) {
+      io_close(&file);
+      fprintf(stderr, "\nerror seeking in file "); fwprint(stderr, path, 1);
+      return NULL;
+    }
+    fsize -= PARTIAL_HASH_SIZE;
+    pos = PARTIAL_HASH_SIZE;
+  }
+  hash_provider->init(&hs, *hash);
+  /* Read the file in CHUNK_SIZE chunks until we've read it all. */
+  while (fsize > 0) {
+    size_t bytes_to_read;
+
+    if (interrupt) {
+      io_close(&file);
+      return 0;
+    }
+    bytes_to_read = (fsize >= (off_t)auto_chunk_size) ? auto_chunk_size : (size_t)fsize;
+    /* The first PARTIAL_HASH_SIZE bytes are always hashed by themselves
+     * so that a narrow full hash is the same whether or not it continues
+     * from an existing partial hash */
+    if (pos < PARTIAL_HASH_SIZE && (off_t)bytes_to_read > PARTIAL_HASH_SIZE - pos)
+      bytes_to_read = (size_t)(PARTIAL_HASH_SIZE - pos);
+    data = io_read(&file, chunk, bytes_to_read, &got);
+    if (data == NULL || got != bytes_to_read) {
+      fprintf(stderr, "\nerror reading from file "); fwprint(stderr, path, 1);
+      io_close(&file);
+      return NULL;
+    }
+
+    hash_provider->update(&hs, data, bytes_to_read);
+    fsize -= (off_t)bytes_to_read;
+    pos += (off_t)bytes_to_read;
+    if (!hash_provider->wide && pos == PARTIAL_HASH_SIZE && fsize > 0)
+      hash_provider->init(&hs, hash_provider->final(&hs, ext));
+
+    if (show_progress && !ISFLAG(flags, F_HIDEPROGRESS)) {
       check++;
       if (check > CHECK_MINIMUM) {
         update_progress("hashing", (int)(((checkfile->size - fsize) * 100) / checkfile->size));
@@ -922,334 +1507,852 @@ static hash_t *get_filehash(const file_t * const restrict checkfile,
     }
   }
 
-  fclose(file);
+  io_close(&file);
+  *hash = hash_provider->final(&hs, ext);
 
   LOUD(fprintf(stderr, "get_filehash: returning hash: 0x%016jx\n", (uintmax_t)*hash));
   return hash;
 }
 
 
-static inline void registerfile(filetree_t * restrict * const restrict nodeptr,
-                const enum tree_direction d, file_t * const restrict file)
+/* Hash part or all of a file from the main thread using static buffers */
+static hash_t *get_filehash(const file_t * const restrict checkfile,
+                const size_t max_read, uint64_t * const restrict ext)
 {
-  filetree_t * restrict branch;
+  /* This is an array because we return a pointer to it */
+  static hash_t hash[1];
+  static hash_t chunk[(CHUNK_SIZE / sizeof(hash_t))];
 
-  if (nodeptr == NULL || file == NULL || (d != NONE && *nodeptr == NULL)) nullptr("registerfile()");
-  LOUD(fprintf(stderr, "registerfile(direction %d)\n", d));
+  return get_filehash_r(checkfile, max_read, hash, ext, chunk, 1);
+}
 
-  /* Allocate and initialize a new node for the file */
-  branch = (filetree_t *)string_malloc(sizeof(filetree_t));
-  if (branch == NULL) oom("registerfile() branch");
-  branch->file = file;
-  branch->left = NULL;
-  branch->right = NULL;
-#ifdef USE_TREE_REBALANCE
-  branch->left_weight = 0;
-  branch->right_weight = 0;
 
-  /* Attach the new node to the requested branch and the parent */
-  switch (d) {
-    case LEFT:
-      branch->parent = *nodeptr;
-      (*nodeptr)->left = branch;
-      (*nodeptr)->left_weight++;
-      break;
-    case RIGHT:
-      branch->parent = *nodeptr;
-      (*nodeptr)->right = branch;
-      (*nodeptr)->right_weight++;
+/* Hash the end of a large file (stage F_HASH_TAIL) or blocks sampled at
+ * evenly spaced offsets through it (stage F_HASH_SAMPLE). These stages
+ * sit between the partial and full hashes and let large files that only
+ * share a header be told apart without reading them in full. Every read
+ * starts on a PARTIAL_HASH_SIZE boundary so O_DIRECT reads stay aligned;
+ * the tail block runs from the last such boundary before the final
+ * PARTIAL_HASH_SIZE bytes to the end of the file. Reentrant like
+ * get_filehash_r(); 'chunk' must hold CHUNK_SIZE bytes. */
+static hash_t *get_stagehash_r(const file_t * const restrict checkfile,
+                const uint32_t stage, hash_t * const restrict hash,
+                hash_t * const restrict chunk)
+{
+  struct io_file file;
+  hash_state_t hs;
+  const void *data;
+  uint64_t ext;
+  off_t offset;
+  size_t len, got;
+  unsigned int blocks;
+  char path[FILE_PATH_SIZE];
+
+  if (checkfile == NULL || checkfile->name == NULL) nullptr("get_stagehash()");
+  LOUD(fprintf(stderr, "get_stagehash('%s', %s)\n", checkfile->name,
+        (stage == F_HASH_TAIL) ? "tail" : "sample");)
+
+  if (checkfile->size < STAGE_MIN_SIZE) return NULL;
+  if (io_open(&file, file_path(checkfile, path)) != 0) {
+    fprintf(stderr, "\nerror opening file "); fwprint(stderr, path, 1);
+    return NULL;
+  }
+  STATS(stats_add_files(1);)
+
+  blocks = (stage == F_HASH_TAIL) ? 1 : sample_count;
+  hash_provider->init(&hs, 0);
+  for (unsigned int i = 1; i <= blocks; i++) {
+    if (interrupt) {
+      io_close(&file);
+      return NULL;
+    }
+    if (stage == F_HASH_TAIL) offset = checkfile->size - PARTIAL_HASH_SIZE;
+    else offset = (checkfile->size / (off_t)(blocks + 1)) * (off_t)i;
+    offset &= ~(off_t)(PARTIAL_HASH_SIZE - 1);
+    len = (stage == F_HASH_TAIL) ? (size_t)(checkfile->size - offset) : PARTIAL_HASH_SIZE;
+
+    if (io_seek(&file, offset) == -1) data = NULL;
+    else data = io_read(&file, chunk, len, &got);
+    if (data == NULL || got != len) {
+      fprintf(stderr, "\nerror reading from file "); fwprint(stderr, path, 1);
+      io_close(&file);
+      return NULL;
+    }
+    hash_provider->update(&hs, data, len);
+  }
+
+  io_close(&file);
+  *hash = hash_provider->final(&hs, &ext);
+  LOUD(fprintf(stderr, "get_stagehash: returning hash: 0x%016jx\n", (uintmax_t)*hash));
+  return hash;
+}
+
+
+/* Make sure a file has the hash for a stage; returns 0 or -1 on error */
+static int set_stagehash(file_t * const restrict file, const uint32_t stage)
+{
+  static hash_t chunk[(CHUNK_SIZE / sizeof(hash_t))];
+  struct stats_timer st;
+  hash_t hash;
+  int ok;
+
+  if (ISFLAG(file->flags, stage)) return 0;
+  STATS(stats_begin(&st, STATS_FULL);)
+  ok = (get_stagehash_r(file, stage, &hash, chunk) != NULL);
+  STATS(stats_end(&st);)
+  if (!ok) return -1;
+  if (stage == F_HASH_TAIL) file->filehash_tail = hash;
+  else file->filehash_sample = hash;
+  SETFLAG(file->flags, stage);
+  return 0;
+}
+
+
+/* Size grouping sorts these packed keys rather than file pointers so
+ * that every compare reads one contiguous array instead of a file_t */
+struct size_key {
+  off_t size;
+  size_t id;  /* Position in the file list */
+};
+
+/* Stable merge sort of size keys; tmp must hold count keys */
+static void mergesort_sizes(struct size_key * const restrict keys,
+                struct size_key * const restrict tmp, const size_t count)
+{
+  size_t half, i, j, k;
+
+  if (count < 2) return;
+  half = count / 2;
+  mergesort_sizes(keys, tmp, half);
+  mergesort_sizes(keys + half, tmp, count - half);
+
+  /* Already in order; nothing to merge */
+  if (keys[half - 1].size <= keys[half].size) return;
+
+  memcpy(tmp, keys, sizeof(struct size_key) * count);
+  for (i = 0, j = half, k = 0; i < half && j < count; k++) {
+    if (tmp[j].size < tmp[i].size) keys[k] = tmp[j++];
+    else keys[k] = tmp[i++];
+  }
+  while (i < half) keys[k++] = tmp[i++];
+  while (j < count) keys[k++] = tmp[j++];
+  return;
+}
+
+
+/* Build an array of every file that shares its size with at least one
+ * other file, grouped by size in ascending order. Files of the same size
+ * keep their relative order from the file list, so matching inside a
+ * group behaves exactly as if the whole list were walked. A file with a
+ * unique size can never be a duplicate, so it is dropped here before it
+ * is ever opened. Returns NULL if no two files have the same size. */
+static file_t **group_files_by_size(file_t *files, size_t * const restrict count)
+{
+  file_t **list, **sorted;
+  struct size_key *keys, *tmp;
+  size_t n = 0, i, j, want;
+
+  if (count == NULL) nullptr("group_files_by_size()");
+  LOUD(fprintf(stderr, "group_files_by_size()\n");)
+
+  *count = 0;
+  for (file_t *f = files; f != NULL; f = f->next) n++;
+  if (n < 2) return NULL;
+  list = (file_t **)malloc(sizeof(file_t *) * n);
+  keys = (struct size_key *)malloc(sizeof(struct size_key) * n);
+  tmp = (struct size_key *)malloc(sizeof(struct size_key) * n);
+  if (list == NULL || keys == NULL || tmp == NULL) oom("group_files_by_size()");
+
+  n = 0;
+  for (file_t *f = files; f != NULL; f = f->next) {
+    keys[n].size = f->size;
+    keys[n].id = n;
+    list[n++] = f;
+  }
+  mergesort_sizes(keys, tmp, n);
+  free(tmp);
+
+  /* Pack the non-unique sizes together at the front */
+  sorted = (file_t **)malloc(sizeof(file_t *) * n);
+  if (sorted == NULL) oom("group_files_by_size()");
+  want = 0;
+  for (i = 0; i < n; i = j) {
+    for (j = i + 1; j < n && keys[j].size == keys[i].size; j++);
+    if (j - i < 2) continue;
+    for (; i < j; i++) sorted[want++] = list[keys[i].id];
+  }
+  free(keys);
+  free(list);
+  LOUD(fprintf(stderr, "group_files_by_size: %" PRIuMAX " of %" PRIuMAX " files have non-unique sizes\n",
+        (uintmax_t)want, (uintmax_t)n);)
+
+  if (want == 0) {
+    free(sorted);
+    return NULL;
+  }
+  *count = want;
+  return sorted;
+}
+
+
+/* Copy the hot matching fields of every candidate file into the
+ * metadata arrays; the file ID is the file's index in list[] */
+static void meta_build(file_t * const * const restrict list, const size_t count)
+{
+  meta.device = (dev_t *)malloc(sizeof(dev_t) * count);
+  meta.inode = (jdupes_ino_t *)malloc(sizeof(jdupes_ino_t) * count);
+  meta.user_order = (unsigned int *)malloc(sizeof(unsigned int) * count);
+  meta.partial = (hash_t *)malloc(sizeof(hash_t) * count);
+  meta.full = (hash_t *)malloc(sizeof(hash_t) * count);
+  meta.state = (uint8_t *)malloc(count);
+  if (!meta.device || !meta.inode || !meta.user_order || !meta.partial || !meta.full || !meta.state)
+    oom("meta_build()");
+#ifdef WIDE_HASH
+  meta.partial_ext = (uint64_t *)malloc(sizeof(uint64_t) * count);
+  meta.full_ext = (uint64_t *)malloc(sizeof(uint64_t) * count);
+  if (!meta.partial_ext || !meta.full_ext) oom("meta_build()");
+#endif
+
+  for (size_t i = 0; i < count; i++) {
+    const file_t * const f = list[i];
+
+    meta.device[i] = f->device;
+    meta.inode[i] = f->inode;
+    meta.user_order[i] = f->user_order;
+    meta.state[i] = 0;
+    /* Hashes from the hash database or the parallel prehash */
+    if (ISFLAG(f->flags, F_HASH_PARTIAL)) {
+      meta.partial[i] = f->filehash_partial;
+      SET_HASH_EXT(meta.partial_ext[i], f->filehash_partial_ext);
+      meta.state[i] |= META_PARTIAL;
+    }
+    if (ISFLAG(f->flags, F_HASH_FULL)) {
+      meta.full[i] = f->filehash;
+      SET_HASH_EXT(meta.full_ext[i], f->filehash_ext);
+      meta.state[i] |= META_FULL;
+    }
+  }
+  return;
+}
+
+
+static void meta_free(void)
+{
+  free(meta.device);
+  free(meta.inode);
+  free(meta.user_order);
+  free(meta.partial);
+  free(meta.full);
+  free(meta.state);
+#ifdef WIDE_HASH
+  free(meta.partial_ext);
+  free(meta.full_ext);
+#endif
+  memset(&meta, 0, sizeof(meta));
+  return;
+}
+
+
+#ifndef NO_THREADS
+/* Compare file sizes for qsort() */
+static int sort_files_by_size(const void *a, const void *b)
+{
+  const file_t * const f1 = *(const file_t * const *)a;
+  const file_t * const f2 = *(const file_t * const *)b;
+
+  if (f1->size < f2->size) return -1;
+  if (f1->size > f2->size) return 1;
+  return 0;
+}
+
+
+/* Compare file sizes, then every hash stage computed so far, for qsort() */
+static int sort_files_by_stages(const void *a, const void *b)
+{
+  const file_t * const f1 = *(const file_t * const *)a;
+  const file_t * const f2 = *(const file_t * const *)b;
+  int i;
+
+  i = sort_files_by_size(a, b);
+  if (i != 0) return i;
+  i = HASH_COMPARE(f1->filehash_partial, f2->filehash_partial);
+  if (i != 0) return i;
+  i = HASH_COMPARE((f1->flags & F_HASH_TAIL), (f2->flags & F_HASH_TAIL));
+  if (i != 0) return i;
+  i = HASH_COMPARE(f1->filehash_tail, f2->filehash_tail);
+  if (i != 0) return i;
+  i = HASH_COMPARE((f1->flags & F_HASH_SAMPLE), (f2->flags & F_HASH_SAMPLE));
+  if (i != 0) return i;
+  return HASH_COMPARE(f1->filehash_sample, f2->filehash_sample);
+}
+
+
+/* Shared state for the hashing thread pool */
+struct prehash {
+  file_t **list;
+  uint32_t stage;    /* The F_HASH_* flag being computed */
+  hash_t *chunks;    /* One CHUNK_SIZE read buffer per thread */
+  size_t done;       /* Files hashed so far; only updated atomically */
+  size_t total;
+};
+
+
+/* Hash one file of a prehash list (thread pool work function) */
+static void prehash_worker(void * const ctx, const size_t item, const unsigned int thread)
+{
+  struct prehash * const restrict ph = (struct prehash *)ctx;
+  file_t * const restrict file = ph->list[item];
+  hash_t * const restrict chunk = ph->chunks + (thread * (CHUNK_SIZE / sizeof(hash_t)));
+  hash_t hash;
+  uint64_t ext;
+  size_t done;
+
+  if (interrupt) return;
+  /* Only this thread touches this file until the pool finishes */
+  switch (ph->stage) {
+    case F_HASH_PARTIAL:
+      if (get_filehash_r(file, PARTIAL_HASH_SIZE, &hash, &ext, chunk, 0) == NULL) break;
+      file->filehash_partial = hash;
+      SET_HASH_EXT(file->filehash_partial_ext, ext);
+      SETFLAG(file->flags, F_HASH_PARTIAL);
       break;
-    case NONE:
-      /* For the root of the tree only */
-      branch->parent = NULL;
-      *nodeptr = branch;
+    case F_HASH_TAIL:
+    case F_HASH_SAMPLE:
+      if (get_stagehash_r(file, ph->stage, &hash, chunk) == NULL) break;
+      if (ph->stage == F_HASH_TAIL) file->filehash_tail = hash;
+      else file->filehash_sample = hash;
+      SETFLAG(file->flags, ph->stage);
       break;
     default:
-      /* This should never ever happen */
-      fprintf(stderr, "\ninternal error: invalid direction for registerfile(), report this\n");
-      string_malloc_destroy();
-      exit(EXIT_FAILURE);
+      if (get_filehash_r(file, 0, &hash, &ext, chunk, 0) == NULL) break;
+      file->filehash = hash;
+      SET_HASH_EXT(file->filehash_ext, ext);
+      SETFLAG(file->flags, F_HASH_FULL);
       break;
   }
 
-  /* Propagate weights up the tree */
-  while (branch->parent != NULL) {
-    filetree_t * restrict up;
+  done = __atomic_add_fetch(&ph->done, 1, __ATOMIC_RELAXED);
+  if (thread == 0 && !ISFLAG(flags, F_HIDEPROGRESS)) {
+    gettimeofday(&time2, NULL);
+    if (time2.tv_sec > time1.tv_sec) {
+      fprintf(stderr, "\rHashing: %" PRIuMAX "/%" PRIuMAX " files (%s)         ",
+          (uintmax_t)done, (uintmax_t)ph->total,
+          (ph->stage == F_HASH_PARTIAL) ? "partial" :
+          (ph->stage == F_HASH_TAIL) ? "tail" :
+          (ph->stage == F_HASH_SAMPLE) ? "sampled" : "full");
+      fflush(stderr);
+    }
+    time1.tv_sec = time2.tv_sec;
+  }
+  return;
+}
 
-    up = branch->parent;
-    if (up->left == branch) up->left_weight++;
-    else if (up->right == branch) up->right_weight++;
-    else {
-      fprintf(stderr, "\nInternal error: file tree linkage is broken\n");
-      exit(EXIT_FAILURE);
+
+/* Put the files of 'list' that share their size and every hash stage so
+ * far with another file at the front and return how many there are;
+ * those are the only ones checkmatch() would hash any further */
+static size_t prehash_select(file_t ** const restrict list, const size_t count,
+                const uint32_t stage)
+{
+  size_t n = 0, i, j;
+
+  qsort(list, count, sizeof(file_t *), sort_files_by_stages);
+  for (i = 0; i < count; i = j) {
+    for (j = i + 1; j < count && sort_files_by_stages(&list[i], &list[j]) == 0; j++);
+    if (j - i < 2) continue;
+    for (; i < j; i++) if (!ISFLAG(list[i]->flags, stage)) list[n++] = list[i];
+  }
+  return n;
+}
+
+
+/* Compute partial and full hashes with a pool of worker threads before
+ * the (single-threaded) match index is built. 'groups' is the output of
+ * group_files_by_size(), so every file in it shares its size with another
+ * file. Each later stage (tail and sampled blocks for large files, then
+ * the full hash) is only computed for files that still share all earlier
+ * hashes with another file, since checkmatch() would never hash anything
+ * else. Files whose hashes can't be read are left unflagged so
+ * checkmatch() handles them as usual. */
+static void prehash_files(file_t ** const restrict groups, const size_t count,
+                const unsigned int threads)
+{
+  static const uint32_t stages[] = { F_HASH_TAIL, F_HASH_SAMPLE, F_HASH_FULL };
+  struct prehash ph;
+  struct stats_timer st;
+  file_t **list;
+  size_t n, i;
+
+  LOUD(fprintf(stderr, "prehash_files(%u threads)\n", threads);)
+
+  if (count < 2) return;
+  list = (file_t **)malloc(sizeof(file_t *) * count);
+  ph.chunks = (hash_t *)malloc(CHUNK_SIZE * threads);
+  if (list == NULL || ph.chunks == NULL) oom("prehash_files()");
+  ph.list = list;
+
+  /* Partial hashes for everything with a non-unique size */
+  n = 0;
+  for (i = 0; i < count; i++) if (!ISFLAG(groups[i]->flags, F_HASH_PARTIAL)) list[n++] = groups[i];
+  ph.stage = F_HASH_PARTIAL;
+  ph.done = 0;
+  ph.total = n;
+  STATS(stats_begin(&st, STATS_PARTIAL);)
+  pool_run(threads, n, prehash_worker, &ph);
+  STATS(stats_end(&st);)
+
+  for (unsigned int k = 0; k < sizeof(stages) / sizeof(stages[0]); k++) {
+    if (stages[k] == F_HASH_SAMPLE && sample_count == 0) continue;
+    /* Only files that have been through every earlier stage */
+    n = 0;
+    for (i = 0; i < count; i++) {
+      const file_t * const f = groups[i];
+
+      if (!ISFLAG(f->flags, F_HASH_PARTIAL) || f->size <= PARTIAL_HASH_SIZE) continue;
+      if (f->size >= STAGE_MIN_SIZE) {
+        if (stages[k] != F_HASH_TAIL && !ISFLAG(f->flags, F_HASH_TAIL)) continue;
+        if (stages[k] == F_HASH_FULL && sample_count > 0 && !ISFLAG(f->flags, F_HASH_SAMPLE)) continue;
+      } else if (stages[k] != F_HASH_FULL) continue;
+      list[n++] = groups[i];
     }
-    branch = up;
+    n = prehash_select(list, n, stages[k]);
+    ph.stage = stages[k];
+    ph.done = 0;
+    ph.total = n;
+    STATS(stats_begin(&st, STATS_FULL);)
+    pool_run(threads, n, prehash_worker, &ph);
+    STATS(stats_end(&st);)
   }
-#else /* USE_TREE_REBALANCE */
-  /* Attach the new node to the requested branch */
-  switch (d) {
-    case LEFT:
-      (*nodeptr)->left = branch;
-      break;
-    case RIGHT:
-      (*nodeptr)->right = branch;
-      break;
-    case NONE:
-      /* For the root of the tree only */
-      *nodeptr = branch;
-      break;
+
+  if (!ISFLAG(flags, F_HIDEPROGRESS)) fprintf(stderr, "\r%60s\r", " ");
+  free(ph.chunks);
+  free(list);
+  return;
+}
+#endif /* NO_THREADS */
+
+
+/* check_conditions() using only the hot metadata. Files in a match index
+ * always have the same size; -p needs the cold attributes in file_t. */
+static inline int meta_conditions(const file_t * const restrict file1, const size_t id1,
+                const file_t * const restrict file2, const size_t id2)
+{
+  if (ISFLAG(flags, F_PERMISSIONS)) return check_conditions(file1, file2);
+  if (ISFLAG(flags, F_ISOLATE) && meta.user_order[id1] == meta.user_order[id2]) return -1;
+  if (ISFLAG(flags, F_ONEFS) && meta.device[id1] != meta.device[id2]) return -1;
+#ifndef NO_HARDLINKS
+  if (meta.inode[id1] == meta.inode[id2] && meta.device[id1] == meta.device[id2])
+    return ISFLAG(flags, F_CONSIDERHARDLINKS) ? 2 : -2;
+#endif
+  return 0;
+}
+
+
+/* Make sure a file's partial hash is known; returns -1 if it can't be read */
+static int meta_partial(file_t * const restrict file, const size_t id)
+{
+  const hash_t * restrict filehash;
+  uint64_t ext;
+
+  if (meta.state[id] & META_PARTIAL) return 0;
+  if (!ISFLAG(file->flags, F_HASH_PARTIAL)) {
+    struct stats_timer st;
+
+    STATS(stats_begin(&st, STATS_PARTIAL);)
+    filehash = get_filehash(file, PARTIAL_HASH_SIZE, &ext);
+    STATS(stats_end(&st);)
+    if (filehash == NULL) return -1;
+
+    file->filehash_partial = *filehash;
+    SET_HASH_EXT(file->filehash_partial_ext, ext);
+    SETFLAG(file->flags, F_HASH_PARTIAL);
+  }
+  meta.partial[id] = file->filehash_partial;
+  SET_HASH_EXT(meta.partial_ext[id], file->filehash_partial_ext);
+  meta.state[id] |= META_PARTIAL;
+  return 0;
+}
+
+
+/* Make sure a file's full hash is known; returns -1 if it can't be read.
+ * For small files the partial hash already covers the whole file. */
+static int meta_full(file_t * const restrict file, const size_t id)
+{
+  const hash_t * restrict filehash;
+  uint64_t ext;
+
+  if (meta.state[id] & META_FULL) return 0;
+  if (!ISFLAG(file->flags, F_HASH_FULL)) {
+    if (file->size <= PARTIAL_HASH_SIZE) {
+      LOUD(fprintf(stderr, "checkmatch: small file: copying partial hash to full hash\n"));
+      file->filehash = file->filehash_partial;
+      SET_HASH_EXT(file->filehash_ext, file->filehash_partial_ext);
+      DBG(small_file++;)
+    } else {
+      struct stats_timer st;
+
+      STATS(stats_begin(&st, STATS_FULL);)
+      filehash = get_filehash(file, 0, &ext);
+      STATS(stats_end(&st);)
+      if (filehash == NULL) return -1;
+
+      file->filehash = *filehash;
+      SET_HASH_EXT(file->filehash_ext, ext);
+    }
+    SETFLAG(file->flags, F_HASH_FULL);
+  }
+  meta.full[id] = file->filehash;
+  SET_HASH_EXT(meta.full_ext[id], file->filehash_ext);
+  meta.state[id] |= META_FULL;
+  return 0;
+}
+
+
+/* Match index
+ * The files of one size group are matched through buckets of files that
+ * agree on every key level so far: the size, the partial hash, for large
+ * files the tail and sampled hashes, and then the full hash. Levels are
+ * filled in lazily. A bucket keeps its first file without hashing it any
+ * further; only when a second file arrives is the first one moved down
+ * to a bucket of the next level (a "split"). A file is therefore hashed
+ * one level deeper only when another file shares everything before that
+ * level. A bucket of the last level holds the heads of the sets found so
+ * far with that content; there is more than one only when
+ * check_conditions() keeps them apart (-I, -1, -p, or hard links without
+ * -H).
+ *
+ * Buckets are found through an open-addressing table (linear probing)
+ * keyed on the parent bucket and the hash of the level, so each lookup
+ * costs O(1) expected no matter what order the files come in, and
+ * nothing recurses. */
+
+enum match_level { LEVEL_SIZE, LEVEL_PARTIAL, LEVEL_TAIL, LEVEL_SAMPLE, LEVEL_FULL };
+#define MATCH_LEVELS 5
+#define MATCH_NONE SIZE_MAX
+
+/* A set head in the match index */
+struct match_node {
+  file_t *file;
+  size_t id;    /* Index of the file in the hot metadata arrays */
+  size_t next;  /* Next set head with the same content */
+};
+
+struct match_bucket {
+  hash_t hash;
+  uint64_t ext;        /* Wide hash bits, or the size for LEVEL_SIZE */
+  size_t parent;       /* Bucket of the level before, or MATCH_NONE */
+  size_t head;         /* First node; MATCH_NONE once split */
+};
+
+struct match_slot {
+  uint64_t key;
+  size_t bucket;       /* MATCH_NONE if the slot is empty */
+};
+
+static struct {
+  struct match_node *nodes;
+  struct match_bucket *buckets;
+  struct match_slot *slots;
+  size_t nnodes, nodes_alloc;
+  size_t nbuckets, buckets_alloc;
+  size_t nslots, slots_alloc;  /* nslots is a power of two */
+  enum match_level levels[MATCH_LEVELS];
+  unsigned int nlevels;
+} match_index;
+
+
+/* Get a file's key for one level of the match index, hashing the file
+ * if needed; returns -1 if it can't be read */
+static int match_level_key(file_t * const restrict file, const size_t id,
+                const enum match_level level, hash_t * const restrict hash,
+                uint64_t * const restrict ext)
+{
+  *ext = 0;
+  switch (level) {
+    case LEVEL_SIZE:
+      *hash = 0;
+      *ext = (uint64_t)file->size;
+      return 0;
+    case LEVEL_PARTIAL:
+      if (meta_partial(file, id) != 0) return -1;
+      *hash = meta.partial[id];
+      SET_HASH_EXT(*ext, meta.partial_ext[id]);
+      /* The partial hash of a small file is its full hash */
+      if (file->size <= PARTIAL_HASH_SIZE) meta_full(file, id);
+      return 0;
+    case LEVEL_TAIL:
+      if (set_stagehash(file, F_HASH_TAIL) != 0) return -1;
+      *hash = file->filehash_tail;
+      return 0;
+    case LEVEL_SAMPLE:
+      if (set_stagehash(file, F_HASH_SAMPLE) != 0) return -1;
+      *hash = file->filehash_sample;
+      return 0;
+    case LEVEL_FULL:
     default:
-      /* This should never ever happen */
-      fprintf(stderr, "\ninternal error: invalid direction for registerfile(), report this\n");
-      string_malloc_destroy();
-      exit(EXIT_FAILURE);
-      break;
+      if (meta_full(file, id) != 0) return -1;
+      *hash = meta.full[id];
+      SET_HASH_EXT(*ext, meta.full_ext[id]);
+      return 0;
   }
+}
+
+
+static inline uint64_t match_key(const size_t parent, const hash_t hash, const uint64_t ext)
+{
+  uint64_t key = (uint64_t)hash ^ (ext * 0x9e3779b97f4a7c15ULL) ^ ((uint64_t)parent * 0xbf58476d1ce4e5b9ULL);
+
+  key ^= key >> 31;
+  key *= 0x94d049bb133111ebULL;
+  return key ^ (key >> 29);
+}
+
+
+/* Find the slot of a bucket, or the empty slot where it would go */
+static struct match_slot *match_probe(const uint64_t key, const size_t parent,
+                const hash_t hash, const uint64_t ext)
+{
+  const size_t mask = match_index.nslots - 1;
+  struct match_slot *slot;
+  const struct match_bucket *b;
+
+  for (size_t i = (size_t)key & mask; ; i = (i + 1) & mask) {
+    slot = &match_index.slots[i];
+    DBG(match_probes++;)
+    if (slot->bucket == MATCH_NONE) return slot;
+    if (slot->key != key) continue;
+    b = &match_index.buckets[slot->bucket];
+    if (b->parent == parent && b->hash == hash && b->ext == ext) return slot;
+  }
+}
 
-#endif /* USE_TREE_REBALANCE */
 
+/* Set up an empty slot table of nslots slots */
+static void match_slots_clear(const size_t nslots)
+{
+  if (nslots > match_index.slots_alloc) {
+    free(match_index.slots);
+    match_index.slots = (struct match_slot *)malloc(sizeof(struct match_slot) * nslots);
+    if (match_index.slots == NULL) oom("match_slots_clear()");
+    match_index.slots_alloc = nslots;
+  }
+  match_index.nslots = nslots;
+  memset(match_index.slots, 0xff, sizeof(struct match_slot) * nslots);
   return;
 }
 
 
-/* Experimental tree rebalance code. This slows things down in testing
- * but may be more useful in the future. Pass -DUSE_TREE_REBALANCE
- * to try it. */
-#ifdef USE_TREE_REBALANCE
-
-/* How much difference to ignore when considering a rebalance */
-#ifndef BALANCE_THRESHOLD
-#define BALANCE_THRESHOLD 4
-#endif
-
-/* Rebalance the file tree to reduce search depth */
-static inline void rebalance_tree(filetree_t * const tree)
-{
-  filetree_t * restrict promote;
-  filetree_t * restrict demote;
-  int difference, direction;
-#ifdef CONSIDER_IMBALANCE
-  int l, r, imbalance;
-#endif
-
-  if (!tree) return;
-
-  /* Rebalance all children first */
-  if (tree->left_weight > BALANCE_THRESHOLD) rebalance_tree(tree->left);
-  if (tree->right_weight > BALANCE_THRESHOLD) rebalance_tree(tree->right);
-
-  /* If weights are within a certain threshold, do nothing */
-  direction = tree->right_weight - tree->left_weight;
-  difference = direction;
-  if (difference < 0) difference = -difference;
-  if (difference <= BALANCE_THRESHOLD) return;
-
-  /* Determine if a tree rotation will help, and do it if so */
-  if (direction > 0) {
-#ifdef CONSIDER_IMBALANCE
-    l = tree->right->left_weight + tree->right_weight;
-    r = tree->right->right_weight;
-    imbalance = l - r;
-    if (imbalance < 0) imbalance = -imbalance;
-    /* Don't rotate if imbalance will increase */
-    if (imbalance >= difference) return;
-#endif /* CONSIDER_IMBALANCE */
-
-    /* Rotate the right node up one level */
-    promote = tree->right;
-    demote = tree;
-    /* Attach new parent's left tree to old parent */
-    demote->right = promote->left;
-    demote->right_weight = promote->left_weight;
-    /* Attach old parent to new parent */
-    promote->left = demote;
-    promote->left_weight = demote->left_weight + demote->right_weight + 1;
-    /* Reconnect parent linkages */
-    promote->parent = demote->parent;
-    if (demote->right) demote->right->parent = demote;
-    demote->parent = promote;
-    if (promote->parent == NULL) checktree = promote;
-    else if (promote->parent->left == demote) promote->parent->left = promote;
-    else promote->parent->right = promote;
-    return;
-  } else if (direction < 0) {
-#ifdef CONSIDER_IMBALANCE
-    r = tree->left->right_weight + tree->left_weight;
-    l = tree->left->left_weight;
-    imbalance = r - l;
-    if (imbalance < 0) imbalance = -imbalance;
-    /* Don't rotate if imbalance will increase */
-    if (imbalance >= difference) return;
-#endif /* CONSIDER_IMBALANCE */
-
-    /* Rotate the left node up one level */
-    promote = tree->left;
-    demote = tree;
-    /* Attach new parent's right tree to old parent */
-    demote->left = promote->right;
-    demote->left_weight = promote->right_weight;
-    /* Attach old parent to new parent */
-    promote->right = demote;
-    promote->right_weight = demote->right_weight + demote->left_weight + 1;
-    /* Reconnect parent linkages */
-    promote->parent = demote->parent;
-    if (demote->left) demote->left->parent = demote;
-    demote->parent = promote;
-    if (promote->parent == NULL) checktree = promote;
-    else if (promote->parent->left == demote) promote->parent->left = promote;
-    else promote->parent->right = promote;
-    return;
+/* Double the slot table and put every bucket back in */
+static void match_grow(void)
+{
+  struct match_slot *slot;
+
+  match_slots_clear(match_index.nslots * 2);
+  for (size_t i = 0; i < match_index.nbuckets; i++) {
+    const struct match_bucket * const b = &match_index.buckets[i];
+    const uint64_t key = match_key(b->parent, b->hash, b->ext);
+
+    slot = match_probe(key, b->parent, b->hash, b->ext);
+    slot->key = key;
+    slot->bucket = i;
+  }
+  return;
+}
+
+
+/* Add a bucket holding one node in an empty slot from match_probe() */
+static void match_bucket_new(struct match_slot * const restrict slot, const uint64_t key,
+                const size_t parent, const hash_t hash, const uint64_t ext, const size_t node)
+{
+  struct match_bucket *b;
+
+  if (match_index.nbuckets == match_index.buckets_alloc) {
+    match_index.buckets_alloc = match_index.buckets_alloc ? match_index.buckets_alloc * 2 : 64;
+    b = (struct match_bucket *)realloc(match_index.buckets,
+        sizeof(struct match_bucket) * match_index.buckets_alloc);
+    if (b == NULL) oom("match_bucket_new()");
+    match_index.buckets = b;
+  }
+  b = &match_index.buckets[match_index.nbuckets];
+  b->hash = hash;
+  b->ext = ext;
+  b->parent = parent;
+  b->head = node;
+  slot->key = key;
+  slot->bucket = match_index.nbuckets++;
+  /* Keep the table at most half full */
+  if (match_index.nbuckets * 2 > match_index.nslots) match_grow();
+  return;
+}
+
+
+static size_t match_node_new(file_t * const restrict file, const size_t id)
+{
+  struct match_node * const node = &match_index.nodes[match_index.nnodes];
+
+  node->file = file;
+  node->id = id;
+  node->next = MATCH_NONE;
+  return match_index.nnodes++;
+}
 
+
+/* Empty the match index for the size group at the start of 'list' */
+static void match_reset(file_t * const * const restrict list, const size_t count)
+{
+  const off_t size = list[0]->size;
+  size_t n, nslots = 16;
+
+  for (n = 1; n < count && list[n]->size == size; n++);
+  if (n > match_index.nodes_alloc) {
+    free(match_index.nodes);
+    match_index.nodes = (struct match_node *)malloc(sizeof(struct match_node) * n);
+    if (match_index.nodes == NULL) oom("match_reset()");
+    match_index.nodes_alloc = n;
+  }
+  match_index.nnodes = 0;
+  match_index.nbuckets = 0;
+  /* Room for about one bucket per file; match_grow() handles the rest */
+  while (nslots < n * 2) nslots <<= 1;
+  match_slots_clear(nslots);
+
+  /* Every file in the group goes through the same levels */
+  match_index.nlevels = 0;
+  match_index.levels[match_index.nlevels++] = LEVEL_SIZE;
+  match_index.levels[match_index.nlevels++] = LEVEL_PARTIAL;
+  if (size > PARTIAL_HASH_SIZE) {
+    if (size >= STAGE_MIN_SIZE) {
+      match_index.levels[match_index.nlevels++] = LEVEL_TAIL;
+      if (sample_count > 0) match_index.levels[match_index.nlevels++] = LEVEL_SAMPLE;
+    }
+    match_index.levels[match_index.nlevels++] = LEVEL_FULL;
+  }
+  return;
+}
+
+
+static void match_free(void)
+{
+  free(match_index.nodes);
+  free(match_index.buckets);
+  free(match_index.slots);
+  memset(&match_index, 0, sizeof(match_index));
+  return;
+}
+
+
+#ifdef DEBUG
+/* Debug counters for one lookup in the match index */
+static void match_count(const enum match_level level, const int missed)
+{
+  switch (level) {
+    case LEVEL_SIZE:
+      break;
+    case LEVEL_PARTIAL:
+      partial_hash++;
+      if (missed) partial_elim++;
+      break;
+    case LEVEL_TAIL:
+    case LEVEL_SAMPLE:
+      if (level == LEVEL_TAIL) tail_hash++;
+      else sample_hash++;
+      if (missed) stage_elim++;
+      break;
+    case LEVEL_FULL:
+    default:
+      full_hash++;
+      break;
   }
-
-  /* Fall through */
   return;
 }
-
-#endif /* USE_TREE_REBALANCE */
-
-
-#ifdef TREE_DEPTH_STATS
-#define TREE_DEPTH_UPDATE_MAX() { if (max_depth < tree_depth) max_depth = tree_depth; tree_depth = 0; }
-#else
-#define TREE_DEPTH_UPDATE_MAX()
 #endif
 
 
-/* Check two files for a match */
-static file_t **checkmatch(filetree_t * restrict tree, file_t * const restrict file)
+/* Look a file up in the match index. Returns the node of the set the
+ * file belongs to, or NULL after adding the file to the index. */
+static struct match_node *checkmatch(file_t * const restrict file, const size_t id)
 {
-  int cmpresult = 0;
-  const hash_t * restrict filehash;
-
-  if (tree == NULL || file == NULL || tree->file == NULL || tree->file->d_name == NULL || file->d_name == NULL) nullptr("checkmatch()");
-  LOUD(fprintf(stderr, "checkmatch ('%s', '%s')\n", tree->file->d_name, file->d_name));
-
-  /* If device and inode fields are equal one of the files is a
-   * hard link to the other or the files have been listed twice
-   * unintentionally. We don't want to flag these files as
-   * duplicates unless the user specifies otherwise. */
-
-  /* Count the total number of comparisons requested */
+  struct match_slot *slot;
+  struct match_bucket *b;
+  struct match_node *node;
+  size_t parent = MATCH_NONE, bucket, n;
+  hash_t hash;
+  uint64_t ext, key;
+
+  if (file == NULL || file->name == NULL) nullptr("checkmatch()");
+  LOUD(fprintf(stderr, "checkmatch ('%s')\n", file->name));
   DBG(comparisons++;)
 
-/* If considering hard linked files as duplicates, they are
- * automatically duplicates without being read further since
- * they point to the exact same inode. If we aren't considering
- * hard links as duplicates, we just return NULL. */
-
-  cmpresult = check_conditions(tree->file, file);
-  switch (cmpresult) {
-    case 2: return &tree->file;  /* linked files + -H switch */
-    case -2: return NULL;  /* linked files, no -H switch */
-    default: break;
-  }
-
-  /* If preliminary matching succeeded, move to full file checks */
-  if (cmpresult == 0) {
-    LOUD(fprintf(stderr, "checkmatch: starting file data comparisons\n"));
-    /* Attempt to exclude files quickly with partial file hashing */
-    if (!ISFLAG(tree->file->flags, F_HASH_PARTIAL)) {
-      filehash = get_filehash(tree->file, PARTIAL_HASH_SIZE);
-      if (filehash == NULL) return NULL;
-
-      tree->file->filehash_partial = *filehash;
-      SETFLAG(tree->file->flags, F_HASH_PARTIAL);
+  for (unsigned int level = 0; ; level++) {
+    const enum match_level kind = match_index.levels[level];
+
+    if (match_level_key(file, id, kind, &hash, &ext) != 0) return NULL;
+    key = match_key(parent, hash, ext);
+    slot = match_probe(key, parent, hash, ext);
+    DBG(match_count(kind, slot->bucket == MATCH_NONE);)
+    if (slot->bucket == MATCH_NONE) {
+      /* Nothing else has this key, so the file waits in a new bucket */
+      LOUD(fprintf(stderr, "checkmatch: no match at level %u\n", level));
+      match_bucket_new(slot, key, parent, hash, ext, match_node_new(file, id));
+      return NULL;
     }
-
-    if (!ISFLAG(file->flags, F_HASH_PARTIAL)) {
-      filehash = get_filehash(file, PARTIAL_HASH_SIZE);
-      if (filehash == NULL) return NULL;
-
-      file->filehash_partial = *filehash;
-      SETFLAG(file->flags, F_HASH_PARTIAL);
+    bucket = slot->bucket;
+    b = &match_index.buckets[bucket];
+
+    if (level + 1 == match_index.nlevels) {
+      /* Same content as every set head here; join the first one that the
+       * file may be matched with */
+      for (n = b->head; ; n = node->next) {
+        node = &match_index.nodes[n];
+        switch (meta_conditions(node->file, node->id, file, id)) {
+          case 0:
+          case 2:
+            LOUD(fprintf(stderr, "checkmatch: files appear to match based on hashes\n"));
+            DBG(partial_to_full++;)
+            return node;
+          case -2: return NULL;  /* linked files, no -H switch */
+          default: break;
+        }
+        if (node->next == MATCH_NONE) break;
+      }
+      node->next = match_node_new(file, id);
+      return NULL;
     }
 
-    cmpresult = HASH_COMPARE(file->filehash_partial, tree->file->filehash_partial);
-    LOUD(if (!cmpresult) fprintf(stderr, "checkmatch: partial hashes match\n"));
-    LOUD(if (cmpresult) fprintf(stderr, "checkmatch: partial hashes do not match\n"));
-    DBG(partial_hash++;)
-
-    if (file->size <= PARTIAL_HASH_SIZE) {
-      LOUD(fprintf(stderr, "checkmatch: small file: copying partial hash to full hash\n"));
-      /* filehash_partial = filehash if file is small enough */
-      if (!ISFLAG(file->flags, F_HASH_FULL)) {
-        file->filehash = file->filehash_partial;
-        SETFLAG(file->flags, F_HASH_FULL);
-        DBG(small_file++;)
-      }
-      if (!ISFLAG(tree->file->flags, F_HASH_FULL)) {
-        tree->file->filehash = tree->file->filehash_partial;
-        SETFLAG(tree->file->flags, F_HASH_FULL);
-        DBG(small_file++;)
+    if (b->head != MATCH_NONE) {
+      hash_t phash;
+      uint64_t pext;
+
+      /* Hard links can be settled without reading anything */
+      n = b->head;
+      node = &match_index.nodes[n];
+      switch (meta_conditions(node->file, node->id, file, id)) {
+        case 2: return node;  /* linked files + -H switch */
+        case -2: return NULL;  /* linked files, no -H switch */
+        default: break;
       }
-    } else if (cmpresult == 0) {
-      /* If partial match was correct, perform a full file hash match */
-      if (!ISFLAG(tree->file->flags, F_HASH_FULL)) {
-        filehash = get_filehash(tree->file, 0);
-        if (filehash == NULL) return NULL;
-
-        tree->file->filehash = *filehash;
-        SETFLAG(tree->file->flags, F_HASH_FULL);
+      /* Split: move the waiting file down a level. A file that can't be
+       * read there drops out. */
+      LOUD(fprintf(stderr, "checkmatch: splitting bucket at level %u\n", level));
+      DBG(match_splits++;)
+      b->head = MATCH_NONE;
+      if (match_level_key(node->file, node->id, match_index.levels[level + 1], &phash, &pext) == 0) {
+        key = match_key(bucket, phash, pext);
+        match_bucket_new(match_probe(key, bucket, phash, pext), key, bucket, phash, pext, n);
       }
-
-      if (!ISFLAG(file->flags, F_HASH_FULL)) {
-        filehash = get_filehash(file, 0);
-        if (filehash == NULL) return NULL;
-
-        file->filehash = *filehash;
-        SETFLAG(file->flags, F_HASH_FULL);
-      }
-
-      /* Full file hash comparison */
-      cmpresult = HASH_COMPARE(file->filehash, tree->file->filehash);
-      LOUD(if (!cmpresult) fprintf(stderr, "checkmatch: full hashes match\n"));
-      LOUD(if (cmpresult) fprintf(stderr, "checkmatch: full hashes do not match\n"));
-      DBG(full_hash++);
-    } else {
-      DBG(partial_elim++);
-    }
-  }
-
-  if (cmpresult < 0) {
-    if (tree->left != NULL) {
-      LOUD(fprintf(stderr, "checkmatch: recursing tree: left\n"));
-      DBG(left_branch++; tree_depth++;)
-      return checkmatch(tree->left, file);
-    } else {
-      LOUD(fprintf(stderr, "checkmatch: registering file: left\n"));
-      registerfile(&tree, LEFT, file);
-      TREE_DEPTH_UPDATE_MAX();
-      return NULL;
-    }
-  } else if (cmpresult > 0) {
-    if (tree->right != NULL) {
-      LOUD(fprintf(stderr, "checkmatch: recursing tree: right\n"));
-      DBG(right_branch++; tree_depth++;)
-      return checkmatch(tree->right, file);
-    } else {
-      LOUD(fprintf(stderr, "checkmatch: registering file: right\n"));
-      registerfile(&tree, RIGHT, file);
-      TREE_DEPTH_UPDATE_MAX();
-      return NULL;
     }
-  } else {
-    /* All compares matched */
-    DBG(partial_to_full++;)
-    TREE_DEPTH_UPDATE_MAX();
-    LOUD(fprintf(stderr, "checkmatch: files appear to match based on hashes\n"));
-    return &tree->file;
+    parent = bucket;
   }
-  /* Fall through - should never be reached */
-  return NULL;
 }
 
 
 /* Do a byte-by-byte comparison in case two different files produce the
    same signature. Unlikely, but better safe than sorry. */
-static inline int confirmmatch(FILE * const restrict file1, FILE * const restrict file2, off_t size)
+static inline int confirmmatch(struct io_file * const restrict file1,
+                struct io_file * const restrict file2, off_t size)
 {
   static char c1[CHUNK_SIZE], c2[CHUNK_SIZE];
+  const void *d1, *d2;
   size_t r1, r2;
   off_t bytes = 0;
   int check = 0;
@@ -1257,16 +2360,17 @@ static inline int confirmmatch(FILE * const restrict file1, FILE * const restric
   if (file1 == NULL || file2 == NULL) nullptr("confirmmatch()");
   LOUD(fprintf(stderr, "confirmmatch running\n"));
 
-  fseek(file1, 0, SEEK_SET);
-  fseek(file2, 0, SEEK_SET);
+  io_seek(file1, 0);
+  io_seek(file2, 0);
 
   do {
     if (interrupt) return 0;
-    r1 = fread(c1, sizeof(char), auto_chunk_size, file1);
-    r2 = fread(c2, sizeof(char), auto_chunk_size, file2);
+    d1 = io_read(file1, c1, auto_chunk_size, &r1);
+    d2 = io_read(file2, c2, auto_chunk_size, &r2);
 
+    if (d1 == NULL || d2 == NULL) return 0; /* read error */
     if (r1 != r2) return 0; /* file lengths are different */
-    if (memcmp (c1, c2, r1)) return 0; /* file contents are different */
+    if (memcmp (d1, d2, r1)) return 0; /* file contents are different */
 
     if (!ISFLAG(flags, F_HIDEPROGRESS)) {
       check++;
@@ -1335,58 +2439,506 @@ static int sort_pairs_by_mtime(file_t *f1, file_t *f2)
 }
 
 
+#ifdef SORT_KEYS
+/* Build a file's collation key for sorting by name if it has none yet */
+static void make_sortkey(file_t * const restrict file)
+{
+  char path[FILE_PATH_SIZE];
+  unsigned char key[NUMERIC_SORT_KEY_SIZE(FILE_PATH_SIZE)];
+  size_t len;
+
+  if (file->sortkey != NULL) return;
+  len = numeric_sort_key(file_path(file, path), key);
+  file->sortkey = (unsigned char *)string_malloc(len ? len : 1);
+  if (file->sortkey == NULL) oom("make_sortkey()");
+  memcpy(file->sortkey, key, len);
+  file->sortkey_len = (unsigned int)len;
+  return;
+}
+#endif
+
+
 static int sort_pairs_by_filename(file_t *f1, file_t *f2)
 {
+  char path1[FILE_PATH_SIZE], path2[FILE_PATH_SIZE];
+
   if (f1 == NULL || f2 == NULL) nullptr("sort_pairs_by_filename()");
   int po = sort_pairs_by_param_order(f1, f2);
 
   if (po != 0) return po;
 
-  return numeric_sort(f1->d_name, f2->d_name, sort_direction);
+#ifdef SORT_KEYS
+  /* Paths are only rebuilt when one key is a prefix of the other */
+  make_sortkey(f1);
+  make_sortkey(f2);
+  po = memcmp(f1->sortkey, f2->sortkey,
+      (f1->sortkey_len < f2->sortkey_len) ? f1->sortkey_len : f2->sortkey_len);
+  if (po != 0) return (po < 0) ? -sort_direction : sort_direction;
+#endif
+
+  return numeric_sort(file_path(f1, path1), file_path(f2, path2), sort_direction);
 }
 
 
+/* Add a file to a duplicate set. Sets are only put in order once they
+ * are final (see sort_set()), so this is O(1): the new file goes right
+ * after the head, or becomes the head if it sorts before it. Keeping the
+ * first file in sort order at the head matters because matching checks
+ * new files against the head. */
 static void registerpair(file_t **matchlist, file_t *newmatch,
                 int (*comparef)(file_t *f1, file_t *f2))
 {
-  file_t *traverse;
-  file_t *back;
+  file_t *head;
 
   /* NULL pointer sanity checks */
   if (matchlist == NULL || newmatch == NULL || comparef == NULL) nullptr("registerpair()");
-  LOUD(fprintf(stderr, "registerpair: '%s', '%s'\n", (*matchlist)->d_name, newmatch->d_name);)
-
-  SETFLAG((*matchlist)->flags, F_HAS_DUPES);
-  back = NULL;
-  traverse = *matchlist;
-
-  /* FIXME: This needs to be changed! As it currently stands, the compare
-   * function only runs on a pair as it is registered and future pairs can
-   * mess up the sort order. A separate sorting function should happen before
-   * the dupe chain is acted upon rather than while pairs are registered. */
-  while (traverse) {
-    if (comparef(newmatch, traverse) <= 0) {
-      newmatch->duplicates = traverse;
-
-      if (!back) {
-        *matchlist = newmatch; /* update pointer to head of list */
-        SETFLAG(newmatch->flags, F_HAS_DUPES);
-        CLEARFLAG(traverse->flags, F_HAS_DUPES); /* flag is only for first file in dupe chain */
-      } else back->duplicates = newmatch;
+  LOUD(fprintf(stderr, "registerpair: '%s', '%s'\n", (*matchlist)->name, newmatch->name);)
+
+  head = *matchlist;
+  if (comparef(newmatch, head) <= 0) {
+    newmatch->duplicates = head;
+    *matchlist = newmatch;
+    SETFLAG(newmatch->flags, F_HAS_DUPES);
+    CLEARFLAG(head->flags, F_HAS_DUPES); /* flag is only for first file in dupe chain */
+  } else {
+    newmatch->duplicates = head->duplicates;
+    head->duplicates = newmatch;
+    SETFLAG(head->flags, F_HAS_DUPES);
+  }
+  return;
+}
+
+
+/* Put a finished duplicate set in order with a bottom-up merge sort of
+ * its chain and return the new head. The sort is stable, and registerpair()
+ * leaves files that compare equal with the newest first, which is the
+ * order the old insertion into a sorted chain gave them. */
+static file_t *sort_set(file_t *head, int (*comparef)(file_t *f1, file_t *f2))
+{
+  file_t *p, *q, *e, *tail;
+  size_t width = 1, merges, psize, qsize;
+
+  if (head == NULL || comparef == NULL) nullptr("sort_set()");
+
+  do {
+    p = head;
+    head = NULL;
+    tail = NULL;
+    merges = 0;
+    /* Merge each pair of neighboring runs of 'width' files */
+    while (p != NULL) {
+      merges++;
+      q = p;
+      for (psize = 0; psize < width && q != NULL; psize++) q = q->duplicates;
+      qsize = width;
+      while (psize > 0 || (qsize > 0 && q != NULL)) {
+        if (psize > 0 && (qsize == 0 || q == NULL || comparef(p, q) <= 0)) {
+          e = p;
+          p = p->duplicates;
+          psize--;
+        } else {
+          e = q;
+          q = q->duplicates;
+          qsize--;
+        }
+        if (tail != NULL) tail->duplicates = e;
+        else head = e;
+        tail = e;
+      }
+      p = q;
+    }
+    tail->duplicates = NULL;
+    width *= 2;
+  } while (merges > 1);
+
+  return head;
+}
+
 
+/* A file taking part in a group verification */
+struct verify_member {
+  file_t *file;
+  struct io_file io;
+  char *buf;         /* Read buffer for this file */
+  const void *data;  /* Last chunk read */
+  size_t got;
+  int open;          /* Still being read */
+  int set;           /* Subset of identical files; -1 if it dropped out */
+  int alias;         /* Earlier member with the same inode, or -1 */
+};
+
+
+/* Compare each file against the first one that is still unsorted, then
+ * repeat with whatever didn't match; used when a set is too big to hold
+ * every file open at once */
+static void verify_set_pairwise(struct verify_member * const restrict m, const size_t n)
+{
+  static struct io_file ref;
+  char path[FILE_PATH_SIZE];
+  size_t first, i;
+  int set = 0;
+
+  /* -2 means "not compared yet" */
+  for (i = 0; i < n; i++) if (m[i].alias < 0) m[i].set = -2;
+
+  for (first = 0; first < n; first++) {
+    if (m[first].alias >= 0 || m[first].set != -2) continue;
+    if (io_open(&ref, file_path(m[first].file, path)) != 0) {
+      m[first].set = -1;
+      continue;
+    }
+    m[first].set = set;
+    for (i = first + 1; i < n; i++) {
+      if (m[i].alias >= 0 || m[i].set != -2) continue;
+      if (io_open(&m[i].io, file_path(m[i].file, path)) != 0) {
+        m[i].set = -1;
+        continue;
+      }
+      if (confirmmatch(&ref, &m[i].io, m[i].file->size)) m[i].set = set;
+      io_close(&m[i].io);
+    }
+    io_close(&ref);
+    if (interrupt) break;
+    set++;
+  }
+  for (i = 0; i < n; i++) if (m[i].set == -2 || interrupt) m[i].set = -1;
+  return;
+}
+
+
+static inline int same_chunk(const struct verify_member * const restrict m1,
+                const struct verify_member * const restrict m2)
+{
+  return m1->got == m2->got && memcmp(m1->data, m2->data, m1->got) == 0;
+}
+
+
+/* Read every member of a group in lockstep, one chunk at a time. When a
+ * chunk differs the group is split into subsets of files that are still
+ * identical and each subset carries on alone; a file is closed as soon
+ * as nothing is left in its subset to compare it against. Each byte of
+ * each file is therefore read at most once. */
+static void verify_set_lockstep(struct verify_member * const restrict m,
+                const size_t n, const size_t nread)
+{
+  char *bufs;
+  int *leader, *parent, *count;
+  int nsets = 1, sets_before, reading, check = 0;
+  off_t bytes = 0;
+  const off_t total = m[0].file->size * (off_t)nread;
+  char path[FILE_PATH_SIZE];
+  size_t i, k = 0;
+
+  bufs = (char *)malloc(auto_chunk_size * nread);
+  leader = (int *)malloc(sizeof(int) * nread);
+  parent = (int *)malloc(sizeof(int) * nread);
+  count = (int *)malloc(sizeof(int) * nread);
+  if (bufs == NULL || leader == NULL || parent == NULL || count == NULL) oom("verify_set_lockstep()");
+
+  for (i = 0; i < n; i++) {
+    m[i].open = 0;
+    if (m[i].alias >= 0) continue;
+    m[i].buf = bufs + auto_chunk_size * k++;
+    if (io_open(&m[i].io, file_path(m[i].file, path)) == 0) m[i].open = 1;
+    else m[i].set = -1;
+  }
+  parent[0] = 0;
+
+  while (1) {
+    if (interrupt) {
+      for (i = 0; i < n; i++) m[i].set = -1;
       break;
-    } else {
-      if (traverse->duplicates == 0) {
-        traverse->duplicates = newmatch;
-        if (!back) SETFLAG(traverse->flags, F_HAS_DUPES);
+    }
+
+    /* A file alone in its set has nothing left to be compared with */
+    for (int set = 0; set < nsets; set++) count[set] = 0;
+    for (i = 0; i < n; i++) if (m[i].open) count[m[i].set]++;
+    reading = 0;
+    for (i = 0; i < n; i++) {
+      if (!m[i].open) continue;
+      if (count[m[i].set] < 2) {
+        io_close(&m[i].io);
+        m[i].open = 0;
+        continue;
+      }
+      m[i].data = io_read(&m[i].io, m[i].buf, auto_chunk_size, &m[i].got);
+      if (m[i].data == NULL) {
+        /* read error */
+        io_close(&m[i].io);
+        m[i].open = 0;
+        m[i].set = -1;
+        continue;
+      }
+      bytes += (off_t)m[i].got;
+      reading = 1;
+    }
+    if (!reading) break;
+
+    /* Split off files whose chunk differs from the first file of their
+     * set. Files leaving the same set with identical chunks stay together
+     * in one new set; 'parent' records which set a new set came from. */
+    sets_before = nsets;
+    for (int set = 0; set < nsets; set++) leader[set] = -1;
+    for (i = 0; i < n; i++) {
+      int set, t;
+
+      if (!m[i].open) continue;
+      set = m[i].set;
+      if (leader[set] < 0) {
+        leader[set] = (int)i;
+        continue;
+      }
+      if (same_chunk(&m[i], &m[leader[set]])) continue;
+      for (t = sets_before; t < nsets; t++)
+        if (parent[t] == set && same_chunk(&m[i], &m[leader[t]])) break;
+      if (t == nsets) {
+        parent[nsets] = set;
+        leader[nsets] = (int)i;
+        nsets++;
+      }
+      m[i].set = t;
+    }
+
+    /* Files that reached EOF together are identical */
+    for (i = 0; i < n; i++) {
+      if (m[i].open && m[i].got == 0) {
+        io_close(&m[i].io);
+        m[i].open = 0;
+      }
+    }
+
+    if (!ISFLAG(flags, F_HIDEPROGRESS) && total > 0) {
+      check++;
+      if (check > CHECK_MINIMUM) {
+        update_progress("confirm", (int)((bytes * 100) / total));
+        check = 0;
+      }
+    }
+  }
+
+  for (i = 0; i < n; i++) if (m[i].open) io_close(&m[i].io);
+  free(bufs);
+  free(leader);
+  free(parent);
+  free(count);
+  return;
+}
+
 
-        break;
+/* Byte-for-byte verification of a duplicate set that was built from
+ * hash matches. Members that are hard links to an earlier member (only
+ * possible with -H) are never read and go wherever that member goes.
+ * If the files turn out not to be identical the set is taken apart and
+ * every subset of two or more identical files becomes a set of its own. */
+static void verify_set(file_t ** const restrict files, const size_t n)
+{
+  struct verify_member *m;
+  size_t nread = 0, registered = 0, i;
+  int maxset = 0;
+
+  if (files == NULL) nullptr("verify_set()");
+  LOUD(fprintf(stderr, "verify_set(%" PRIuMAX " files)\n", (uintmax_t)n);)
+
+  m = (struct verify_member *)malloc(sizeof(struct verify_member) * n);
+  if (m == NULL) oom("verify_set()");
+  for (i = 0; i < n; i++) {
+    m[i].file = files[i];
+    m[i].set = 0;
+    m[i].alias = -1;
+    if (ISFLAG(flags, F_CONSIDERHARDLINKS)) {
+      for (size_t j = 0; j < i; j++) {
+        if (m[j].alias < 0 && m[j].file->inode == files[i]->inode
+            && m[j].file->device == files[i]->device) {
+          m[i].alias = (int)j;
+          break;
+        }
+      }
+    }
+    if (m[i].alias < 0) nread++;
+  }
+
+  if (nread > 1) {
+    STATS(stats_add_files(nread);)
+    if (nread > verify_max_files) {
+      LOUD(fprintf(stderr, "verify_set: too many files, comparing pairwise\n");)
+      verify_set_pairwise(m, n);
+    } else verify_set_lockstep(m, n, nread);
+  }
+
+  for (i = 0; i < n; i++) {
+    if (m[i].alias >= 0) m[i].set = m[m[i].alias].set;
+    if (m[i].set != 0) break;
+  }
+  if (i == n) {
+    /* Everything matched; the set stands as it is */
+    free(m);
+    return;
+  }
+
+  /* Take the set apart and register each identical subset */
+  for (i = 0; i < n; i++) {
+    files[i]->duplicates = NULL;
+    CLEARFLAG(files[i]->flags, F_HAS_DUPES);
+    if (m[i].set > maxset) maxset = m[i].set;
+  }
+  dupecount -= n - 1;
+  for (int set = 0; set <= maxset; set++) {
+    file_t *head = NULL;
+
+    for (i = 0; i < n; i++) {
+      if (m[i].set != set) continue;
+      if (head == NULL) {
+        head = m[i].file;
+        continue;
       }
+      registerpair(&head, m[i].file,
+          (ordertype == ORDER_TIME) ? sort_pairs_by_mtime : sort_pairs_by_filename);
+      dupecount++;
+      registered++;
     }
+    if (head != NULL && ISFLAG(head->flags, F_HAS_DUPES)) registered++;
+  }
+  LOUD(fprintf(stderr, "verify_set: only %" PRIuMAX " of %" PRIuMAX " files are duplicates\n",
+        (uintmax_t)registered, (uintmax_t)n);)
+  DBG(hash_fail += (unsigned int)(n - registered);)
+
+  free(m);
+  return;
+}
+
+
+/* Verify every duplicate set found among the files of one size */
+static void verify_sets(file_t ** const restrict list, const size_t count)
+{
+  file_t **heads, **set;
+  size_t nheads = 0, n, i;
+
+  if (list == NULL) nullptr("verify_sets()");
+  LOUD(fprintf(stderr, "verify_sets(%" PRIuMAX " files)\n", (uintmax_t)count);)
+
+  /* Quick compare and --trust-hash take hash matches as they are */
+  if (ISFLAG(flags, F_QUICKCOMPARE) || ISFLAG(flags, F_TRUSTHASH)) return;
+
+  if (verify_max_files == 0) {
+    verify_max_files = VERIFY_MAX_FILES;
+#ifndef ON_WINDOWS
+    /* Leave some descriptors free for everything else */
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY) {
+      if (rl.rlim_cur <= 66) verify_max_files = 2;
+      else if (rl.rlim_cur - 64 < verify_max_files) verify_max_files = (size_t)(rl.rlim_cur - 64);
+    }
+#endif
+  }
+
+  /* Splitting a set creates new heads, so collect the heads first */
+  for (i = 0; i < count; i++) if (ISFLAG(list[i]->flags, F_HAS_DUPES)) nheads++;
+  if (nheads == 0) return;
+  heads = (file_t **)malloc(sizeof(file_t *) * (nheads + count));
+  if (heads == NULL) oom("verify_sets()");
+  set = heads + nheads;
+  nheads = 0;
+  for (i = 0; i < count; i++) if (ISFLAG(list[i]->flags, F_HAS_DUPES)) heads[nheads++] = list[i];
+
+  for (i = 0; i < nheads; i++) {
+    n = 0;
+    for (file_t *f = heads[i]; f != NULL; f = f->duplicates) set[n++] = f;
+    verify_set(set, n);
+  }
+
+  free(heads);
+  return;
+}
+
+
+/* Number of files in a duplicate set */
+static uintmax_t set_size(const file_t * restrict head)
+{
+  uintmax_t n = 0;
+
+  for (; head != NULL; head = head->duplicates) n++;
+  return n;
+}
+
+
+/* Run the selected action on one finished set (--json and --stream) */
+static void stream_set(file_t * const restrict head)
+{
+  stream_sets++;
+  STATS(stats_add_files(set_size(head));)
+  if (ISFLAG(flags, F_PRINTJSON)) {
+    printjson_set(head);
+    return;
+  }
+  if (ISFLAG(flags, F_DELETEFILES)) deletefiles_set(head);
+  if (ISFLAG(flags, F_SUMMARIZEMATCHES)) summarize_set(head);
+#ifndef NO_SYMLINKS
+  if (ISFLAG(flags, F_MAKESYMLINKS)) linkfiles_set(head, 0);
+#endif
+#ifndef NO_HARDLINKS
+  if (ISFLAG(flags, F_HARDLINKFILES)) linkfiles_set(head, 1);
+#endif
+#ifdef ENABLE_DEDUPE
+  if (ISFLAG(flags, F_REFLINKFILES)) reflinkfiles_set(head);
+#endif
+  if (ISFLAG(flags, F_PRINTMATCHES)) {
+    printmatches_set(head);
+    fwprint(stdout, "", 1);
+  }
+  fflush(stdout);
+  return;
+}
+
+
+/* Wrap up a size group once all of its files have been matched: check
+ * the sets byte-for-byte, then hand them to the action when streaming */
+static void finish_group(file_t ** const restrict group, const size_t count)
+{
+  struct stats_timer st;
+  int cleared = 0;
+#ifdef ENABLE_DEDUPE
+  file_t **heads;
+  size_t nheads = 0;
+#endif
+
+  STATS(stats_begin(&st, STATS_CONFIRM);)
+  verify_sets(group, count);
+  STATS(stats_end(&st);)
+
+  /* The sets are final now, so each one only has to be sorted once */
+  for (size_t i = 0; i < count; i++) {
+    file_t *head;
+
+    if (!ISFLAG(group[i]->flags, F_HAS_DUPES)) continue;
+    head = sort_set(group[i], (ordertype == ORDER_TIME) ? sort_pairs_by_mtime : sort_pairs_by_filename);
+    if (head != group[i]) {
+      CLEARFLAG(group[i]->flags, F_HAS_DUPES);
+      SETFLAG(head->flags, F_HAS_DUPES);
+    }
+  }
+  if (!ISFLAG(flags, F_PRINTJSON) && !ISFLAG(flags, F_STREAM)) return;
+
+  STATS(stats_begin(&st, STATS_ACTION);)
+  for (size_t i = 0; i < count; i++) {
+    if (!ISFLAG(group[i]->flags, F_HAS_DUPES)) continue;
+    /* Don't leave action output on the end of the progress line */
+    if (!cleared && !ISFLAG(flags, F_HIDEPROGRESS)) fprintf(stderr, "\r%60s\r", " ");
+    cleared = 1;
+    stream_set(group[i]);
+  }
 
-    back = traverse;
-    traverse = traverse->duplicates;
+#ifdef ENABLE_DEDUPE
+  /* The sets of a group are independent, so they can be deduped together */
+  if (cleared && ISFLAG(flags, F_DEDUPEFILES) && !ISFLAG(flags, F_PRINTJSON)) {
+    heads = (file_t **)malloc(sizeof(file_t *) * count);
+    if (heads == NULL) oom("finish_group()");
+    for (size_t i = 0; i < count; i++)
+      if (ISFLAG(group[i]->flags, F_HAS_DUPES)) heads[nheads++] = group[i];
+    dedupefiles_sets(heads, nheads);
+    free(heads);
   }
+#endif
+  STATS(stats_end(&st);)
   return;
 }
 
@@ -1397,8 +2949,8 @@ static inline void help_text(void)
 
   printf(" -1 --one-file-system \tdo not match files on different filesystems/devices\n");
   printf(" -A --nohidden    \texclude hidden files from consideration\n");
-#ifdef ENABLE_BTRFS
-  printf(" -B --dedupe      \tSend matches to btrfs for block-level deduplication\n");
+#ifdef ENABLE_DEDUPE
+  printf(" -B --dedupe      \tSend matches to filesystem for block-level deduplication\n");
 #endif
   printf(" -d --delete      \tprompt user for files to preserve and delete all\n");
   printf("                  \tothers; important: under particular circumstances,\n");
@@ -1455,6 +3007,43 @@ static inline void help_text(void)
   printf("                  \tK/M/G size suffixes can be used (case-insensitive)\n");
   printf(" -z --zeromatch   \tconsider zero-length files to be duplicates\n");
   printf(" -Z --softabort   \tIf the user aborts (i.e. CTRL-C) act on matches so far\n");
+#ifndef NO_THREADS
+  printf("    --threads=N   \tscan and hash using N threads (0 = one per CPU)\n");
+#endif
+  printf("    --hash-db=FILE\treuse hashes of unchanged files stored in FILE and\n");
+  printf("                  \tsave new hashes to it on exit\n");
+#ifndef ON_WINDOWS
+  printf("    --io=MODE     \tread files with MODE: stdio (default), pread, mmap,\n");
+  printf("                  \tor direct; all but stdio avoid filling the page cache\n");
+#ifdef ENABLE_IO_URING
+  printf("                  \t'uring' reads many files at once (Linux 5.6+)\n");
+#endif
+#endif
+#ifdef WIDE_HASH
+  printf("    --hash=NAME   \thash files with NAME: jodyhash (default) or murmur3\n");
+  printf("                  \t(128-bit, hashes whole files)\n");
+  printf("    --trust-hash  \ttreat 128-bit hash matches as duplicates without\n");
+  printf("                  \ta byte-for-byte check; needs --hash=murmur3\n");
+#endif
+  printf("    --samples=N   \tbefore fully hashing files of 1 MiB or more, hash\n");
+  printf("                  \ttheir last block, then N blocks spread through them\n");
+  printf("                  \t(default 8, at most 64; 0 = last block only)\n");
+  printf("    --files-from=FILE\tcheck the files listed one per line in FILE (or\n");
+  printf("                  \tstdin if FILE is -) as well as any directories\n");
+  printf("    --files0-from=FILE\tlike --files-from but names are NUL-separated\n");
+  printf("    --json        \tprint matches as a JSON array of sets, writing\n");
+  printf("                  \teach set as soon as it is final\n");
+  printf("    --ndjson      \tlike --json but one set per line (NDJSON)\n");
+#ifdef ENABLE_DEDUPE
+  printf("    --dedupe-jobs=N\twith -B, dedupe up to N sets at once (default %d)\n", DEDUPE_JOBS_DEFAULT);
+  printf("    --reflink     \treplace duplicates with copy-on-write clones of the\n");
+  printf("                  \tfirst file; each keeps its own inode and times\n");
+#endif
+  printf("    --stream      \tact on each set of matches as soon as it is final\n");
+  printf("                  \tinstead of after the whole scan (sets come out in\n");
+  printf("                  \torder of size); -d needs -N for this\n");
+  printf("    --stats[=json]\tafter the run, print the time, files and bytes read\n");
+  printf("                  \tand files opened of each phase to stderr\n");
 #ifdef OMIT_GETOPT_LONG
   printf("Note: Long options are not supported in this build.\n\n");
 #endif
@@ -1470,12 +3059,14 @@ int main(int argc, char **argv)
   static struct proc_cacheinfo pci;
   static file_t *files = NULL;
   static file_t *curfile;
+  static file_t **sizegroups;
+  static size_t groupcount, curgroup, groupstart = 0;
   static char **oldargv;
   static char *endptr;
   static int firstrecurse;
   static int opt;
   static int pm = 1;
-  static ordertype_t ordertype = ORDER_NAME;
+  static struct stats_timer st;
 
 #ifndef OMIT_GETOPT_LONG
   static const struct option long_options[] =
@@ -1518,6 +3109,20 @@ int main(int argc, char **argv)
     { "xsize", 1, 0, 'x' },
     { "zeromatch", 0, 0, 'z' },
     { "softabort", 0, 0, 'Z' },
+    { "threads", 1, 0, OPT_THREADS },
+    { "hash-db", 1, 0, OPT_HASHDB },
+    { "io", 1, 0, OPT_IO },
+    { "hash", 1, 0, OPT_HASH },
+    { "trust-hash", 0, 0, OPT_TRUSTHASH },
+    { "samples", 1, 0, OPT_SAMPLES },
+    { "files-from", 1, 0, OPT_FILESFROM },
+    { "files0-from", 1, 0, OPT_FILES0FROM },
+    { "json", 0, 0, OPT_JSON },
+    { "ndjson", 0, 0, OPT_NDJSON },
+    { "stream", 0, 0, OPT_STREAM },
+    { "dedupe-jobs", 1, 0, OPT_DEDUPEJOBS },
+    { "reflink", 0, 0, OPT_REFLINK },
+    { "stats", 2, 0, OPT_STATS },
     { 0, 0, 0, 0 }
   };
 #define GETOPT getopt_long
@@ -1730,18 +3335,105 @@ int main(int argc, char **argv)
       }
       break;
     case 'B':
-#ifdef ENABLE_BTRFS
+#ifdef ENABLE_DEDUPE
     SETFLAG(flags, F_DEDUPEFILES);
-    /* btrfs will do the byte-for-byte check itself */
+    /* The kernel will do the byte-for-byte check itself */
     SETFLAG(flags, F_QUICKCOMPARE);
     /* It is completely useless to dedupe zero-length extents */
     CLEARFLAG(flags, F_INCLUDEEMPTY);
 #else
-    fprintf(stderr, "This program was built without btrfs support\n");
+    fprintf(stderr, "This program was built without dedupe support\n");
     exit(EXIT_FAILURE);
 #endif
     break;
 
+    case OPT_THREADS:
+      hash_threads = (unsigned int)strtoul(optarg, &endptr, 10);
+      if (*optarg == '\0' || *endptr != '\0' || *optarg == '-') {
+        fprintf(stderr, "invalid value for --threads: '%s'\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      if (hash_threads == 0) hash_threads = pool_cpu_count();
+#ifdef NO_THREADS
+      if (hash_threads > 1) {
+        fprintf(stderr, "This program was built without thread support\n");
+        exit(EXIT_FAILURE);
+      }
+#endif
+      break;
+    case OPT_HASHDB:
+      hashdb_name = optarg;
+      break;
+    case OPT_IO:
+      if (io_set_mode(optarg) != 0) {
+        fprintf(stderr, "invalid value for --io: '%s'\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case OPT_HASH:
+      if (hash_provider_set(optarg) != 0) {
+        fprintf(stderr, "invalid value for --hash: '%s'\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case OPT_TRUSTHASH:
+      SETFLAG(flags, F_TRUSTHASH);
+      break;
+    case OPT_SAMPLES:
+      sample_count = (unsigned int)strtoul(optarg, &endptr, 10);
+      if (*optarg == '\0' || *endptr != '\0' || *optarg == '-' || sample_count > SAMPLE_COUNT_MAX) {
+        fprintf(stderr, "invalid value for --samples: '%s'\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case OPT_FILESFROM:
+    case OPT_FILES0FROM:
+      files_from_name = optarg;
+      files_from_delim = (opt == OPT_FILES0FROM) ? '\0' : '\n';
+      break;
+    case OPT_JSON:
+    case OPT_NDJSON:
+      SETFLAG(flags, F_PRINTJSON);
+      json_lines = (opt == OPT_NDJSON);
+      break;
+    case OPT_STREAM:
+      SETFLAG(flags, F_STREAM);
+      break;
+    case OPT_STATS:
+      if (stats_set_mode(optarg) != 0) {
+        fprintf(stderr, "invalid value for --stats: '%s'\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case OPT_REFLINK:
+#ifdef ENABLE_DEDUPE
+      SETFLAG(flags, F_REFLINKFILES);
+      /* Cloning zero-length files would gain nothing */
+      CLEARFLAG(flags, F_INCLUDEEMPTY);
+#else
+      fprintf(stderr, "This program was built without dedupe support\n");
+      exit(EXIT_FAILURE);
+#endif
+      break;
+    case OPT_DEDUPEJOBS:
+#ifdef ENABLE_DEDUPE
+      dedupe_jobs = (unsigned int)strtoul(optarg, &endptr, 10);
+      if (*optarg == '\0' || *endptr != '\0' || *optarg == '-' || dedupe_jobs == 0) {
+        fprintf(stderr, "invalid value for --dedupe-jobs: '%s'\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+ #ifdef NO_THREADS
+      if (dedupe_jobs > 1) {
+        fprintf(stderr, "This program was built without thread support\n");
+        exit(EXIT_FAILURE);
+      }
+ #endif
+#else
+      fprintf(stderr, "This program was built without dedupe support\n");
+      exit(EXIT_FAILURE);
+#endif
+      break;
+
     default:
       fprintf(stderr, "Try `jdupes --help' for more information.\n");
       string_malloc_destroy();
@@ -1749,31 +3441,51 @@ int main(int argc, char **argv)
     }
   }
 
-  if (optind >= argc) {
+  if (optind >= argc && files_from_name == NULL) {
     fprintf(stderr, "no directories specified (use -h option for help)\n");
     string_malloc_destroy();
     exit(EXIT_FAILURE);
   }
 
-  if (ISFLAG(flags, F_ISOLATE) && optind == (argc - 1)) {
+  /* A file list counts as one more directory for isolation */
+  if (ISFLAG(flags, F_ISOLATE) && (argc - optind) + (files_from_name != NULL) < 2) {
     fprintf(stderr, "Isolation requires at least two directories on the command line\n");
     string_malloc_destroy();
     exit(EXIT_FAILURE);
   }
 
+  if (ISFLAG(flags, F_TRUSTHASH) && !hash_provider->wide) {
+    fprintf(stderr, "option --trust-hash requires a 128-bit hash (--hash=murmur3)\n");
+    string_malloc_destroy();
+    exit(EXIT_FAILURE);
+  }
+
   if (ISFLAG(flags, F_RECURSE) && ISFLAG(flags, F_RECURSEAFTER)) {
     fprintf(stderr, "options --recurse and --recurse: are not compatible\n");
     string_malloc_destroy();
     exit(EXIT_FAILURE);
   }
 
+  if (files_from_name != NULL && strcmp(files_from_name, "-") == 0
+      && ISFLAG(flags, F_DELETEFILES) && !ISFLAG(flags, F_NOPROMPT)) {
+    fprintf(stderr, "reading the file list from stdin requires --noprompt with --delete\n");
+    string_malloc_destroy();
+    exit(EXIT_FAILURE);
+  }
+
+  if (ISFLAG(flags, F_STREAM) && ISFLAG(flags, F_DELETEFILES) && !ISFLAG(flags, F_NOPROMPT)) {
+    fprintf(stderr, "option --stream requires --noprompt with --delete\n");
+    string_malloc_destroy();
+    exit(EXIT_FAILURE);
+  }
+
   if (ISFLAG(flags, F_SUMMARIZEMATCHES) && ISFLAG(flags, F_DELETEFILES)) {
     fprintf(stderr, "options --summarize and --delete are not compatible\n");
     string_malloc_destroy();
     exit(EXIT_FAILURE);
   }
 
-#ifdef ENABLE_BTRFS
+#ifdef ENABLE_DEDUPE
   if (ISFLAG(flags, F_CONSIDERHARDLINKS) && ISFLAG(flags, F_DEDUPEFILES))
     fprintf(stderr, "warning: option --dedupe overrides the behavior of --hardlinks\n");
 #endif
@@ -1783,15 +3495,18 @@ int main(int argc, char **argv)
       !!ISFLAG(flags, F_DELETEFILES) +
       !!ISFLAG(flags, F_HARDLINKFILES) +
       !!ISFLAG(flags, F_MAKESYMLINKS) +
-      !!ISFLAG(flags, F_DEDUPEFILES);
+      !!ISFLAG(flags, F_DEDUPEFILES) +
+      !!ISFLAG(flags, F_REFLINKFILES) +
+      !!ISFLAG(flags, F_PRINTJSON);
 
   if (pm > 1) {
-      fprintf(stderr, "Only one of --summarize, --delete, --linkhard, --linksoft, or --dedupe\nmay be used\n");
+      fprintf(stderr, "Only one of --summarize, --delete, --linkhard, --linksoft, --reflink, --dedupe,\nor --json/--ndjson may be used\n");
       string_malloc_destroy();
       exit(EXIT_FAILURE);
   }
   if (pm == 0) SETFLAG(flags, F_PRINTMATCHES);
 
+  STATS(stats_start(); stats_begin(&st, STATS_SCAN);)
   if (ISFLAG(flags, F_RECURSEAFTER)) {
     firstrecurse = nonoptafter("--recurse:", argc, oldargv, argv);
 
@@ -1807,7 +3522,7 @@ int main(int argc, char **argv)
     /* F_RECURSE is not set for directories before --recurse: */
     for (int x = optind; x < firstrecurse; x++) {
       slash_convert(argv[x]);
-      grokdir(argv[x], &files, 0);
+      grokdirs(argv[x], &files, 0);
       user_dir_count++;
     }
 
@@ -1816,110 +3531,94 @@ int main(int argc, char **argv)
 
     for (int x = firstrecurse; x < argc; x++) {
       slash_convert(argv[x]);
-      grokdir(argv[x], &files, 1);
+      grokdirs(argv[x], &files, 1);
       user_dir_count++;
     }
   } else {
     for (int x = optind; x < argc; x++) {
       slash_convert(argv[x]);
-      grokdir(argv[x], &files, ISFLAG(flags, F_RECURSE));
+      grokdirs(argv[x], &files, ISFLAG(flags, F_RECURSE));
       user_dir_count++;
     }
   }
 
+  if (files_from_name != NULL) {
+    grokfilelist(files_from_name, files_from_delim, &files);
+    user_dir_count++;
+  }
+  STATS(stats_add_files(filecount); stats_end(&st);)
+
   if (ISFLAG(flags, F_REVERSESORT)) sort_direction = -1;
   if (!ISFLAG(flags, F_HIDEPROGRESS)) fprintf(stderr, "\n");
-  if (!files) exit(EXIT_SUCCESS);
+  if (ISFLAG(flags, F_PRINTJSON)) printjson_start(json_lines);
+  if (!files) {
+    if (ISFLAG(flags, F_PRINTJSON)) printjson_end();
+    STATS(stats_print(stderr, hash_threads);)
+    exit(EXIT_SUCCESS);
+  }
 
-  curfile = files;
-  progress = 0;
+  /* Reuse hashes of unchanged files from earlier runs */
+  if (hashdb_name != NULL && hashdb_load(hashdb_name) > 0) hashdb_apply(files, sample_count);
 
   /* Catch CTRL-C */
   signal(SIGINT, sighandler);
 
-  while (curfile) {
-    static file_t **match = NULL;
-    static FILE *file1;
-    static FILE *file2;
-#ifdef USE_TREE_REBALANCE
-    static unsigned int depth_threshold = INITIAL_DEPTH_THRESHOLD;
+  /* Only files that share a size with another file need to be matched */
+  sizegroups = group_files_by_size(files, &groupcount);
+  progress = filecount - groupcount;
+
+#ifdef ENABLE_IO_URING
+  /* Read the first block of many files at once; anything this misses
+   * is hashed the usual way */
+  STATS(stats_begin(&st, STATS_PARTIAL);)
+  if (io_mode == IO_URING && uring_hash_partial(sizegroups, groupcount, &interrupt) != 0) {
+    LOUD(fprintf(stderr, "io_uring is unavailable, hashing files one at a time\n"));
+  }
+  STATS(stats_end(&st);)
+#endif
+#ifndef NO_THREADS
+  /* Hash everything that will need it in parallel before matching */
+  if (hash_threads > 1) prehash_files(sizegroups, groupcount, hash_threads);
 #endif
 
+  /* Matching reads the hot fields from packed arrays */
+  if (groupcount > 0) meta_build(sizegroups, groupcount);
+
+  for (curgroup = 0; curgroup < groupcount; curgroup++) {
+    static struct match_node *match = NULL;
+
     if (interrupt) {
       fprintf(stderr, "\nStopping file scan due to user abort\n");
       if (!ISFLAG(flags, F_SOFTABORT)) exit(EXIT_FAILURE);
       interrupt = 0;  /* reset interrupt for re-use */
+      /* Sets found so far in the unfinished group still need checking */
+      finish_group(sizegroups + groupstart, curgroup - groupstart);
       goto skip_file_scan;
     }
 
-    LOUD(fprintf(stderr, "\nMAIN: current file: %s\n", curfile->d_name));
+    curfile = sizegroups[curgroup];
+    LOUD(fprintf(stderr, "\nMAIN: current file: %s\n", curfile->name));
 
-    if (!checktree) registerfile(&checktree, NONE, curfile);
-    else match = checkmatch(checktree, curfile);
-
-#ifdef USE_TREE_REBALANCE
-    /* Rebalance the match tree after a certain number of files processed */
-    if (max_depth > depth_threshold) {
-      rebalance_tree(checktree);
-      max_depth = 0;
-      if (depth_threshold < 512) depth_threshold <<= 1;
-      else depth_threshold += 64;
-    }
-#endif /* USE_TREE_REBALANCE */
+    /* Each size group gets its own match index */
+    if (curgroup == 0 || curfile->size != sizegroups[curgroup - 1]->size)
+      match_reset(sizegroups + curgroup, groupcount - curgroup);
+    match = checkmatch(curfile, curgroup);
 
-    /* Byte-for-byte check that a matched pair are actually matched */
     if (match != NULL) {
-      /* Quick comparison mode will never run confirmmatch()
-       * Also skip match confirmation for hard-linked files
-       * (This set of comparisons is ugly, but quite efficient) */
-      if (ISFLAG(flags, F_QUICKCOMPARE) ||
-           (ISFLAG(flags, F_CONSIDERHARDLINKS) &&
-           (curfile->inode == (*match)->inode) &&
-           (curfile->device == (*match)->device))
-         ) {
-        LOUD(fprintf(stderr, "MAIN: notice: quick compare match (-Q)\n"));
-        registerpair(match, curfile,
-            (ordertype == ORDER_TIME) ? sort_pairs_by_mtime : sort_pairs_by_filename);
-        dupecount++;
-        goto skip_full_check;
-      }
-
-#ifdef UNICODE
-      if (!M2W(curfile->d_name, wstr)) file1 = NULL;
-      else file1 = _wfopen(wstr, FILE_MODE_RO);
-#else
-      file1 = fopen(curfile->d_name, FILE_MODE_RO);
-#endif
-      if (!file1) {
-        curfile = curfile->next;
-        continue;
-      }
-
-#ifdef UNICODE
-      if (!M2W((*match)->d_name, wstr)) file2 = NULL;
-      else file2 = _wfopen(wstr, FILE_MODE_RO);
-#else
-      file2 = fopen((*match)->d_name, FILE_MODE_RO);
-#endif
-      if (!file2) {
-        fclose(file1);
-        curfile = curfile->next;
-        continue;
-      }
-
-      if (confirmmatch(file1, file2, curfile->size)) {
-        LOUD(fprintf(stderr, "MAIN: registering matched file pair\n"));
-        registerpair(match, curfile,
-            (ordertype == ORDER_TIME) ? sort_pairs_by_mtime : sort_pairs_by_filename);
-        dupecount++;
-      } DBG(else hash_fail++;)
-
-      fclose(file1);
-      fclose(file2);
+      registerpair(&match->file, curfile,
+          (ordertype == ORDER_TIME) ? sort_pairs_by_mtime : sort_pairs_by_filename);
+      /* The index node follows the head of the set */
+      if (match->file == curfile) match->id = curgroup;
+      dupecount++;
     }
 
-skip_full_check:
-    curfile = curfile->next;
+    /* Hash matches are checked byte-for-byte a whole set at a time once
+     * every file of this size has been through the match index; after
+     * that the sets of this size are final */
+    if (curgroup + 1 == groupcount || sizegroups[curgroup + 1]->size != curfile->size) {
+      finish_group(sizegroups + groupstart, curgroup + 1 - groupstart);
+      groupstart = curgroup + 1;
+    }
 
     if (!ISFLAG(flags, F_HIDEPROGRESS)) update_progress(NULL, -1);
     progress++;
@@ -1930,6 +3629,31 @@ skip_full_check:
 skip_file_scan:
   /* Stop catching CTRL+C */
   signal(SIGINT, SIG_DFL);
+  meta_free();
+  match_free();
+  free(sizegroups);
+  if (hashdb_name != NULL) {
+    hashdb_save(hashdb_name, files, sample_count);
+    hashdb_free();
+  }
+  STATS(stats_begin(&st, STATS_ACTION);)
+  if (ISFLAG(flags, F_PRINTJSON)) {
+    printjson_end();
+    goto skip_actions;
+  }
+  if (ISFLAG(flags, F_STREAM)) {
+    /* Every set has already been acted upon */
+    if (ISFLAG(flags, F_SUMMARIZEMATCHES)) summarize_print();
+#ifdef ENABLE_DEDUPE
+    if (ISFLAG(flags, F_DEDUPEFILES)) dedupefiles_report();
+#endif
+    if (ISFLAG(flags, F_PRINTMATCHES) && stream_sets == 0) fwprint(stderr, "No duplicates found.", 1);
+    goto skip_actions;
+  }
+  STATS(
+    for (file_t *f = files; f != NULL; f = f->next)
+      if (ISFLAG(f->flags, F_HAS_DUPES)) stats_add_files(set_size(f));
+  )
   if (ISFLAG(flags, F_DELETEFILES)) {
     if (ISFLAG(flags, F_NOPROMPT)) deletefiles(files, 0, 0);
     else deletefiles(files, 1, stdin);
@@ -1941,11 +3665,17 @@ skip_file_scan:
 #ifndef NO_HARDLINKS
   if (ISFLAG(flags, F_HARDLINKFILES)) linkfiles(files, 1);
 #endif /* NO_HARDLINKS */
-#ifdef ENABLE_BTRFS
+#ifdef ENABLE_DEDUPE
   if (ISFLAG(flags, F_DEDUPEFILES)) dedupefiles(files);
-#endif /* ENABLE_BTRFS */
+  if (ISFLAG(flags, F_REFLINKFILES)) reflinkfiles(files);
+#endif /* ENABLE_DEDUPE */
   if (ISFLAG(flags, F_PRINTMATCHES)) printmatches(files);
 
+skip_actions:
+  STATS(
+    stats_end(&st);
+    stats_print(stderr, hash_threads);
+  )
   string_malloc_destroy();
 
 #ifdef DEBUG
@@ -1953,14 +3683,17 @@ skip_file_scan:
     fprintf(stderr, "\n%d partial (+%d small) -> %d full hash -> %d full (%d partial elim) (%d hash%u fail)\n",
         partial_hash, small_file, full_hash, partial_to_full,
         partial_elim, hash_fail, (unsigned int)sizeof(hash_t)*8);
-    fprintf(stderr, "%" PRIuMAX " total files, %" PRIuMAX " comparisons, branch L %u, R %u, both %u\n",
-        filecount, comparisons, left_branch, right_branch,
-        left_branch + right_branch);
-    fprintf(stderr, "Max tree depth: %u; SMA: allocs %" PRIuMAX ", free %" PRIuMAX ", fail %" PRIuMAX ", reuse %" PRIuMAX ", scan %" PRIuMAX ", tails %" PRIuMAX "\n",
-        max_depth, sma_allocs, sma_free_good, sma_free_ignored,
+    fprintf(stderr, "Large files: %d tail, %d sampled (%d blocks) compares -> %d eliminated before full hash\n",
+        tail_hash, sample_hash, sample_count, stage_elim);
+    fprintf(stderr, "%" PRIuMAX " total files, %" PRIuMAX " lookups, %" PRIuMAX " index probes, %u splits\n",
+        filecount, comparisons, match_probes, match_splits);
+    fprintf(stderr, "SMA: allocs %" PRIuMAX ", free %" PRIuMAX ", fail %" PRIuMAX ", reuse %" PRIuMAX ", scan %" PRIuMAX ", tails %" PRIuMAX "\n",
+        sma_allocs, sma_free_good, sma_free_ignored,
         sma_free_reclaimed, sma_free_scanned, sma_free_tails);
     fprintf(stderr, "I/O chunk size: %" PRIuMAX " KiB (%s)\n", (uintmax_t)(auto_chunk_size >> 10),
         (pci.l1 + pci.l1d) != 0 ? "dynamically sized" : "default size");
+    fprintf(stderr, "Hash: %s, %u bits (jodyhash: %d lanes, %s kernel)\n",
+        hash_provider->name, hash_provider_bits(), JODY_HASH_LANES, jody_hash_kernel());
 #ifdef ON_WINDOWS
  #ifndef NO_HARDLINKS
     if (ISFLAG(flags, F_HARDLINKFILES))
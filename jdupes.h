@@ -17,12 +17,6 @@ extern "C" {
 #include "jody_sort.h"
 #include "version.h"
 
-/* Optional btrfs support */
-#ifdef ENABLE_BTRFS
-#include <sys/ioctl.h>
-#include <linux/btrfs.h>
-#endif
-
 /* Detect Windows and modify as needed */
 #if defined _WIN32 || defined __CYGWIN__
  #define ON_WINDOWS 1
@@ -79,10 +73,15 @@ extern int err_mode;
 
 /* Low memory option overrides */
 #ifdef LOW_MEMORY
- #undef USE_TREE_REBALANCE
  #ifndef NO_PERMS
   #define NO_PERMS 1
  #endif
+ #undef WIDE_HASH
+#else
+ /* Room for 64 more hash bits per file (needed by 128-bit hashes) */
+ #define WIDE_HASH 1
+ /* Keep a numeric_sort_key() per file for ordering sets by name */
+ #define SORT_KEYS 1
 #endif
 
 /* Aggressive verbosity for deep debugging */
@@ -98,9 +97,6 @@ extern int err_mode;
 /* Compile out debugging stat counters unless requested */
 #ifdef DEBUG
  #define DBG(a) a
- #ifndef TREE_DEPTH_STATS
-  #define TREE_DEPTH_STATS
- #endif
 #else
  #define DBG(a)
 #endif
@@ -135,6 +131,10 @@ extern uint_fast32_t flags;
 #define F_MAKESYMLINKS		0x00200000U
 #define F_PRINTMATCHES		0x00400000U
 #define F_ONEFS			0x00800000U
+#define F_TRUSTHASH		0x01000000U
+#define F_PRINTJSON		0x02000000U
+#define F_STREAM		0x04000000U
+#define F_REFLINKFILES		0x08000000U
 
 #define F_LOUD			0x40000000U
 #define F_DEBUG			0x80000000U
@@ -145,6 +145,8 @@ extern uint_fast32_t flags;
 #define F_HASH_FULL		0x00000004U
 #define F_HAS_DUPES		0x00000008U
 #define F_IS_SYMLINK		0x00000010U
+#define F_HASH_TAIL		0x00000020U
+#define F_HASH_SAMPLE		0x00000040U
 
 typedef enum {
   ORDER_NAME = 0,
@@ -168,20 +170,36 @@ typedef enum {
 /* For interactive deletion input */
 #define INPUT_SIZE 512
 
-/* Per-file information */
+/* Per-file information
+ * Only the file's own name is stored; file_path() (path_intern.h) puts
+ * its full path name back together from the shared directory records */
+struct _path_dir;
 typedef struct _file {
   struct _file *duplicates;
   struct _file *next;
-  char *d_name;
+  const struct _path_dir *dir;
+  char *name;
   dev_t device;
   jdupes_mode_t mode;
   off_t size;
   jdupes_ino_t inode;
   hash_t filehash_partial;
+  hash_t filehash_tail;    /* Last block; large files only */
+  hash_t filehash_sample;  /* Sampled blocks; large files only */
   hash_t filehash;
+#ifdef WIDE_HASH
+  uint64_t filehash_partial_ext;  /* Extra bits from wide hash providers */
+  uint64_t filehash_ext;
+#endif
   time_t mtime;
+  int64_t ctime_ns;  /* Status change time; unlike mtime users can't set it */
+  uint32_t mtime_nsec;
   uint32_t flags;  /* Status flags */
   unsigned int user_order; /* Order of the originating command-line parameter */
+#ifdef SORT_KEYS
+  unsigned int sortkey_len;
+  unsigned char *sortkey;  /* Built the first time the file is sorted by name */
+#endif
 #ifndef NO_PERMS
   uid_t uid;
   gid_t gid;
@@ -193,16 +211,12 @@ typedef struct _file {
 #endif
 } file_t;
 
-typedef struct _filetree {
-  file_t *file;
-  struct _filetree *left;
-  struct _filetree *right;
-#ifdef USE_TREE_REBALANCE
-  struct _filetree *parent;
-  unsigned int left_weight;
-  unsigned int right_weight;
-#endif /* USE_TREE_REBALANCE */
-} filetree_t;
+/* Store wide hash bits; does nothing if there's no room for them */
+#ifdef WIDE_HASH
+ #define SET_HASH_EXT(a,b) (a = b)
+#else
+ #define SET_HASH_EXT(a,b)
+#endif
 
 /* This gets used in many functions */
 #ifdef ON_WINDOWS
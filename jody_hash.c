@@ -11,6 +11,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "jody_hash.h"
 
 /* DO NOT modify the shift unless you know what you're doing.
@@ -112,3 +113,259 @@ extern hash_t jody_block_hash(const hash_t * restrict data,
 
 	return hash;
 }
+
+
+/* Multi-lane hashing
+ *
+ * jody_block_hash() is one long dependency chain, so a CPU can't work
+ * on more than one hash_t at a time no matter how wide it is. The lane
+ * variant runs JODY_HASH_LANES copies of the same round side by side:
+ * hash_t number N of the data goes to lane (N % JODY_HASH_LANES). The
+ * lanes are independent, so they map directly onto vector registers
+ * (SSE2 and AVX2 on x86, NEON on ARM) and even the plain C version keeps
+ * several ALUs busy. At the end the lanes are folded into one hash_t
+ * with the normal round, then any leftover bytes that don't fill a whole
+ * block are hashed with jody_block_hash().
+ *
+ * Every kernel computes exactly the same value; the fastest one the CPU
+ * supports is picked at run time. Hashing zero bytes returns the start
+ * hash unchanged, just like jody_block_hash(). */
+
+typedef void (*jody_lanes_t)(hash_t * const restrict lane,
+		const unsigned char * restrict data, size_t blocks);
+
+/* One round of the hash for a single element */
+#define JODY_ROUND(h, e, c) do { \
+	h += e; \
+	h += c; \
+	h = (h << JODY_HASH_SHIFT) | h >> (sizeof(hash_t) * 8 - JODY_HASH_SHIFT); \
+	h ^= e; \
+	h = (h << JODY_HASH_SHIFT) | h >> (sizeof(hash_t) * 8 - JODY_HASH_SHIFT); \
+	h ^= c; \
+	h += e; \
+} while (0)
+
+static void jody_lanes_c(hash_t * const restrict lane,
+		const unsigned char * restrict data, size_t blocks)
+{
+	hash_t h[JODY_HASH_LANES], e[JODY_HASH_LANES];
+	int i;
+
+	for (i = 0; i < JODY_HASH_LANES; i++) h[i] = lane[i];
+	for (; blocks > 0; blocks--) {
+		memcpy(e, data, JODY_HASH_BLOCK);
+		for (i = 0; i < JODY_HASH_LANES; i++) JODY_ROUND(h[i], e[i], (hash_t)JODY_HASH_CONSTANT);
+		data += JODY_HASH_BLOCK;
+	}
+	for (i = 0; i < JODY_HASH_LANES; i++) lane[i] = h[i];
+	return;
+}
+
+/* Vector kernels are only written for 64-bit hashes and a multiple of four lanes */
+#if !defined JODY_HASH_NOSIMD && JODY_HASH_WIDTH == 64 && (JODY_HASH_LANES % 4) == 0 && defined __GNUC__
+ #if defined __x86_64__ && defined __SSE2__
+  #define JODY_HASH_X86 1
+  #include <immintrin.h>
+ #endif
+ #if defined __aarch64__ && defined __ARM_NEON
+  #define JODY_HASH_NEON 1
+  #include <arm_neon.h>
+ #endif
+#endif
+
+#ifdef JODY_HASH_X86
+#define JODY_ROUND_SSE2(h, e, c) do { \
+	h = _mm_add_epi64(h, e); \
+	h = _mm_add_epi64(h, c); \
+	h = _mm_or_si128(_mm_slli_epi64(h, JODY_HASH_SHIFT), _mm_srli_epi64(h, 64 - JODY_HASH_SHIFT)); \
+	h = _mm_xor_si128(h, e); \
+	h = _mm_or_si128(_mm_slli_epi64(h, JODY_HASH_SHIFT), _mm_srli_epi64(h, 64 - JODY_HASH_SHIFT)); \
+	h = _mm_xor_si128(h, c); \
+	h = _mm_add_epi64(h, e); \
+} while (0)
+
+static void jody_lanes_sse2(hash_t * const restrict lane,
+		const unsigned char * restrict data, size_t blocks)
+{
+	const __m128i c = _mm_set1_epi64x(JODY_HASH_CONSTANT);
+	__m128i h[JODY_HASH_LANES / 2], e;
+	int i;
+
+	for (i = 0; i < JODY_HASH_LANES / 2; i++)
+		h[i] = _mm_loadu_si128((const __m128i *)(const void *)(lane + i * 2));
+	for (; blocks > 0; blocks--) {
+		for (i = 0; i < JODY_HASH_LANES / 2; i++) {
+			e = _mm_loadu_si128((const __m128i *)(const void *)(data + i * 16));
+			JODY_ROUND_SSE2(h[i], e, c);
+		}
+		data += JODY_HASH_BLOCK;
+	}
+	for (i = 0; i < JODY_HASH_LANES / 2; i++)
+		_mm_storeu_si128((__m128i *)(void *)(lane + i * 2), h[i]);
+	return;
+}
+
+#define JODY_ROUND_AVX2(h, e, c) do { \
+	h = _mm256_add_epi64(h, e); \
+	h = _mm256_add_epi64(h, c); \
+	h = _mm256_or_si256(_mm256_slli_epi64(h, JODY_HASH_SHIFT), _mm256_srli_epi64(h, 64 - JODY_HASH_SHIFT)); \
+	h = _mm256_xor_si256(h, e); \
+	h = _mm256_or_si256(_mm256_slli_epi64(h, JODY_HASH_SHIFT), _mm256_srli_epi64(h, 64 - JODY_HASH_SHIFT)); \
+	h = _mm256_xor_si256(h, c); \
+	h = _mm256_add_epi64(h, e); \
+} while (0)
+
+__attribute__((target("avx2")))
+static void jody_lanes_avx2(hash_t * const restrict lane,
+		const unsigned char * restrict data, size_t blocks)
+{
+	const __m256i c = _mm256_set1_epi64x(JODY_HASH_CONSTANT);
+	__m256i h[JODY_HASH_LANES / 4], e;
+	int i;
+
+	for (i = 0; i < JODY_HASH_LANES / 4; i++)
+		h[i] = _mm256_loadu_si256((const __m256i *)(const void *)(lane + i * 4));
+	for (; blocks > 0; blocks--) {
+		for (i = 0; i < JODY_HASH_LANES / 4; i++) {
+			e = _mm256_loadu_si256((const __m256i *)(const void *)(data + i * 32));
+			JODY_ROUND_AVX2(h[i], e, c);
+		}
+		data += JODY_HASH_BLOCK;
+	}
+	for (i = 0; i < JODY_HASH_LANES / 4; i++)
+		_mm256_storeu_si256((__m256i *)(void *)(lane + i * 4), h[i]);
+	return;
+}
+#endif /* JODY_HASH_X86 */
+
+#ifdef JODY_HASH_NEON
+#define JODY_ROUND_NEON(h, e, c) do { \
+	h = vaddq_u64(h, e); \
+	h = vaddq_u64(h, c); \
+	h = vorrq_u64(vshlq_n_u64(h, JODY_HASH_SHIFT), vshrq_n_u64(h, 64 - JODY_HASH_SHIFT)); \
+	h = veorq_u64(h, e); \
+	h = vorrq_u64(vshlq_n_u64(h, JODY_HASH_SHIFT), vshrq_n_u64(h, 64 - JODY_HASH_SHIFT)); \
+	h = veorq_u64(h, c); \
+	h = vaddq_u64(h, e); \
+} while (0)
+
+static void jody_lanes_neon(hash_t * const restrict lane,
+		const unsigned char * restrict data, size_t blocks)
+{
+	const uint64x2_t c = vdupq_n_u64(JODY_HASH_CONSTANT);
+	uint64x2_t h[JODY_HASH_LANES / 2], e;
+	int i;
+
+	for (i = 0; i < JODY_HASH_LANES / 2; i++) h[i] = vld1q_u64(lane + i * 2);
+	for (; blocks > 0; blocks--) {
+		for (i = 0; i < JODY_HASH_LANES / 2; i++) {
+			e = vreinterpretq_u64_u8(vld1q_u8(data + i * 16));
+			JODY_ROUND_NEON(h[i], e, c);
+		}
+		data += JODY_HASH_BLOCK;
+	}
+	for (i = 0; i < JODY_HASH_LANES / 2; i++) vst1q_u64(lane + i * 2, h[i]);
+	return;
+}
+#endif /* JODY_HASH_NEON */
+
+static jody_lanes_t jody_lanes = NULL;
+static const char *jody_lanes_name = "c";
+
+
+/* Pick the fastest lane kernel this CPU can run */
+static jody_lanes_t jody_lanes_select(void)
+{
+	jody_lanes_t kernel = jody_lanes_c;
+	const char *name = "c";
+
+#ifdef JODY_HASH_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		kernel = jody_lanes_avx2;
+		name = "avx2";
+	} else {
+		kernel = jody_lanes_sse2;
+		name = "sse2";
+	}
+#endif
+#ifdef JODY_HASH_NEON
+	kernel = jody_lanes_neon;
+	name = "neon";
+#endif
+	/* Several threads may get here at once; they all pick the same thing */
+	__atomic_store_n(&jody_lanes_name, name, __ATOMIC_RELAXED);
+	__atomic_store_n(&jody_lanes, kernel, __ATOMIC_RELEASE);
+	return kernel;
+}
+
+
+/* Name of the lane kernel in use, for diagnostics */
+extern const char *jody_hash_kernel(void)
+{
+	if (__atomic_load_n(&jody_lanes, __ATOMIC_ACQUIRE) == NULL) jody_lanes_select();
+	return __atomic_load_n(&jody_lanes_name, __ATOMIC_RELAXED);
+}
+
+
+extern void jody_hash_init(jody_hash_state_t * const restrict state,
+		const hash_t start_hash)
+{
+	for (int i = 0; i < JODY_HASH_LANES; i++)
+		state->lane[i] = start_hash ^ (hash_t)(JODY_HASH_CONSTANT * (hash_t)i);
+	state->seed = start_hash;
+	state->tail_len = 0;
+	state->total = 0;
+	return;
+}
+
+
+extern void jody_hash_update(jody_hash_state_t * const restrict state,
+		const void * const restrict data, size_t count)
+{
+	const unsigned char *p = (const unsigned char *)data;
+	jody_lanes_t kernel;
+	size_t blocks, fill;
+
+	if (count == 0) return;
+	kernel = __atomic_load_n(&jody_lanes, __ATOMIC_ACQUIRE);
+	if (kernel == NULL) kernel = jody_lanes_select();
+	state->total += count;
+
+	/* Finish a partial block left over from the last update */
+	if (state->tail_len > 0) {
+		fill = JODY_HASH_BLOCK - state->tail_len;
+		if (fill > count) fill = count;
+		memcpy((unsigned char *)state->tail + state->tail_len, p, fill);
+		state->tail_len += fill;
+		p += fill;
+		count -= fill;
+		if (state->tail_len < JODY_HASH_BLOCK) return;
+		kernel(state->lane, (const unsigned char *)state->tail, 1);
+		state->tail_len = 0;
+	}
+
+	blocks = count / JODY_HASH_BLOCK;
+	if (blocks > 0) kernel(state->lane, p, blocks);
+	p += blocks * JODY_HASH_BLOCK;
+	count -= blocks * JODY_HASH_BLOCK;
+
+	if (count > 0) {
+		memcpy(state->tail, p, count);
+		state->tail_len = count;
+	}
+	return;
+}
+
+
+extern hash_t jody_hash_final(jody_hash_state_t * const restrict state)
+{
+	hash_t hash;
+
+	if (state->total == 0) return state->seed;
+
+	hash = state->lane[0];
+	for (int i = 1; i < JODY_HASH_LANES; i++)
+		JODY_ROUND(hash, state->lane[i], (hash_t)JODY_HASH_CONSTANT);
+	return jody_block_hash(state->tail, hash, state->tail_len);
+}
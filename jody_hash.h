@@ -8,8 +8,9 @@
 extern "C" {
 #endif
 
-/* Required for uint64_t */
+/* Required for uint64_t and size_t */
 #include <stdint.h>
+#include <stddef.h>
 
 /* Width of a jody_hash. Changing this will also require
  * changing the width of tail masks and endian conversion */
@@ -28,10 +29,30 @@ typedef uint16_t hash_t;
 #endif
 
 /* Version increments when algorithm changes incompatibly */
-#define JODY_HASH_VERSION 4
+#define JODY_HASH_VERSION 5
+
+/* Number of independent lanes in the multi-lane hash. Changing this
+ * changes every hash value, so it is part of the hash version. */
+#define JODY_HASH_LANES 8
+#define JODY_HASH_BLOCK (JODY_HASH_LANES * sizeof(hash_t))
+
+/* Multi-lane hash state; data can be fed in pieces of any size */
+typedef struct {
+	hash_t lane[JODY_HASH_LANES];
+	hash_t tail[JODY_HASH_LANES];
+	hash_t seed;
+	size_t tail_len;
+	uint64_t total;
+} jody_hash_state_t;
 
 extern hash_t jody_block_hash(const hash_t * restrict data,
 		const hash_t start_hash, const size_t count);
+extern void jody_hash_init(jody_hash_state_t * const restrict state,
+		const hash_t start_hash);
+extern void jody_hash_update(jody_hash_state_t * const restrict state,
+		const void * const restrict data, size_t count);
+extern hash_t jody_hash_final(jody_hash_state_t * const restrict state);
+extern const char *jody_hash_kernel(void);
 
 #ifdef __cplusplus
 }
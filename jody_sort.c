@@ -5,10 +5,15 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 #include "jody_sort.h"
 
 #define IS_NUM(a) (((a >= '0') && (a <= '9')) ? 1 : 0)
 
+/* Collation key codes (see numeric_sort_key()) */
+#define KEY_NUMBER 0x04  /* A run of digits; sorts between '/' and ':' */
+#define KEY_SYMBOL 203   /* Code of a NUL compared as a symbol */
+
 extern int numeric_sort(const char * restrict c1,
                 const char * restrict c2, int sort_direction)
 {
@@ -89,3 +94,70 @@ extern int numeric_sort(const char * restrict c1,
   /* Fall through: the strings are equal */
   return 0;
 }
+
+
+/* Key code of a character that is not a digit: symbols and spaces (and
+ * anything else below '.') go after everything else, and each group keeps
+ * the order of a plain char comparison */
+static inline unsigned char key_char(const char c)
+{
+  if (c >= '.') {
+    if (c == '.') return 0x02;
+    if (c == '/') return 0x03;
+    return (unsigned char)(KEY_NUMBER + 1 + ((unsigned char)c - ':'));
+  }
+  return (unsigned char)(KEY_SYMBOL + c);
+}
+
+
+/* Build a collation key for a string so that comparing keys with memcmp()
+ * gives the same order as numeric_sort() with a sort_direction of 1.
+ * Sorting the same strings many times then only costs the key building
+ * once per string. The key is written to 'key', which must have room for
+ * NUMERIC_SORT_KEY_SIZE(strlen(str)) bytes, and its length is returned.
+ *
+ * numeric_sort() skips zeros before each character, compares runs of
+ * digits by length and then digit by digit, and treats the end of a
+ * string met after skipping zeros or a number as a symbol. A key is the
+ * string with those rules applied once: skipped zeros are left out and
+ * every run of digits becomes KEY_NUMBER, its length and its digits.
+ * When one key is the same as or a prefix of the other, the order also
+ * depends on how many zeros were skipped where, so numeric_sort() must
+ * settle those pairs; memcmp() over the shorter length settles the rest. */
+extern size_t numeric_sort_key(const char * restrict str, unsigned char * restrict key)
+{
+  unsigned char *k = key;
+  size_t digits;
+  int mid;
+
+  if (str == NULL || key == NULL) return 0;
+
+  while (*str != '\0') {
+    mid = 0;
+    while (*str == '0') {
+      mid = 1;
+      str++;
+    }
+    if (IS_NUM(*str)) {
+      for (digits = 0; IS_NUM(str[digits]); digits++);
+      *k++ = KEY_NUMBER;
+      /* Longer runs of digits are larger numbers */
+      if (digits < 255) *k++ = (unsigned char)digits;
+      else {
+        *k++ = 255;
+        for (int shift = 24; shift >= 0; shift -= 8) *k++ = (unsigned char)(digits >> shift);
+      }
+      memcpy(k, str, digits);
+      k += digits;
+      str += digits;
+      mid = 1;
+    }
+    if (*str == '\0') {
+      if (mid) *k++ = KEY_SYMBOL;
+      break;
+    }
+    *k++ = key_char(*str++);
+  }
+
+  return (size_t)(k - key);
+}
@@ -4,12 +4,18 @@
 #ifndef JODY_SORT_H
 #define JODY_SORT_H
 
+#include <stddef.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/* Largest numeric_sort_key() for a string of 'a' characters */
+#define NUMERIC_SORT_KEY_SIZE(a) ((a) * 2 + 2)
+
 extern int numeric_sort(const char * restrict c1,
                 const char * restrict c2, int sort_direction);
+extern size_t numeric_sort_key(const char * restrict str, unsigned char * restrict key);
 
 #ifdef __cplusplus
 }
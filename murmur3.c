@@ -0,0 +1,137 @@
+/* MurmurHash3_x64_128
+ *
+ * MurmurHash3 was written by Austin Appleby, and is placed in the public
+ * domain. The author hereby disclaims copyright to this source code.
+ *
+ * This is the x64 128-bit variant rearranged so that data can be fed in
+ * pieces of any size. For a seed below 2^32 the output is identical to
+ * the reference MurmurHash3_x64_128() run over all of the data at once;
+ * larger seeds are used in full for both halves of the state. */
+
+#include <string.h>
+#include "murmur3.h"
+
+#define ROTL64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+static const uint64_t c1 = 0x87c37b91114253d5ULL;
+static const uint64_t c2 = 0x4cf5ad432745937fULL;
+
+
+static inline uint64_t fmix64(uint64_t k)
+{
+  k ^= k >> 33;
+  k *= 0xff51afd7ed558ccdULL;
+  k ^= k >> 33;
+  k *= 0xc4ceb9fe1a85ec53ULL;
+  k ^= k >> 33;
+  return k;
+}
+
+
+/* Mix 16-byte blocks into the state */
+static void murmur3_blocks(murmur3_state_t * const restrict state,
+                const unsigned char * restrict data, size_t blocks)
+{
+  uint64_t h1 = state->h1, h2 = state->h2;
+  uint64_t k[2];
+
+  for (; blocks > 0; blocks--) {
+    memcpy(k, data, 16);
+    k[0] *= c1; k[0] = ROTL64(k[0], 31); k[0] *= c2; h1 ^= k[0];
+    h1 = ROTL64(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+    k[1] *= c2; k[1] = ROTL64(k[1], 33); k[1] *= c1; h2 ^= k[1];
+    h2 = ROTL64(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+    data += 16;
+  }
+  state->h1 = h1;
+  state->h2 = h2;
+  return;
+}
+
+
+extern void murmur3_init(murmur3_state_t * const restrict state, const uint64_t seed)
+{
+  state->h1 = seed;
+  state->h2 = seed;
+  state->total = 0;
+  state->tail_len = 0;
+  return;
+}
+
+
+extern void murmur3_update(murmur3_state_t * const restrict state,
+                const void * const restrict data, size_t count)
+{
+  const unsigned char *p = (const unsigned char *)data;
+  size_t fill, blocks;
+
+  state->total += count;
+
+  /* Finish a block left over from the last update */
+  if (state->tail_len > 0) {
+    fill = 16 - state->tail_len;
+    if (fill > count) fill = count;
+    memcpy(state->tail + state->tail_len, p, fill);
+    state->tail_len += fill;
+    p += fill;
+    count -= fill;
+    if (state->tail_len < 16) return;
+    murmur3_blocks(state, state->tail, 1);
+    state->tail_len = 0;
+  }
+
+  blocks = count / 16;
+  if (blocks > 0) murmur3_blocks(state, p, blocks);
+  p += blocks * 16;
+  count -= blocks * 16;
+
+  if (count > 0) {
+    memcpy(state->tail, p, count);
+    state->tail_len = count;
+  }
+  return;
+}
+
+
+extern void murmur3_final(murmur3_state_t * const restrict state, uint64_t out[2])
+{
+  const unsigned char * const tail = state->tail;
+  uint64_t h1 = state->h1, h2 = state->h2;
+  uint64_t k1 = 0, k2 = 0;
+
+  switch (state->tail_len & 15) {
+    case 15: k2 ^= ((uint64_t)tail[14]) << 48; /* Fall through */
+    case 14: k2 ^= ((uint64_t)tail[13]) << 40; /* Fall through */
+    case 13: k2 ^= ((uint64_t)tail[12]) << 32; /* Fall through */
+    case 12: k2 ^= ((uint64_t)tail[11]) << 24; /* Fall through */
+    case 11: k2 ^= ((uint64_t)tail[10]) << 16; /* Fall through */
+    case 10: k2 ^= ((uint64_t)tail[9]) << 8;   /* Fall through */
+    case  9: k2 ^= ((uint64_t)tail[8]);
+             k2 *= c2; k2 = ROTL64(k2, 33); k2 *= c1; h2 ^= k2;
+             /* Fall through */
+    case  8: k1 ^= ((uint64_t)tail[7]) << 56;  /* Fall through */
+    case  7: k1 ^= ((uint64_t)tail[6]) << 48;  /* Fall through */
+    case  6: k1 ^= ((uint64_t)tail[5]) << 40;  /* Fall through */
+    case  5: k1 ^= ((uint64_t)tail[4]) << 32;  /* Fall through */
+    case  4: k1 ^= ((uint64_t)tail[3]) << 24;  /* Fall through */
+    case  3: k1 ^= ((uint64_t)tail[2]) << 16;  /* Fall through */
+    case  2: k1 ^= ((uint64_t)tail[1]) << 8;   /* Fall through */
+    case  1: k1 ^= ((uint64_t)tail[0]);
+             k1 *= c1; k1 = ROTL64(k1, 31); k1 *= c2; h1 ^= k1;
+             /* Fall through */
+    default: break;
+  }
+
+  h1 ^= state->total;
+  h2 ^= state->total;
+  h1 += h2;
+  h2 += h1;
+  h1 = fmix64(h1);
+  h2 = fmix64(h2);
+  h1 += h2;
+  h2 += h1;
+
+  out[0] = h1;
+  out[1] = h2;
+  return;
+}
@@ -0,0 +1,31 @@
+/* MurmurHash3_x64_128 (streaming version)
+ * See murmur3.c for license information */
+
+#ifndef MURMUR3_H
+#define MURMUR3_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef struct {
+  uint64_t h1;
+  uint64_t h2;
+  uint64_t total;
+  unsigned char tail[16];
+  size_t tail_len;
+} murmur3_state_t;
+
+extern void murmur3_init(murmur3_state_t * const restrict state, const uint64_t seed);
+extern void murmur3_update(murmur3_state_t * const restrict state,
+                const void * const restrict data, size_t count);
+extern void murmur3_final(murmur3_state_t * const restrict state, uint64_t out[2]);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MURMUR3_H */
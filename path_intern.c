@@ -0,0 +1,95 @@
+/* jdupes compact path storage
+ * Scanning a deep tree used to store the full path name of every file,
+ * which repeats the same directory prefixes over and over. Instead, each
+ * directory is stored once as its name plus a link to its parent, and
+ * each file only keeps its own name and its directory. Full path names
+ * are put back together on demand in a caller's FILE_PATH_SIZE buffer.
+ *
+ * The pieces are joined exactly the way grokdir() used to join them: a
+ * separator goes between a directory and the next name unless the
+ * directory is empty or already ends with one. A directory without a
+ * parent (a command-line argument or a --files-from prefix) keeps its
+ * name as given, so the rebuilt path is byte-for-byte the original.
+ * This file is part of jdupes; see jdupes.c for license information */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "jdupes.h"
+#include "path_intern.h"
+
+
+static inline int needs_sep(const path_dir_t * const restrict dir)
+{
+  return dir->len != 0 && dir->name[dir->len - 1] != dir_sep;
+}
+
+
+/* Store a directory name; name need not be NUL-terminated */
+extern path_dir_t *path_dir_new(const path_dir_t * const restrict parent,
+                const char * const restrict name, const size_t len)
+{
+  path_dir_t *dir;
+
+  if (name == NULL) nullptr("path_dir_new()");
+
+  dir = (path_dir_t *)string_malloc(sizeof(path_dir_t) + len + 1);
+  if (dir == NULL) oom("path_dir_new()");
+  dir->parent = parent;
+  dir->len = len;
+  memcpy(dir->name, name, len);
+  dir->name[len] = '\0';
+  return dir;
+}
+
+
+/* Write the full path of 'name' in 'dir' to buf and return its length
+ * Either one may be NULL: no directory means 'name' is the whole path
+ * and no name builds the path of the directory itself. */
+extern size_t path_build(char * const restrict buf, const path_dir_t * restrict dir,
+                const char * const restrict name)
+{
+  const path_dir_t *d;
+  size_t len = 0, namelen = 0;
+  char *p;
+
+  if (buf == NULL) nullptr("path_build()");
+
+  /* Measure first so the pieces can be copied in from the end */
+  if (name != NULL) {
+    namelen = strlen(name);
+    len = namelen;
+    if (dir != NULL && needs_sep(dir)) len++;
+  }
+  for (d = dir; d != NULL; d = d->parent) {
+    len += d->len;
+    if (d->parent != NULL && needs_sep(d->parent)) len++;
+  }
+  if (len >= FILE_PATH_SIZE) {
+    fprintf(stderr, "\nerror: a path buffer overflowed\n");
+    exit(EXIT_FAILURE);
+  }
+
+  p = buf + len;
+  *p = '\0';
+  if (name != NULL) {
+    p -= namelen;
+    memcpy(p, name, namelen);
+    if (dir != NULL && needs_sep(dir)) *--p = dir_sep;
+  }
+  for (d = dir; d != NULL; d = d->parent) {
+    p -= d->len;
+    memcpy(p, d->name, d->len);
+    if (d->parent != NULL && needs_sep(d->parent)) *--p = dir_sep;
+  }
+  return len;
+}
+
+
+/* Full path name of a file; returns buf */
+extern const char *file_path(const file_t * const restrict file, char * const restrict buf)
+{
+  if (file == NULL) nullptr("file_path()");
+  path_build(buf, file->dir, file->name);
+  return buf;
+}
@@ -0,0 +1,35 @@
+/* jdupes compact path storage
+ * This file is part of jdupes; see jdupes.c for license information */
+
+#ifndef PATH_INTERN_H
+#define PATH_INTERN_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include "jdupes.h"
+
+/* Size of a buffer that can hold any full path name */
+#define FILE_PATH_SIZE (PATHBUF_SIZE * 2)
+
+/* One directory: its name relative to the parent directory, or the
+ * full prefix as given for a directory with no parent */
+typedef struct _path_dir {
+  const struct _path_dir *parent;
+  size_t len;
+  char name[];
+} path_dir_t;
+
+extern path_dir_t *path_dir_new(const path_dir_t * const restrict parent,
+                const char * const restrict name, const size_t len);
+extern size_t path_build(char * const restrict buf, const path_dir_t * restrict dir,
+                const char * const restrict name);
+extern const char *file_path(const file_t * const restrict file, char * const restrict buf);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PATH_INTERN_H */
@@ -0,0 +1,196 @@
+/* jdupes per-phase run statistics (--stats)
+ * The work of a run is split into phases: scanning, partial hashing,
+ * further hashing, byte-for-byte confirmation, and the action. Matching
+ * moves back and forth between these for every size group, so each
+ * piece of work is timed on its own with stats_begin()/stats_end() and
+ * added to its phase. Anything read while a phase is current (through
+ * io_backend.c or the io_uring batch) is counted against that phase.
+ *
+ * Timing is always done by the main thread. When a phase is run by the
+ * thread pool, the main thread times the whole pool run, so the wall
+ * time is real elapsed time and the CPU time covers every thread. The
+ * counters are only written when --stats is given (see STATS()).
+ * This file is part of jdupes; see jdupes.c for license information */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+#include "jdupes.h"
+#include "stats.h"
+
+#ifdef ON_WINDOWS
+ #include <sys/time.h>
+#else
+ #include <sys/resource.h>
+#endif
+
+#ifndef NO_THREADS
+ #define STATS_ADD(a,b) __atomic_add_fetch(&(a), (b), __ATOMIC_RELAXED)
+#else
+ #define STATS_ADD(a,b) ((a) += (b))
+#endif
+
+int stats_mode = STATS_OFF;
+int stats_phase = STATS_SCAN;
+
+static struct {
+  uint64_t wall, cpu;  /* Nanoseconds */
+  uintmax_t files, opens, bytes;
+} phases[STATS_PHASES];
+
+static const char *phase_names[STATS_PHASES] = {
+  "scan", "partial_hash", "full_hash", "confirm", "action"
+};
+
+static uint64_t start_wall, start_cpu;
+
+
+static uint64_t wall_ns(void)
+{
+#ifdef ON_WINDOWS
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return (uint64_t)tv.tv_sec * 1000000000 + (uint64_t)tv.tv_usec * 1000;
+#else
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+
+/* CPU time used so far by every thread of the process */
+static uint64_t cpu_ns(void)
+{
+#ifdef ON_WINDOWS
+  return (uint64_t)clock() * (1000000000 / CLOCKS_PER_SEC);
+#else
+  struct timespec ts;
+
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+
+/* Select the output format: "text" (also for a NULL name) or "json"
+ * Returns 0 on success or -1 if the name is unknown */
+extern int stats_set_mode(const char * const restrict name)
+{
+  if (name == NULL || strcmp(name, "text") == 0) stats_mode = STATS_TEXT;
+  else if (strcmp(name, "json") == 0) stats_mode = STATS_JSON;
+  else return -1;
+  return 0;
+}
+
+
+/* Mark the start of the run for the totals */
+extern void stats_start(void)
+{
+  start_wall = wall_ns();
+  start_cpu = cpu_ns();
+  return;
+}
+
+
+/* Start timing some work of one phase and make it the current phase */
+extern void stats_begin(struct stats_timer * const restrict t, const int phase)
+{
+  if (t == NULL) nullptr("stats_begin()");
+  t->prev = stats_phase;
+  stats_phase = phase;
+  t->wall = wall_ns();
+  t->cpu = cpu_ns();
+  return;
+}
+
+
+/* Add the time since stats_begin() to its phase */
+extern void stats_end(const struct stats_timer * const restrict t)
+{
+  if (t == NULL) nullptr("stats_end()");
+  phases[stats_phase].cpu += cpu_ns() - t->cpu;
+  phases[stats_phase].wall += wall_ns() - t->wall;
+  stats_phase = t->prev;
+  return;
+}
+
+
+/* Counters for the current phase; these can be called from any thread */
+extern void stats_add_files(const uintmax_t n)
+{
+  STATS_ADD(phases[stats_phase].files, n);
+  return;
+}
+
+
+extern void stats_add_opens(const uintmax_t n)
+{
+  STATS_ADD(phases[stats_phase].opens, n);
+  return;
+}
+
+
+extern void stats_add_bytes(const uintmax_t n)
+{
+  STATS_ADD(phases[stats_phase].bytes, n);
+  return;
+}
+
+
+extern void stats_print(FILE * const restrict fp, const unsigned int threads)
+{
+  uint64_t wall = wall_ns() - start_wall, cpu = cpu_ns() - start_cpu;
+  uintmax_t opens = 0, bytes = 0;
+  long maxrss = -1;  /* KiB; -1 if unknown */
+#ifndef ON_WINDOWS
+  struct rusage ru;
+
+  if (getrusage(RUSAGE_SELF, &ru) == 0) {
+    maxrss = ru.ru_maxrss;
+ #ifdef __APPLE__
+    /* macOS reports bytes */
+    maxrss /= 1024;
+ #endif
+  }
+#endif
+
+  if (fp == NULL) nullptr("stats_print()");
+  for (int i = 0; i < STATS_PHASES; i++) {
+    opens += phases[i].opens;
+    bytes += phases[i].bytes;
+  }
+
+  if (stats_mode == STATS_JSON) {
+    fprintf(fp, "{\"threads\": %u, \"phases\": {", threads);
+    for (int i = 0; i < STATS_PHASES; i++)
+      fprintf(fp, "%s\"%s\": {\"wall\": %.6f, \"cpu\": %.6f, \"files\": %" PRIuMAX
+          ", \"bytes\": %" PRIuMAX ", \"opens\": %" PRIuMAX "}",
+          i ? ", " : "", phase_names[i], (double)phases[i].wall / 1e9,
+          (double)phases[i].cpu / 1e9, phases[i].files, phases[i].bytes, phases[i].opens);
+    fprintf(fp, "}, \"total\": {\"wall\": %.6f, \"cpu\": %.6f, \"bytes\": %" PRIuMAX
+        ", \"opens\": %" PRIuMAX ", \"maxrss_kib\": ",
+        (double)wall / 1e9, (double)cpu / 1e9, bytes, opens);
+    if (maxrss < 0) fprintf(fp, "null}}\n");
+    else fprintf(fp, "%ld}}\n", maxrss);
+    return;
+  }
+
+  fprintf(fp, "\n%-13s %10s %10s %10s %14s %10s\n", "phase", "wall (s)", "cpu (s)",
+      "files", "bytes read", "opens");
+  for (int i = 0; i < STATS_PHASES; i++)
+    fprintf(fp, "%-13s %10.3f %10.3f %10" PRIuMAX " %14" PRIuMAX " %10" PRIuMAX "\n",
+        phase_names[i], (double)phases[i].wall / 1e9, (double)phases[i].cpu / 1e9,
+        phases[i].files, phases[i].bytes, phases[i].opens);
+  fprintf(fp, "%-13s %10.3f %10.3f %10s %14" PRIuMAX " %10" PRIuMAX "\n",
+      "total", (double)wall / 1e9, (double)cpu / 1e9, "", bytes, opens);
+  if (maxrss >= 0) fprintf(fp, "Peak RSS: %ld KiB", maxrss);
+  if (threads > 1) fprintf(fp, "%sthreads: %u", (maxrss >= 0) ? "; " : "", threads);
+  if (maxrss >= 0 || threads > 1) fprintf(fp, "\n");
+  return;
+}
@@ -0,0 +1,53 @@
+/* jdupes per-phase run statistics (--stats)
+ * This file is part of jdupes; see jdupes.c for license information */
+
+#ifndef STATS_H
+#define STATS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdio.h>
+#include <stdint.h>
+
+enum stats_phase {
+  STATS_SCAN = 0,  /* Finding and stat()ing files */
+  STATS_PARTIAL,   /* Hashing the first block of files */
+  STATS_FULL,      /* Tail, sampled, and full hashes */
+  STATS_CONFIRM,   /* Byte-for-byte comparison of duplicate sets */
+  STATS_ACTION,    /* Printing, linking, deleting, etc. */
+  STATS_PHASES
+};
+
+enum stats_mode {
+  STATS_OFF = 0,
+  STATS_TEXT,
+  STATS_JSON
+};
+
+struct stats_timer {
+  int prev;  /* Phase to go back to when this one ends */
+  uint64_t wall, cpu;  /* Nanoseconds at the start */
+};
+
+/* Everything is skipped with a single test when --stats isn't used */
+#define STATS(a) if (stats_mode != STATS_OFF) { a }
+
+extern int stats_mode;
+extern int stats_phase;
+
+extern int stats_set_mode(const char * const restrict name);
+extern void stats_start(void);
+extern void stats_begin(struct stats_timer * const restrict t, const int phase);
+extern void stats_end(const struct stats_timer * const restrict t);
+extern void stats_add_files(const uintmax_t n);
+extern void stats_add_opens(const uintmax_t n);
+extern void stats_add_bytes(const uintmax_t n);
+extern void stats_print(FILE * const restrict fp, const unsigned int threads);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* STATS_H */
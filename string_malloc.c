@@ -8,6 +8,9 @@
 
 #include <stdlib.h>
 #include <stdint.h>
+#ifndef NO_THREADS
+#include <pthread.h>
+#endif
 #include "string_malloc.h"
 
 /* Size of pages to allocate at once. Must be divisible by uintptr_t.
@@ -16,18 +19,16 @@
 #define SMA_PAGE_SIZE 262144
 #endif
 
-/* Max freed pointers to remember. Increasing this number allows storing
- * more free objects but can slow down allocations. Don't increase it if
- * the program's total reused freed alloc counter doesn't increase as a
- * result or you're slowing allocs down to no benefit. */
-#ifndef SMA_MAX_FREE
-#define SMA_MAX_FREE 32
+/* Largest object size that gets its own free list. Freed objects are
+ * kept on one list per (aligned) size, so both allocating from a free
+ * list and freeing are O(1). Bigger freed objects are not reused. */
+#ifndef SMA_MAX_CLASS
+#define SMA_MAX_CLASS 4096
 #endif
 
-/* Minimum free object size to consider adding to free list */
-#ifndef SMA_MIN_SLACK
-#define SMA_MIN_SLACK 48
-#endif
+#define SMA_ALIGN sizeof(uintptr_t)
+#define SMA_CLASSES (SMA_MAX_CLASS / SMA_ALIGN + 1)
+#define SMA_MAX_OBJECT (SMA_PAGE_SIZE - sizeof(uintptr_t) - sizeof(size_t))
 
 #ifdef DEBUG
 uintmax_t sma_allocs = 0;
@@ -37,6 +38,11 @@ uintmax_t sma_free_reclaimed = 0;
 uintmax_t sma_free_scanned = 0;
 uintmax_t sma_free_tails = 0;
  #define DBG(a) a
+ #ifndef NO_THREADS
+  #define SMA_COUNT(a) __atomic_add_fetch(&a, 1, __ATOMIC_RELAXED)
+ #else
+  #define SMA_COUNT(a) a++
+ #endif
 #else
  #define DBG(a)
 #endif
@@ -59,66 +65,39 @@ void string_malloc_destroy(void) {
 	return;
 }
 
-#else /* Not SMA_PASSTHROUGH mode */
-
-static void *sma_head = NULL;
-static uintptr_t *sma_curpage = NULL;
-static unsigned int sma_pages = 0;
-static void *sma_freelist[SMA_MAX_FREE];
-static int sma_freelist_cnt = 0;
-static size_t sma_nextfree = sizeof(uintptr_t);
-
-
-/* Scan the freed chunk list for a suitably sized object */
-static inline void *scan_freelist(const size_t size)
+int string_malloc_arena(const unsigned int n)
 {
-	size_t *object, *min_p;
-	size_t sz, min = 0;
-	int i, used = 0, min_i = -1;
-
-	/* Don't bother scanning if the list is empty */
-	if (sma_freelist_cnt == 0) return NULL;
-
-	for (i = 0; i < SMA_MAX_FREE; i++) {
-		/* Stop scanning once we run out of valid entries */
-		if (used == sma_freelist_cnt) return NULL;
-
-		DBG(sma_free_scanned++;)
-		object = sma_freelist[i];
-		/* Skip empty entries */
-		if (object == NULL) continue;
-
-		sz = *object;
-		used++;
-
-		/* Skip smaller objects */
-		if (sz < size) continue;
-		/* Object is big enough; record if it's the new minimum */
-		if (min == 0 || sz <= min) {
-			min = sz;
-			min_i = i;
-			/* Always stop scanning if exact sized object found */
-			if (sz == size) break;
-		}
-	}
+	(void)n;
+	return 0;
+}
 
-	/* Enhancement TODO: split the free item if it's big enough */
+#else /* Not SMA_PASSTHROUGH mode */
 
-	/* Return smallest object found and delete from free list */
-	if (min_i != -1) {
-		min_p = sma_freelist[min_i];
-		sma_freelist[min_i] = NULL;
-		sma_freelist_cnt--;
-		min_p++;
-		return (void *)min_p;
-	}
-	/* Fall through - free list search failed */
-	return NULL;
-}
+/* Everything one allocating thread needs. Each page starts with a link
+ * to the next page; freed objects are linked through their first word. */
+struct sma_arena {
+	uintptr_t *head;
+	uintptr_t *curpage;
+	size_t nextfree;
+	unsigned int pages;
+	void *freelist[SMA_CLASSES];
+};
+
+/* Arena 0 is used by every thread that never picks an arena */
+static struct sma_arena sma_main;
+#ifndef NO_THREADS
+static struct sma_arena **sma_arenas = NULL;
+static unsigned int sma_arena_count = 1;
+static pthread_mutex_t sma_arena_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct sma_arena *sma_local = NULL;
+ #define SMA_ARENA() ((sma_local != NULL) ? sma_local : &sma_main)
+#else
+ #define SMA_ARENA() (&sma_main)
+#endif
 
 
-/* malloc() a new page for string_malloc to use */
-static inline void *string_malloc_page(void)
+/* malloc() a new page for an arena to use */
+static inline void *string_malloc_page(struct sma_arena * const restrict arena)
 {
 	uintptr_t * restrict pageptr;
 
@@ -128,141 +107,200 @@ static inline void *string_malloc_page(void)
 	*pageptr = (uintptr_t)NULL;
 
 	/* Link previous page to this page, if applicable */
-	if (sma_curpage != NULL) *sma_curpage = (uintptr_t)pageptr;
+	if (arena->curpage != NULL) *arena->curpage = (uintptr_t)pageptr;
+	else arena->head = pageptr;
 
 	/* Update last page pointers and total page counter */
-	sma_curpage = pageptr;
-	sma_pages++;
+	arena->curpage = pageptr;
+	arena->pages++;
+	arena->nextfree = sizeof(uintptr_t);
 
 	return (void *)pageptr;
 }
 
 
+/* Put an object on its arena's free list for its size */
+static inline void freelist_push(struct sma_arena * const restrict arena,
+		void * const restrict addr, const size_t len)
+{
+	*(void **)addr = arena->freelist[len / SMA_ALIGN];
+	arena->freelist[len / SMA_ALIGN] = addr;
+	return;
+}
+
+
 void *string_malloc(size_t len)
 {
-	const void * restrict page = (char *)sma_curpage;
-	static size_t *address;
+	struct sma_arena * const restrict arena = SMA_ARENA();
+	size_t *address;
+	void *object;
 
 	/* Calling with no actual length is invalid */
 	if (len < 1) return NULL;
 
 	/* Align objects where possible */
-	if (len & (sizeof(uintptr_t) - 1)) {
-		len &= ~(sizeof(uintptr_t) - 1);
-		len += sizeof(uintptr_t);
+	if (len & (SMA_ALIGN - 1)) {
+		len &= ~(SMA_ALIGN - 1);
+		len += SMA_ALIGN;
 	}
 
 	/* Pass-through allocations larger than maximum object size to malloc() */
-	if (len > (SMA_PAGE_SIZE - sizeof(uintptr_t) - sizeof(size_t))) {
+	if (len > SMA_MAX_OBJECT) {
 		/* Allocate the space */
 		address = (size_t *)malloc(len + sizeof(size_t));
 		if (!address) return NULL;
 		/* Prefix object with its size */
 		*address = len;
 		address++;
-		DBG(sma_allocs++;)
+		DBG(SMA_COUNT(sma_allocs);)
 		return (void *)address;
 	}
 
-	/* Initialize on first use */
-	if (sma_pages == 0) {
-		/* Initialize the freed object list */
-		for (int i = 0; i < SMA_MAX_FREE; i++) sma_freelist[i] = NULL;
-		/* Allocate first page and set up for first allocation */
-		sma_head = string_malloc_page();
-		if (sma_head == NULL) return NULL;
-		sma_nextfree = sizeof(uintptr_t);
-		page = sma_head;
-	}
-
 	/* Allocate objects from the free list first */
-	address = (size_t *)scan_freelist(len);
-	if (address != NULL) {
-		DBG(sma_free_reclaimed++;)
-		return (void *)address;
+	if (len <= SMA_MAX_CLASS) {
+		DBG(SMA_COUNT(sma_free_scanned);)
+		object = arena->freelist[len / SMA_ALIGN];
+		if (object != NULL) {
+			arena->freelist[len / SMA_ALIGN] = *(void **)object;
+			DBG(SMA_COUNT(sma_free_reclaimed);)
+			return object;
+		}
 	}
 
 	/* Allocate new page if this object won't fit */
-	if ((sma_nextfree + len + sizeof(size_t)) > SMA_PAGE_SIZE) {
-		size_t sz;
-		size_t *tailaddr;
-		/* See if remaining space is usable */
-		if (sma_freelist_cnt < SMA_MAX_FREE && (sma_nextfree + sizeof(size_t)) < SMA_PAGE_SIZE) {
-			/* Get remaining space size minus page linkage and obj size prefix */
-			sz = sma_nextfree + sizeof(size_t) + SMA_MIN_SLACK;
-
-			if (sz <= SMA_PAGE_SIZE) {
-				sz = SMA_PAGE_SIZE - sma_nextfree - sizeof(size_t);
-				tailaddr = (size_t *)((uintptr_t)page + sma_nextfree);
-				*tailaddr = (size_t)sz;
-				tailaddr++;
-				string_free(tailaddr);
-				DBG(sma_free_tails++;)
-			}
+	if (arena->pages == 0 || (arena->nextfree + len + sizeof(size_t)) > SMA_PAGE_SIZE) {
+		/* Keep the rest of the old page as a free object if it is usable */
+		if (arena->pages != 0 && (arena->nextfree + sizeof(size_t) + SMA_ALIGN) <= SMA_PAGE_SIZE) {
+			size_t sz = SMA_PAGE_SIZE - arena->nextfree - sizeof(size_t);
+
+			if (sz > SMA_MAX_CLASS) sz = SMA_MAX_CLASS;
+			address = (size_t *)((uintptr_t)arena->curpage + arena->nextfree);
+			*address = sz;
+			freelist_push(arena, address + 1, sz);
+			DBG(SMA_COUNT(sma_free_tails);)
 		}
-		page = string_malloc_page();
-		if (!page) return NULL;
-		sma_nextfree = sizeof(uintptr_t);
+		if (!string_malloc_page(arena)) return NULL;
 	}
 
 	/* Allocate the space */
-	address = (size_t *)((uintptr_t)page + sma_nextfree);
+	address = (size_t *)((uintptr_t)arena->curpage + arena->nextfree);
 	/* Prefix object with its size */
 	*address = len;
 	address++;
-	sma_nextfree += len + sizeof(size_t);
+	arena->nextfree += len + sizeof(size_t);
 
-	DBG(sma_allocs++;)
+	DBG(SMA_COUNT(sma_allocs);)
 	return (void *)address;
 }
 
 
-/* Free an object, adding to free list if possible */
+/* Free an object, adding it to the calling thread's free lists */
 void string_free(void * const restrict addr)
 {
-	int i = 0;
-	size_t * const restrict a = (size_t *)addr - 1;
-
-	/* Do nothing on NULL address or full free list */
-	if ((addr == NULL) || sma_freelist_cnt == SMA_MAX_FREE)
-		goto sf_failed;
-
-	/* Tiny objects keep big ones from being freed; ignore them */
-	if (*(size_t *)((uintptr_t)addr - sizeof(size_t)) < SMA_MIN_SLACK)
-		goto sf_failed;
-
-	/* Add object to free list */
-	while (i < SMA_MAX_FREE) {
-		if (sma_freelist[i] == NULL) {
-			sma_freelist[i] = a;
-			sma_freelist_cnt++;
-			DBG(sma_free_good++;)
-			return;
-		}
-		i++;
+	size_t len;
+
+	if (addr == NULL) goto sf_failed;
+	len = *(size_t *)((uintptr_t)addr - sizeof(size_t));
+
+	/* Objects that were passed through to malloc() go back to free() */
+	if (len > SMA_MAX_OBJECT) {
+		free((size_t *)addr - 1);
+		DBG(SMA_COUNT(sma_free_good);)
+		return;
 	}
+	if (len > SMA_MAX_CLASS) goto sf_failed;
+
+	/* The object's memory stays with the page it came from, so it can
+	 * go on any arena's list, as long as no other thread is using it */
+	freelist_push(SMA_ARENA(), addr, len);
+	DBG(SMA_COUNT(sma_free_good);)
+	return;
 
-	/* Fall through */
 sf_failed:
-	DBG(sma_free_ignored++;)
+	DBG(SMA_COUNT(sma_free_ignored);)
 	return;
 }
 
-/* Destroy all allocated pages */
-void string_malloc_destroy(void)
+
+/* Make the calling thread allocate from and free to arena 'n'. Arena 0
+ * is the one used by threads that never call this; any other arena is
+ * created on first use. No two threads may use one arena at the same
+ * time, but an arena can be handed on to another thread afterwards.
+ * Returns 0 on success or -1 if the arena could not be created. */
+int string_malloc_arena(const unsigned int n)
+{
+#ifndef NO_THREADS
+	struct sma_arena **arenas;
+	int ret = 0;
+
+	if (n == 0) {
+		sma_local = NULL;
+		return 0;
+	}
+
+	pthread_mutex_lock(&sma_arena_lock);
+	if (n >= sma_arena_count) {
+		arenas = (struct sma_arena **)realloc(sma_arenas, sizeof(struct sma_arena *) * (n + 1));
+		if (arenas == NULL) {
+			ret = -1;
+			goto arena_done;
+		}
+		for (unsigned int i = sma_arena_count; i <= n; i++) arenas[i] = NULL;
+		sma_arenas = arenas;
+		sma_arena_count = n + 1;
+	}
+	if (sma_arenas[n] == NULL) {
+		sma_arenas[n] = (struct sma_arena *)calloc(1, sizeof(struct sma_arena));
+		if (sma_arenas[n] == NULL) ret = -1;
+	}
+	if (ret == 0) sma_local = sma_arenas[n];
+arena_done:
+	pthread_mutex_unlock(&sma_arena_lock);
+	return ret;
+#else
+	(void)n;
+	return 0;
+#endif
+}
+
+
+/* Destroy all pages of one arena */
+static void arena_destroy(struct sma_arena * const restrict arena)
 {
 	uintptr_t *cur;
 	uintptr_t *next;
 
-	cur = sma_head;
-	if (sma_head == NULL) return;
-	while (sma_pages > 0) {
+	cur = arena->head;
+	while (arena->pages > 0) {
 		next = (uintptr_t *)*cur;
 		free(cur);
 		cur = next;
-		sma_pages--;
+		arena->pages--;
 	}
-	sma_head = NULL;
+	arena->head = NULL;
+	arena->curpage = NULL;
+	for (size_t i = 0; i < SMA_CLASSES; i++) arena->freelist[i] = NULL;
+	return;
+}
+
+
+/* Destroy all allocated pages */
+void string_malloc_destroy(void)
+{
+	arena_destroy(&sma_main);
+#ifndef NO_THREADS
+	pthread_mutex_lock(&sma_arena_lock);
+	for (unsigned int i = 1; i < sma_arena_count; i++) {
+		if (sma_arenas[i] == NULL) continue;
+		arena_destroy(sma_arenas[i]);
+		free(sma_arenas[i]);
+	}
+	free(sma_arenas);
+	sma_arenas = NULL;
+	sma_arena_count = 1;
+	pthread_mutex_unlock(&sma_arena_lock);
+	sma_local = NULL;
+#endif
 	return;
 }
 
@@ -21,6 +21,7 @@ extern uintmax_t sma_free_tails;
 extern void *string_malloc(size_t len);
 extern void string_free(void * const restrict addr);
 extern void string_malloc_destroy(void);
+extern int string_malloc_arena(const unsigned int n);
 
 #ifdef __cplusplus
 }
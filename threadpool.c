@@ -0,0 +1,262 @@
+/* jdupes worker thread pool
+ * pool_run() runs a work function over a numbered set of independent
+ * items using several threads. Items are handed out one at a time from a
+ * shared atomic counter so slow items don't hold up the rest.
+ * pool_queue_run() runs tasks that can queue more tasks (such as one
+ * directory scan finding subdirectories). Queued tasks are kept on a
+ * shared stack; idle threads take the newest task, which keeps each
+ * thread working close to where it just was in a directory tree.
+ * This file is part of jdupes; see jdupes.c for license information */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include "jdupes.h"
+#include "threadpool.h"
+
+#ifndef NO_THREADS
+#include <pthread.h>
+
+struct pool {
+  pool_work_t func;
+  void *ctx;
+  size_t items;
+  size_t next;  /* Next unclaimed item number; only updated atomically */
+};
+
+struct pool_thread {
+  pthread_t tid;
+  struct pool *pool;
+  struct pool_queue *queue;
+  unsigned int id;
+};
+#endif /* NO_THREADS */
+
+struct pool_queue {
+  pool_task_t func;
+  void **tasks;     /* Stack of queued tasks */
+  size_t count;
+  size_t max;
+  unsigned int busy;  /* Number of tasks currently running */
+#ifndef NO_THREADS
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+#endif
+};
+
+#ifndef NO_THREADS
+
+
+/* Claim and process items until none are left */
+static void pool_loop(struct pool * const restrict pool, const unsigned int id)
+{
+  size_t item;
+
+  while ((item = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED)) < pool->items)
+    pool->func(pool->ctx, item, id);
+  return;
+}
+
+
+static void *pool_thread_start(void *arg)
+{
+  struct pool_thread * const restrict pt = (struct pool_thread *)arg;
+
+  pool_loop(pt->pool, pt->id);
+  return NULL;
+}
+#endif /* NO_THREADS */
+
+
+/* Run queued tasks until the queue is empty and no task is running */
+static void pool_queue_loop(struct pool_queue * const restrict queue, const unsigned int id)
+{
+  void *task;
+
+#ifndef NO_THREADS
+  pthread_mutex_lock(&queue->lock);
+#endif
+  while (1) {
+    if (queue->count > 0) {
+      task = queue->tasks[--queue->count];
+      queue->busy++;
+#ifndef NO_THREADS
+      pthread_mutex_unlock(&queue->lock);
+#endif
+      queue->func(queue, task, id);
+#ifndef NO_THREADS
+      pthread_mutex_lock(&queue->lock);
+#endif
+      queue->busy--;
+      /* Nothing left anywhere: wake everyone so they can exit */
+#ifndef NO_THREADS
+      if (queue->count == 0 && queue->busy == 0) pthread_cond_broadcast(&queue->wake);
+#endif
+      continue;
+    }
+    /* Nothing queued and nothing running means nothing more can arrive */
+    if (queue->busy == 0) break;
+#ifndef NO_THREADS
+    pthread_cond_wait(&queue->wake, &queue->lock);
+#endif
+  }
+#ifndef NO_THREADS
+  pthread_mutex_unlock(&queue->lock);
+#endif
+  return;
+}
+
+
+#ifndef NO_THREADS
+static void *pool_queue_thread_start(void *arg)
+{
+  struct pool_thread * const restrict pt = (struct pool_thread *)arg;
+
+  pool_queue_loop(pt->queue, pt->id);
+  return NULL;
+}
+#endif /* NO_THREADS */
+
+
+/* Add a task to a running queue; safe to call from any task */
+extern void pool_queue_push(struct pool_queue * const queue, void * const task)
+{
+  void **tasks;
+
+  if (queue == NULL) nullptr("pool_queue_push()");
+#ifndef NO_THREADS
+  pthread_mutex_lock(&queue->lock);
+#endif
+  if (queue->count == queue->max) {
+    queue->max = (queue->max == 0) ? 64 : queue->max * 2;
+    tasks = (void **)realloc(queue->tasks, sizeof(void *) * queue->max);
+    if (tasks == NULL) oom("pool_queue_push()");
+    queue->tasks = tasks;
+  }
+  queue->tasks[queue->count++] = task;
+#ifndef NO_THREADS
+  pthread_cond_signal(&queue->wake);
+  pthread_mutex_unlock(&queue->lock);
+#endif
+  return;
+}
+
+
+/* Number of online CPUs, or 1 if it can't be determined */
+extern unsigned int pool_cpu_count(void)
+{
+#ifdef _SC_NPROCESSORS_ONLN
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  if (n > 0) return (unsigned int)n;
+#endif
+  return 1;
+}
+
+
+/* Run func() on every item using up to 'threads' threads, including the
+ * calling thread. Returns the number of threads actually used; if thread
+ * creation fails the remaining work is done by the threads that exist. */
+extern unsigned int pool_run(unsigned int threads, const size_t items,
+                const pool_work_t func, void * const ctx)
+{
+#ifndef NO_THREADS
+  struct pool pool;
+  struct pool_thread *pt;
+  unsigned int started = 0;
+#endif
+
+  if (func == NULL) nullptr("pool_run()");
+  if (items == 0) return 0;
+  if (threads > items) threads = (unsigned int)items;
+  LOUD(fprintf(stderr, "pool_run(%u, %" PRIuMAX ")\n", threads, (uintmax_t)items);)
+
+#ifndef NO_THREADS
+  if (threads > 1) {
+    pool.func = func;
+    pool.ctx = ctx;
+    pool.items = items;
+    pool.next = 0;
+
+    pt = (struct pool_thread *)malloc(sizeof(struct pool_thread) * threads);
+    if (pt == NULL) oom("pool_run()");
+
+    /* Thread 0 is the caller, so only start the extra threads */
+    for (started = 1; started < threads; started++) {
+      pt[started].pool = &pool;
+      pt[started].id = started;
+      if (pthread_create(&pt[started].tid, NULL, pool_thread_start, &pt[started]) != 0) {
+        LOUD(fprintf(stderr, "pool_run: pthread_create() failed, using %u threads\n", started);)
+        break;
+      }
+    }
+
+    pool_loop(&pool, 0);
+    for (unsigned int i = 1; i < started; i++) pthread_join(pt[i].tid, NULL);
+    free(pt);
+    return started;
+  }
+#endif /* NO_THREADS */
+
+  /* Single-threaded fallback */
+  for (size_t i = 0; i < items; i++) func(ctx, i, 0);
+  return 1;
+}
+
+
+/* Run func() on first_task and on every task queued by func() using up
+ * to 'threads' threads, including the calling thread. Returns the number
+ * of threads actually used. */
+extern unsigned int pool_queue_run(unsigned int threads, const pool_task_t func,
+                void * const first_task)
+{
+  struct pool_queue queue;
+#ifndef NO_THREADS
+  struct pool_thread *pt;
+#endif
+  unsigned int started = 1;
+
+  if (func == NULL) nullptr("pool_queue_run()");
+  LOUD(fprintf(stderr, "pool_queue_run(%u)\n", threads);)
+
+  queue.func = func;
+  queue.tasks = NULL;
+  queue.count = 0;
+  queue.max = 0;
+  queue.busy = 0;
+#ifndef NO_THREADS
+  pthread_mutex_init(&queue.lock, NULL);
+  pthread_cond_init(&queue.wake, NULL);
+#endif
+  pool_queue_push(&queue, first_task);
+
+#ifndef NO_THREADS
+  pt = NULL;
+  if (threads > 1) {
+    pt = (struct pool_thread *)malloc(sizeof(struct pool_thread) * threads);
+    if (pt == NULL) oom("pool_queue_run()");
+    for (; started < threads; started++) {
+      pt[started].queue = &queue;
+      pt[started].id = started;
+      if (pthread_create(&pt[started].tid, NULL, pool_queue_thread_start, &pt[started]) != 0) {
+        LOUD(fprintf(stderr, "pool_queue_run: pthread_create() failed, using %u threads\n", started);)
+        break;
+      }
+    }
+  }
+#else
+  (void)threads;
+#endif
+
+  pool_queue_loop(&queue, 0);
+
+#ifndef NO_THREADS
+  for (unsigned int i = 1; i < started; i++) pthread_join(pt[i].tid, NULL);
+  free(pt);
+  pthread_cond_destroy(&queue.wake);
+  pthread_mutex_destroy(&queue.lock);
+#endif
+  free(queue.tasks);
+  return started;
+}
@@ -0,0 +1,36 @@
+/* jdupes worker thread pool
+ * This file is part of jdupes; see jdupes.c for license information */
+
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+
+/* Work function: called once for each item number in [0, items).
+ * 'thread' is the zero-based number of the calling thread, which
+ * is always 0 for the thread that called pool_run() */
+typedef void (*pool_work_t)(void * const ctx, const size_t item,
+                const unsigned int thread);
+
+/* Task queue: tasks may queue more tasks while they run, and the queue
+ * finishes when no tasks are queued or running. */
+struct pool_queue;
+typedef void (*pool_task_t)(struct pool_queue * const queue, void * const task,
+                const unsigned int thread);
+
+extern unsigned int pool_cpu_count(void);
+extern unsigned int pool_run(unsigned int threads, const size_t items,
+                const pool_work_t func, void * const ctx);
+extern unsigned int pool_queue_run(unsigned int threads, const pool_task_t func,
+                void * const first_task);
+extern void pool_queue_push(struct pool_queue * const queue, void * const task);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* THREADPOOL_H */
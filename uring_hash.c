@@ -0,0 +1,337 @@
+/* jdupes io_uring batched partial hashing
+ * Hashing a file's first block with get_filehash() blocks on an open()
+ * and a read() for every file, which leaves a fast SSD mostly idle when
+ * there are millions of small files. This keeps up to URING_DEPTH
+ * openat()+read() requests in flight at once using io_uring, talking to
+ * the kernel with raw system calls so that liburing isn't needed.
+ *
+ * Only partial hashes are computed here. Any file that can't be handled
+ * (including every file when io_uring isn't available) is simply left
+ * without a partial hash for checkmatch() to take care of as usual.
+ * This file is part of jdupes; see jdupes.c for license information */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "jdupes.h"
+#include "jody_hash.h"
+#include "hash_provider.h"
+#include "path_intern.h"
+#include "stats.h"
+#include "uring_hash.h"
+
+/* Maximum number of files being opened or read at once */
+#ifndef URING_DEPTH
+ #define URING_DEPTH 256
+#endif
+
+/* Operation in progress, stored in the low bit of the user_data field */
+#define URING_OP_OPEN 0
+#define URING_OP_READ 1
+
+struct uring {
+  int fd;
+  unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned int *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_ptr, *cq_ptr;
+  size_t sq_len, cq_len, sqes_len;
+  unsigned int pending;  /* SQEs queued but not yet submitted */
+};
+
+struct uring_slot {
+  file_t *file;
+  char path[FILE_PATH_SIZE];  /* Must stay put until the open completes */
+  int fd;
+  unsigned int len;
+  hash_t buf[PARTIAL_HASH_SIZE / sizeof(hash_t)];
+};
+
+
+static int sys_io_uring_setup(const unsigned int entries, struct io_uring_params * const p)
+{
+#ifdef __NR_io_uring_setup
+  return (int)syscall(__NR_io_uring_setup, entries, p);
+#else
+  (void)entries; (void)p;
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+
+static int sys_io_uring_enter(const int fd, const unsigned int to_submit,
+                const unsigned int min_complete, const unsigned int enter_flags)
+{
+#ifdef __NR_io_uring_enter
+  return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, enter_flags, NULL, 0);
+#else
+  (void)fd; (void)to_submit; (void)min_complete; (void)enter_flags;
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+
+static void uring_exit(struct uring * const restrict ring)
+{
+  if (ring->sqes != NULL) munmap(ring->sqes, ring->sqes_len);
+  if (ring->cq_ptr != NULL && ring->cq_ptr != ring->sq_ptr) munmap(ring->cq_ptr, ring->cq_len);
+  if (ring->sq_ptr != NULL) munmap(ring->sq_ptr, ring->sq_len);
+  if (ring->fd >= 0) close(ring->fd);
+  return;
+}
+
+
+/* Set up a ring and map its queues; returns 0 on success or -1 */
+static int uring_init(struct uring * const restrict ring, const unsigned int entries)
+{
+  struct io_uring_params p;
+  char *sq, *cq;
+
+  memset(ring, 0, sizeof(struct uring));
+  memset(&p, 0, sizeof(p));
+  ring->fd = sys_io_uring_setup(entries, &p);
+  if (ring->fd < 0) return -1;
+
+  ring->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+  ring->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring->cq_len > ring->sq_len) ring->sq_len = ring->cq_len;
+    ring->cq_len = ring->sq_len;
+  }
+  ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (ring->sq_ptr == MAP_FAILED) goto error_map;
+  if (p.features & IORING_FEAT_SINGLE_MMAP) ring->cq_ptr = ring->sq_ptr;
+  else {
+    ring->cq_ptr = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    if (ring->cq_ptr == MAP_FAILED) goto error_map;
+  }
+  ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = (struct io_uring_sqe *)mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) goto error_map;
+
+  sq = (char *)ring->sq_ptr;
+  cq = (char *)ring->cq_ptr;
+  ring->sq_head = (unsigned int *)(void *)(sq + p.sq_off.head);
+  ring->sq_tail = (unsigned int *)(void *)(sq + p.sq_off.tail);
+  ring->sq_mask = (unsigned int *)(void *)(sq + p.sq_off.ring_mask);
+  ring->sq_array = (unsigned int *)(void *)(sq + p.sq_off.array);
+  ring->cq_head = (unsigned int *)(void *)(cq + p.cq_off.head);
+  ring->cq_tail = (unsigned int *)(void *)(cq + p.cq_off.tail);
+  ring->cq_mask = (unsigned int *)(void *)(cq + p.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(void *)(cq + p.cq_off.cqes);
+  return 0;
+
+error_map:
+  if (ring->sq_ptr == MAP_FAILED) ring->sq_ptr = NULL;
+  if (ring->cq_ptr == MAP_FAILED) ring->cq_ptr = NULL;
+  if (ring->sqes == MAP_FAILED) ring->sqes = NULL;
+  uring_exit(ring);
+  return -1;
+}
+
+
+/* Get a cleared SQE to fill in; the caller must not queue more
+ * requests than the ring has entries */
+static struct io_uring_sqe *uring_get_sqe(struct uring * const restrict ring)
+{
+  const unsigned int tail = *ring->sq_tail;
+  const unsigned int idx = tail & *ring->sq_mask;
+  struct io_uring_sqe * const sqe = &ring->sqes[idx];
+
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  ring->sq_array[idx] = idx;
+  return sqe;
+}
+
+
+/* Make the last SQE from uring_get_sqe() visible to the kernel */
+static void uring_queue_sqe(struct uring * const restrict ring)
+{
+  __atomic_store_n(ring->sq_tail, *ring->sq_tail + 1, __ATOMIC_RELEASE);
+  ring->pending++;
+  return;
+}
+
+
+static void uring_queue_open(struct uring * const restrict ring,
+                struct uring_slot * const restrict slot, const size_t id)
+{
+  struct io_uring_sqe * const sqe = uring_get_sqe(ring);
+
+  sqe->opcode = IORING_OP_OPENAT;
+  sqe->fd = AT_FDCWD;
+  sqe->addr = (uint64_t)(uintptr_t)file_path(slot->file, slot->path);
+  sqe->open_flags = O_RDONLY;
+  sqe->user_data = ((uint64_t)id << 1) | URING_OP_OPEN;
+  uring_queue_sqe(ring);
+  return;
+}
+
+
+static void uring_queue_read(struct uring * const restrict ring,
+                struct uring_slot * const restrict slot, const size_t id)
+{
+  struct io_uring_sqe * const sqe = uring_get_sqe(ring);
+
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = slot->fd;
+  sqe->addr = (uint64_t)(uintptr_t)slot->buf;
+  sqe->len = slot->len;
+  sqe->off = 0;
+  sqe->user_data = ((uint64_t)id << 1) | URING_OP_READ;
+  uring_queue_sqe(ring);
+  return;
+}
+
+
+/* Compute partial hashes for every file in the list that needs one
+ * Returns 0 if io_uring was used (even if some files were skipped) or
+ * -1 if it isn't available or stops working, in which case files may
+ * have been skipped. */
+extern int uring_hash_partial(file_t ** const restrict files, const size_t count,
+                const int * const restrict stop)
+{
+  struct uring ring;
+  struct uring_slot *slots;
+  struct rlimit rl;
+  size_t *freelist, nfree, next = 0, done = 0, total = 0, inflight = 0;
+  unsigned int depth = URING_DEPTH;
+  time_t last = 0;
+  int unsupported = 0;
+
+  if (files == NULL || stop == NULL) nullptr("uring_hash_partial()");
+  LOUD(fprintf(stderr, "uring_hash_partial(%" PRIuMAX " files)\n", (uintmax_t)count);)
+
+  for (size_t i = 0; i < count; i++)
+    if (!ISFLAG(files[i]->flags, F_HASH_PARTIAL) && files[i]->size > 0) total++;
+  if (total == 0) return 0;
+
+  /* Every request in flight holds a file descriptor open */
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY) {
+    if (rl.rlim_cur <= 64) depth = 1;
+    else if (rl.rlim_cur - 64 < depth) depth = (unsigned int)(rl.rlim_cur - 64);
+  }
+  if (total < depth) depth = (unsigned int)total;
+
+  if (uring_init(&ring, depth) != 0) {
+    LOUD(fprintf(stderr, "uring_hash_partial: io_uring_setup() failed: %s\n", strerror(errno));)
+    return -1;
+  }
+  slots = (struct uring_slot *)malloc(sizeof(struct uring_slot) * depth);
+  freelist = (size_t *)malloc(sizeof(size_t) * depth);
+  if (slots == NULL || freelist == NULL) oom("uring_hash_partial()");
+  for (nfree = 0; nfree < depth; nfree++) {
+    freelist[nfree] = nfree;
+    slots[nfree].fd = -1;
+  }
+
+  while (1) {
+    struct io_uring_cqe *cqe;
+    unsigned int head;
+
+    /* Keep the queue full of new files to open */
+    while (nfree > 0 && next < count && !*stop && !unsupported) {
+      file_t * const file = files[next++];
+      struct uring_slot * const slot = &slots[freelist[--nfree]];
+
+      if (ISFLAG(file->flags, F_HASH_PARTIAL) || file->size <= 0) {
+        nfree++;
+        continue;
+      }
+      slot->file = file;
+      slot->fd = -1;
+      slot->len = (file->size > PARTIAL_HASH_SIZE) ? PARTIAL_HASH_SIZE : (unsigned int)file->size;
+      uring_queue_open(&ring, slot, (size_t)(slot - slots));
+      inflight++;
+    }
+    if (inflight == 0) break;
+
+    /* Submit everything queued and wait for at least one completion */
+    if (sys_io_uring_enter(ring.fd, ring.pending, 1, IORING_ENTER_GETEVENTS) < 0) {
+      if (errno == EINTR || errno == EAGAIN || errno == EBUSY) continue;
+      /* The ring is unusable, so in-flight requests can't be reaped; the
+       * files without a partial hash are left to the usual hashing */
+      LOUD(fprintf(stderr, "uring_hash_partial: io_uring_enter() failed: %s\n", strerror(errno));)
+      uring_exit(&ring);
+      for (size_t i = 0; i < depth; i++) if (slots[i].fd != -1) close(slots[i].fd);
+      free(freelist);
+      /* The kernel may still be writing to the read buffers of requests
+       * that were in flight, so the slots are deliberately not freed */
+      return -1;
+    }
+    ring.pending = 0;
+
+    head = *ring.cq_head;
+    while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+      size_t id;
+      struct uring_slot *slot;
+
+      cqe = &ring.cqes[head & *ring.cq_mask];
+      id = (size_t)(cqe->user_data >> 1);
+      slot = &slots[id];
+      head++;
+
+      if ((cqe->user_data & 1) == URING_OP_OPEN) {
+        if (cqe->res >= 0) STATS(stats_add_opens(1);)
+        if (cqe->res >= 0 && !*stop) {
+          slot->fd = cqe->res;
+          uring_queue_read(&ring, slot, id);
+          continue;
+        }
+        if (cqe->res >= 0) close(cqe->res);
+        /* Kernels before 5.6 don't know about IORING_OP_OPENAT */
+        else if (cqe->res == -EINVAL) unsupported = 1;
+      } else {
+        if (cqe->res == (int)slot->len && !*stop) {
+          hash_state_t hs;
+          uint64_t ext;
+
+          STATS(stats_add_files(1); stats_add_bytes(slot->len);)
+          hash_provider->init(&hs, 0);
+          hash_provider->update(&hs, slot->buf, slot->len);
+          slot->file->filehash_partial = hash_provider->final(&hs, &ext);
+          SET_HASH_EXT(slot->file->filehash_partial_ext, ext);
+          SETFLAG(slot->file->flags, F_HASH_PARTIAL);
+        }
+        close(slot->fd);
+        slot->fd = -1;
+      }
+
+      /* Request finished one way or another */
+      freelist[nfree++] = id;
+      inflight--;
+      done++;
+    }
+    __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+
+    if (!ISFLAG(flags, F_HIDEPROGRESS) && time(NULL) != last) {
+      last = time(NULL);
+      fprintf(stderr, "\rHashing: %" PRIuMAX "/%" PRIuMAX " files (partial)         ",
+          (uintmax_t)done, (uintmax_t)total);
+      fflush(stderr);
+    }
+  }
+
+  if (!ISFLAG(flags, F_HIDEPROGRESS) && last != 0) fprintf(stderr, "\r%60s\r", " ");
+  LOUD(if (unsupported) fprintf(stderr, "uring_hash_partial: IORING_OP_OPENAT not supported\n");)
+  free(freelist);
+  free(slots);
+  uring_exit(&ring);
+  return unsupported ? -1 : 0;
+}
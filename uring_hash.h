@@ -0,0 +1,20 @@
+/* jdupes io_uring batched partial hashing
+ * This file is part of jdupes; see jdupes.c for license information */
+
+#ifndef URING_HASH_H
+#define URING_HASH_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "jdupes.h"
+
+extern int uring_hash_partial(file_t ** const restrict files, const size_t count,
+                const int * const restrict stop);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* URING_HASH_H */